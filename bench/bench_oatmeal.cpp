@@ -0,0 +1,282 @@
+/*
+  bench_oatmeal.cpp
+  Copyright 2019, Shield Diagnostics and the Oatmeal Protocol contributors
+  License: Apache 2.0
+
+  Benchmarks of the formatting, parsing, checksum and OatmealPort send/receive
+  paths. Built for three targets (see bench/Makefile):
+
+  - avr:     ATmega2560 under simavr, timed in CPU cycles with Timer1
+  - cortexm: Cortex-M3 (mps2-an385) under QEMU, timed with SysTick
+  - host:    the build machine, timed in nanoseconds
+
+  Each benchmark repeats an operation and reports the cost per operation and
+  per frame byte.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <Arduino.h>
+#include "oatmeal_protocol.h"
+
+#if defined(__AVR__)
+  #include <avr/io.h>
+  #include <avr/sleep.h>
+  #define BENCH_UNIT "cycles"
+  #define BENCH_REPS 20
+#elif defined(__arm__)
+  #ifdef BENCH_TICK_SCALE
+    /* QEMU isn't cycle accurate: run with `-icount shift=0` so that time
+       advances 1ns per instruction, and scale SysTick ticks (core clock) by
+       the number of nanoseconds per tick to count instructions */
+    #define BENCH_UNIT "insns"
+  #else
+    #define BENCH_UNIT "cycles"
+    #define BENCH_TICK_SCALE 1
+  #endif
+  #define BENCH_REPS 100
+#else
+  #include <chrono>
+  #define BENCH_UNIT "ns"
+  #define BENCH_REPS 10000
+#endif
+
+#ifndef __AVR__
+int *__brkval = nullptr;  /* top of the heap, provided by avr-libc on AVR */
+#endif
+
+HardwareSerial Serial, Serial1;
+
+static unsigned long bench_time_us = 0;
+unsigned long millis() { return bench_time_us / 1000; }
+unsigned long micros() { return bench_time_us; }
+void set_time(unsigned long now_us) { bench_time_us = now_us; }
+
+
+/* ---------- Platform specific timers and output ---------- */
+
+#if defined(__AVR__)
+
+/* Timer1 counts CPU cycles (no prescaler); overflows extend it to 32 bits */
+static volatile uint16_t timer1_overflows = 0;
+ISR(TIMER1_OVF_vect) { timer1_overflows++; }
+
+static uint32_t bench_now() {
+  uint8_t sreg = SREG;
+  cli();
+  uint16_t lo = TCNT1;
+  uint16_t hi = timer1_overflows;
+  /* Overflowed since interrupts were disabled, but not yet counted */
+  if ((TIFR1 & _BV(TOV1)) && lo < 0x8000) { hi++; }
+  SREG = sreg;
+  return (static_cast<uint32_t>(hi) << 16) | lo;
+}
+
+/* simavr prints bytes written to UART0 */
+static int uart_putchar(char c, FILE *stream) {
+  (void)stream;
+  loop_until_bit_is_set(UCSR0A, UDRE0);
+  UDR0 = c;
+  return 0;
+}
+static FILE uart_out;
+
+static void bench_init() {
+  UBRR0 = 0;
+  UCSR0B = _BV(TXEN0);
+  fdev_setup_stream(&uart_out, uart_putchar, NULL, _FDEV_SETUP_WRITE);
+  stdout = &uart_out;
+  TCCR1A = 0;
+  TCCR1B = _BV(CS10);
+  TIMSK1 = _BV(TOIE1);
+  sei();
+}
+
+/* simavr exits when the CPU sleeps with interrupts disabled */
+static void bench_exit() {
+  loop_until_bit_is_set(UCSR0A, TXC0);
+  cli();
+  sleep_cpu();
+}
+
+#elif defined(__arm__)
+
+/* SysTick, clocked by the core, counts down 24 bits; overflows extend it */
+#define SYST_CSR (*reinterpret_cast<volatile uint32_t*>(0xE000E010))
+#define SYST_RVR (*reinterpret_cast<volatile uint32_t*>(0xE000E014))
+#define SYST_CVR (*reinterpret_cast<volatile uint32_t*>(0xE000E018))
+static volatile uint32_t systick_overflows = 0;
+extern "C" void SysTick_Handler() { systick_overflows++; }
+
+static uint32_t bench_now() {
+  uint32_t hi, cv;
+  do {
+    hi = systick_overflows;
+    cv = SYST_CVR;
+  } while (hi != systick_overflows);
+  return ((hi << 24) + (0xFFFFFF - cv)) * BENCH_TICK_SCALE;
+}
+
+static void bench_init() {
+  SYST_RVR = 0xFFFFFF;
+  SYST_CVR = 0;
+  SYST_CSR = 0x7;  /* enable, interrupt, core clock */
+}
+
+/* Semihosting exit ends the QEMU process */
+static void bench_exit() { exit(0); }
+
+/* Vector table: initial stack pointer, reset (newlib's crt0) and SysTick */
+extern "C" {
+extern uint32_t __stack_top;
+void _start();
+static void default_handler() { while (1) {} }
+__attribute__((section(".isr_vector"), used))
+void (* const vectors[16])() = {
+  reinterpret_cast<void (*)()>(&__stack_top), _start,
+  default_handler, default_handler, default_handler, default_handler,
+  default_handler, nullptr, nullptr, nullptr, nullptr,
+  default_handler, default_handler, nullptr, default_handler, SysTick_Handler
+};
+}
+
+#else
+
+static uint32_t bench_now() {
+  using namespace std::chrono;
+  static const steady_clock::time_point t0 = steady_clock::now();
+  return duration_cast<nanoseconds>(steady_clock::now() - t0).count();
+}
+
+static void bench_init() {}
+static void bench_exit() {}
+
+#endif
+
+
+/* ---------- Reporting ---------- */
+
+/** Print the cost of `reps` runs of an operation over `n_bytes` frame bytes.
+Costs per byte are printed with one decimal place, using integer maths so
+AVR builds don't need floating point printf. */
+static void report(const char *name, uint32_t elapsed, uint16_t reps,
+                   size_t n_bytes) {
+  uint32_t per_op = elapsed / reps;
+  unsigned long per_byte_x10 =
+    n_bytes ? (elapsed * 10UL) / (static_cast<uint32_t>(reps) * n_bytes) : 0;
+  printf("%-22s %8lu %s/op %6lu.%lu %s/byte\n", name,
+         static_cast<unsigned long>(per_op), BENCH_UNIT,
+         per_byte_x10 / 10, per_byte_x10 % 10, BENCH_UNIT);
+}
+
+/* Keep the compiler from optimizing away results */
+static volatile size_t sink;
+
+#define BENCH(name, n_bytes, ...) do { \
+    uint32_t _t0 = bench_now(); \
+    for (uint16_t _i = 0; _i < BENCH_REPS; _i++) { __VA_ARGS__; } \
+    report(name, bench_now() - _t0, BENCH_REPS, n_bytes); \
+  } while (0)
+
+
+/* ---------- Benchmarks ---------- */
+
+static void build_msg(OatmealMsg *msg) {
+  msg->start("TST", 'R', "ab");
+  msg->append(static_cast<int32_t>(-123456));
+  msg->append(3.14159f);
+  msg->append("valve \"open\"");
+  msg->append(true);
+  msg->append_list_start();
+  for (int16_t i = 1; i < 10000; i *= 10) { msg->append(i); }
+  msg->append_list_end();
+  msg->finish();
+}
+
+static void bench_fmt() {
+  char buf[32];
+  BENCH("fmt int32", 11,
+        sink = OatmealFmt::format(buf, sizeof(buf),
+                                  static_cast<int32_t>(-1234567890)));
+  BENCH("fmt float", 9,
+        sink = OatmealFmt::format(buf, sizeof(buf), 3.14159f, 6));
+  BENCH("fmt str", 16,
+        sink = OatmealFmt::format(buf, sizeof(buf), "valve \"open\""));
+}
+
+static void bench_checksum(const OatmealMsg &msg) {
+  BENCH("checksum", msg.length(),
+        sink = OatmealMsg::compute_checksum(msg.frame(), msg.length()));
+}
+
+static void bench_msg(const OatmealMsg &ref) {
+  OatmealMsg msg;
+  BENCH("msg build", ref.length(), build_msg(&msg); sink = msg.length());
+}
+
+static void bench_parse(const OatmealMsg &msg) {
+  OatmealArgParser parser;
+  int32_t i;
+  float f;
+  char str[16];
+  bool b;
+  int16_t list[4];
+  size_t list_len;
+  BENCH("parse args", msg.length(),
+        parser.start(msg, "TSTR");
+        parser.parse_arg(&i);
+        parser.parse_arg(&f);
+        parser.parse_str(str, sizeof(str));
+        parser.parse_arg(&b);
+        parser.parse_list(list, &list_len, 4);
+        sink = parser.finished());
+}
+
+static size_t port_send(OatmealPort *port) {
+  size_t n = port->start("TST", 'R', "ab") +
+             port->append(static_cast<int32_t>(-123456)) +
+             port->append(3.14159f) +
+             port->append("valve \"open\"") +
+             port->append(true) +
+             port->append_list_start();
+  for (int16_t i = 1; i < 10000; i *= 10) { n += port->append(i); }
+  return n + port->append_list_end() + port->finish();
+}
+
+static void bench_port(const OatmealMsg &msg) {
+  OatmealPort port(&Serial, "Bench");
+
+  size_t n_tx = Serial.n_tx;
+  port_send(&port);
+  size_t n_sent = Serial.n_tx - n_tx;
+  BENCH("port send", n_sent, sink = port_send(&port));
+
+  /* Receive a burst of frames per run, as after a busy period */
+  const uint8_t n_frames = 4;
+  char rx[n_frames * (OatmealMsg::MAX_MSG_LEN+1)];
+  size_t rx_len = 0;
+  for (uint8_t j = 0; j < n_frames; j++) {
+    memcpy(rx+rx_len, msg.frame(), msg.length());
+    rx_len += msg.length();
+  }
+  BENCH("port recv 4 frames", rx_len,
+        Serial.feed(rx, rx_len);
+        for (uint8_t j = 0; j < n_frames; j++) { sink = port.recv(); });
+}
+
+int main() {
+  bench_init();
+
+  OatmealMsg msg;
+  build_msg(&msg);
+  printf("Oatmeal benchmarks, %u reps, frame: %s\n", BENCH_REPS, msg.frame());
+
+  bench_fmt();
+  bench_checksum(msg);
+  bench_msg(msg);
+  bench_parse(msg);
+  bench_port(msg);
+
+  bench_exit();
+  return 0;
+}
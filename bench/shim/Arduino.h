@@ -0,0 +1,92 @@
+/*
+  Arduino.h
+  Copyright 2019, Shield Diagnostics and the Oatmeal Protocol contributors
+  License: Apache 2.0
+
+  The parts of the Arduino core used by the Oatmeal library, for running the
+  benchmarks on bare-metal simulators (simavr, QEMU) and on the host, and for
+  the OatmealPort unit tests (tests/test_oatmeal_protocol.cpp).
+  `HardwareSerial` reads from and writes to memory rather than a UART, so that
+  benchmarks time the library rather than the baud rate.
+*/
+
+#ifndef OATMEAL_BENCH_ARDUINO_H_
+#define OATMEAL_BENCH_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __AVR__
+  #include <avr/interrupt.h>
+  #include <avr/pgmspace.h>
+  inline void noInterrupts() { cli(); }
+  inline void interrupts() { sei(); }
+#else
+  #define PROGMEM
+  #define PSTR(s) (s)
+  #define pgm_read_byte(addr) (*reinterpret_cast<const uint8_t*>(addr))
+  inline void noInterrupts() {}
+  inline void interrupts() {}
+#endif
+
+class __FlashStringHelper;
+#define F(str) (reinterpret_cast<const __FlashStringHelper*>(PSTR(str)))
+
+template<typename T> inline T min(T a, T b) { return a < b ? a : b; }
+template<typename T> inline T max(T a, T b) { return a > b ? a : b; }
+
+/** Time in the benchmarks does not advance on its own; set with `set_time` */
+unsigned long millis();
+unsigned long micros();
+void set_time(unsigned long now_us);
+
+/** A stream backed by memory. Bytes written are counted, and copied into
+`tx_buf` if set until it is full. */
+class Stream {
+ public:
+  const char *rx = nullptr;
+  size_t rx_len = 0;
+  size_t n_tx = 0;
+  char *tx_buf = nullptr;
+  size_t tx_cap = 0;
+
+  /** Set the bytes to be read next */
+  void feed(const char *data, size_t len) { rx = data; rx_len = len; }
+
+  /** Copy the bytes written from now on into `buf`, e.g. to feed them to
+  another stream */
+  void capture(char *buf, size_t cap) { tx_buf = buf; tx_cap = cap; n_tx = 0; }
+
+  int available() { return static_cast<int>(rx_len); }
+  int read() {
+    if (!rx_len) { return -1; }
+    rx_len--;
+    return static_cast<uint8_t>(*(rx++));
+  }
+  size_t readBytes(char *buf, size_t n) {
+    if (n > rx_len) { n = rx_len; }
+    memcpy(buf, rx, n);
+    rx += n; rx_len -= n;
+    return n;
+  }
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buf, size_t n) {
+    if (tx_buf != nullptr && n_tx + n <= tx_cap) { memcpy(tx_buf + n_tx, buf, n); }
+    n_tx += n;
+    return n;
+  }
+  size_t write(const char *buf, size_t n) {
+    return write(reinterpret_cast<const uint8_t*>(buf), n);
+  }
+  void flush() {}
+};
+
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long baud) { (void)baud; }
+};
+
+extern HardwareSerial Serial, Serial1;
+
+#endif  /* OATMEAL_BENCH_ARDUINO_H_ */
@@ -79,6 +79,12 @@ def main():
     all_vals = device.get_all_vals()
     print("x = %r, y = %r, z = %r" % (all_vals[0], all_vals[1], all_vals[2]))
 
+    # Set and get many values in a single round trip with the device's
+    # variable registry
+    device.set_vars({"x": 1, "y": 2, "z": 3})
+    print("x, y = %r" % (device.get_vars("x", "y")))
+    print("all = %r" % (device.dump_vars()))
+
     # Shut down the device here
     device.stop()
 
@@ -18,14 +18,20 @@ unsigned long prev_loop_start, max_loop_ms = 0;
 // In this example we store three ints on the board: x, y & z
 int32_t x, y, z;
 
+// The same variables can be got and set in bulk with the built-in VGTR, VSTR
+// and VDMR commands, once registered
+OatmealVarRegistry vars;
+
 
 void send_heartbeat() {
   OatmealMsg hb_msg;
 
   hb_msg.start("HRT", 'B', port.next_token());
+  hb_msg.append_dict_start();
   port.build_status_heartbeat(&hb_msg, max_loop_ms);
   hb_msg.append_dict_key_value("a", 5.1);
   hb_msg.append_dict_key_value("b", "hi");
+  hb_msg.append_dict_end();
   hb_msg.finish();
   port.send(hb_msg);
 
@@ -93,6 +99,12 @@ void setup() {
   // Must initialize the port to set up UART
   port.init();
 
+  // Register variables for bulk get/set
+  vars.add("x", &x);
+  vars.add("y", &y);
+  vars.add("z", &z);
+  port.set_var_registry(&vars);
+
   // Set up heartbeat timer to send a heartbeat every 500 milliseconds
   port.set_heartbeats_period(500);
   port.set_heartbeats_on(true);
@@ -8,12 +8,18 @@ and dictionaries.
 
 from .protocol import \
     OatmealError, OatmealTimeout, OatmealParseError, \
-    OatmealMsg, OatmealStats, OatmealProtocol, \
+    OatmealMsg, OatmealStats, OatmealProtocol, OatmealSampleBatch, \
+    OatmealClockSync, OatmealLatencyStats, OatmealBurstResult, \
     OatmealBgMsgHandlerBase, OatmealBgMsgHandler, \
-    OatmealDeviceDetails, OatmealPort, OATMEAL_BAUD_RATE
+    OatmealDeviceDetails, OatmealPort, OatmealCaptureMirror, \
+    OATMEAL_BAUD_RATE
 from .device import OatmealDevice, DeviceError, \
                     find_devices, detect_all_devices, \
-                    open_device, close_devices
+                    open_device, close_devices, OatmealDeviceCache
+from .timeseries import OatmealTimeSeriesStore, OatmealSeriesPoint
+from .metrics import OatmealMetrics, OatmealMetricsServer
+from .pool import OatmealWorkerPool
+from .hotplug import OatmealDeviceWatcher
 
 name = "oatmeal"
 
@@ -24,10 +30,15 @@ __all__ = [
     "OatmealMsg",
     "OatmealStats",
     "OatmealProtocol",
+    "OatmealSampleBatch",
+    "OatmealClockSync",
+    "OatmealLatencyStats",
+    "OatmealBurstResult",
     "OatmealBgMsgHandlerBase",
     "OatmealBgMsgHandler",
     "OatmealDeviceDetails",
     "OatmealPort",
+    "OatmealCaptureMirror",
     "OATMEAL_BAUD_RATE",
     "DeviceError",
     "OatmealDevice",
@@ -35,4 +46,11 @@ __all__ = [
     "detect_all_devices",
     "open_device",
     "close_devices",
+    "OatmealDeviceCache",
+    "OatmealTimeSeriesStore",
+    "OatmealSeriesPoint",
+    "OatmealMetrics",
+    "OatmealMetricsServer",
+    "OatmealWorkerPool",
+    "OatmealDeviceWatcher",
 ]
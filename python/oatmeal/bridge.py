@@ -0,0 +1,360 @@
+#!/usr/bin/env python3
+
+# bridge.py
+# Copyright 2019, Shield Diagnostics and the Oatmeal Protocol contributors
+# License: Apache 2.0
+
+"""
+Share Oatmeal devices between several local processes. The bridge owns each
+serial port and exposes the device on a Unix-domain socket. Any number of
+clients can connect to the socket and send requests concurrently: tokens are
+remapped so that requests from different clients never collide, and
+responses are routed back to the client that sent the request. Background
+messages such as heartbeats are sent to every client. Usage::
+
+    python3 -m oatmeal.bridge /dev/ttyUSB0 /dev/ttyUSB1 --socket-dir /tmp
+
+Clients connect with :class:`OatmealBridgeClient`, which can be used in place
+of a serial port::
+
+    port = OatmealPort(OatmealBridgeClient("/tmp/ttyUSB0.sock"))
+"""
+
+from typing import Dict, List, Optional, Tuple
+from collections import OrderedDict
+from multiprocessing import Pipe
+from threading import Thread, Event, Lock
+import argparse
+import logging
+import os
+import socket
+import string
+
+import serial
+
+from .protocol import OatmealMsg, OatmealStats, OatmealProtocol, \
+                      OatmealDataMirror, OATMEAL_BAUD_RATE
+from .metrics import OatmealMetrics, OatmealMetricsServer
+
+
+def split_frames(buf: bytearray) -> Tuple[List[bytearray], bytearray]:
+    """
+    Split complete frames off the front of a stream of bytes. Bytes before a
+    frame start byte are discarded.
+
+    Returns:
+        (frames, remainder) where remainder is the start of an incomplete frame
+    """
+    frames = []  # type: List[bytearray]
+    start = buf.find(OatmealMsg.FRAME_START_BYTE)
+    while start >= 0:
+        end = buf.find(OatmealMsg.FRAME_END_BYTE, start)
+        if end < 0 or end + 2 >= len(buf):
+            return frames, buf[start:]
+        # A start byte before the end byte means the frame was cut short
+        restart = buf.rfind(OatmealMsg.FRAME_START_BYTE, start, end)
+        frames.append(buf[restart:end+3])
+        start = buf.find(OatmealMsg.FRAME_START_BYTE, end+3)
+    return frames, bytearray()
+
+
+class OatmealTokenRouter:
+    """
+    Maps the tokens of requests from several clients onto tokens that are
+    unique on the link to a device, and maps the responses back.
+
+    Routes are kept until the client disconnects or the route is one of the
+    `max_routes` least recently used, so that multi-part responses (e.g. ack.
+    then done) and long-running jobs are still routed. A client resending a
+    request with the same token while its route exists is given the same
+    device token, so devices with a replay cache still see a retransmission.
+    """
+
+    TOKEN_CHARS = string.ascii_letters
+
+    def __init__(self, max_routes: int = 512) -> None:
+        assert max_routes < len(self.TOKEN_CHARS)**2
+        self.max_routes = max_routes
+        # device token -> (client id, client token, command)
+        self.routes = OrderedDict()  # type: OrderedDict
+        # (client id, client token) -> device token
+        self.reverse = {}  # type: Dict[Tuple[int, str], str]
+        self.next_id = 0
+        self.lock = Lock()
+
+    def _new_token(self) -> str:
+        letters = self.TOKEN_CHARS
+        while True:
+            t = self.next_id
+            self.next_id = (self.next_id + 1) % (len(letters)**2)
+            token = letters[t // len(letters)] + letters[t % len(letters)]
+            if token not in self.routes:
+                return token
+
+    def _drop(self, token: str) -> None:
+        client_id, client_token, _ = self.routes.pop(token)
+        del self.reverse[(client_id, client_token)]
+
+    def to_device(self, client_id: int, msg: OatmealMsg) -> str:
+        """
+        Get the token to send request `msg` from client `client_id` to the
+        device with.
+        """
+        key = (client_id, msg.token)
+        with self.lock:
+            token = self.reverse.get(key)
+            if token is not None and self.routes[token][2] == msg.command:
+                self.routes.move_to_end(token)
+                return token
+            if token is not None:
+                self._drop(token)
+            while len(self.routes) >= self.max_routes:
+                self._drop(next(iter(self.routes)))
+            token = self._new_token()
+            self.routes[token] = (client_id, msg.token, msg.command)
+            self.reverse[key] = token
+            return token
+
+    def to_client(self, msg: OatmealMsg) -> Optional[Tuple[int, str]]:
+        """
+        Find the client that message `msg` from the device is for.
+
+        Background messages are only routed if they belong to the routed
+        request (same command, e.g. `BSTB` for `BSTR`), since devices issue
+        their own tokens for unsolicited messages.
+
+        Returns:
+            (client id, client token) or `None` if no client sent the request
+        """
+        with self.lock:
+            route = self.routes.get(msg.token)
+            if route is None or (msg.flag == OatmealProtocol.BACKGROUND_MSG_FLAG
+                                 and route[2] != msg.command):
+                return None
+            return route[0], route[1]
+
+    def drop_client(self, client_id: int) -> None:
+        """ Forget all routes for a client that has disconnected """
+        with self.lock:
+            for token in [t for t, r in self.routes.items()
+                          if r[0] == client_id]:
+                self._drop(token)
+
+
+class OatmealBridge:
+    """
+    Serve one Oatmeal device, connected over a serial port, to any number of
+    clients connected to a Unix-domain socket.
+
+    Frames from clients are validated before they are forwarded, so a
+    misbehaving client cannot corrupt the link for the others.
+    """
+
+    def __init__(self, serial_port, socket_path: str, *,
+                 data_mirror: OatmealDataMirror = None,
+                 max_frame_len: int = OatmealMsg.DEFAULT_MAX_FRAME_LEN,
+                 max_routes: int = 512) -> None:
+        self.serial_port = serial_port
+        self.socket_path = socket_path
+        self.data_mirror = data_mirror
+        self.max_frame_len = max_frame_len
+        self.router = OatmealTokenRouter(max_routes)
+
+        # stats on frames from the device and from the clients
+        self.device_stats = OatmealStats()
+        self.client_stats = OatmealStats()
+        self.n_unroutable = 0
+
+        self.exit_token = Event()
+        self.out_pipe_uart, self.out_pipe = Pipe(duplex=False)
+        self.out_lock = Lock()
+        self.clients = {}  # type: Dict[int, socket.socket]
+        self.clients_lock = Lock()
+        self.n_clients_seen = 0
+
+        if os.path.exists(socket_path):
+            os.unlink(socket_path)
+        self.listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.listener.bind(socket_path)
+        self.listener.listen()
+        self.listener.settimeout(0.1)
+
+        self.threads = [Thread(target=self._device_loop, daemon=True),
+                        Thread(target=self._accept_loop, daemon=True)]
+
+    def start(self) -> None:
+        """ Start serving the device """
+        logging.info("Bridging %s to %s", self.serial_port.name,
+                     self.socket_path)
+        for thread in self.threads:
+            thread.start()
+
+    def stop(self) -> None:
+        """ Disconnect all clients and close the serial port and socket """
+        self.exit_token.set()
+        for thread in self.threads:
+            thread.join()
+        with self.clients_lock:
+            for conn in self.clients.values():
+                conn.close()
+            self.clients.clear()
+        self.listener.close()
+        os.unlink(self.socket_path)
+        self.serial_port.close()
+        self.device_stats.log_stats()
+
+    def _send_to_device(self, msg: OatmealMsg) -> None:
+        with self.out_lock:
+            self.out_pipe.send(msg.encode())
+
+    def _send_to_client(self, client_id: int, msg: OatmealMsg) -> None:
+        with self.clients_lock:
+            conn = self.clients.get(client_id)
+        if conn is not None:
+            try:
+                conn.sendall(msg.encode() + b'\n')
+            except OSError:
+                logging.info("Client %i write failed", client_id)
+
+    def _device_loop(self) -> None:
+        """ Route messages from the device to the clients """
+        msg_iter = OatmealProtocol.read_frame_loop(
+            self.serial_port, self.exit_token, self.out_pipe_uart,
+            self.data_mirror, self.device_stats, self.max_frame_len)
+        for msg in msg_iter:
+            route = self.router.to_client(msg)
+            if route is not None:
+                msg.token = route[1]
+                self._send_to_client(route[0], msg)
+            elif msg.flag == OatmealProtocol.BACKGROUND_MSG_FLAG:
+                with self.clients_lock:
+                    client_ids = list(self.clients)
+                for client_id in client_ids:
+                    self._send_to_client(client_id, msg)
+            else:
+                logging.warning("No client for response %r", msg)
+                self.n_unroutable += 1
+
+    def _accept_loop(self) -> None:
+        while not self.exit_token.is_set():
+            try:
+                conn, _ = self.listener.accept()
+            except socket.timeout:
+                continue
+            conn.settimeout(0.1)
+            with self.clients_lock:
+                client_id = self.n_clients_seen
+                self.n_clients_seen += 1
+                self.clients[client_id] = conn
+            logging.info("Client %i connected to %s", client_id,
+                         self.socket_path)
+            Thread(target=self._client_loop, args=(client_id, conn),
+                   daemon=True).start()
+
+    def _client_loop(self, client_id: int, conn: socket.socket) -> None:
+        """ Validate and forward requests from a client to the device """
+        buf = bytearray()
+        while not self.exit_token.is_set():
+            try:
+                data = conn.recv(4096)
+            except socket.timeout:
+                continue
+            except OSError:
+                break
+            if not data:
+                break
+            buf += data
+            frames, buf = split_frames(buf)
+            for frame in frames:
+                msg = OatmealProtocol.convert_frame(frame, self.client_stats,
+                                                    self.max_frame_len)
+                if msg is not None:
+                    msg.token = self.router.to_device(client_id, msg)
+                    self._send_to_device(msg)
+        logging.info("Client %i disconnected", client_id)
+        with self.clients_lock:
+            self.clients.pop(client_id, None)
+        self.router.drop_client(client_id)
+        conn.close()
+
+
+class OatmealBridgeClient:
+    """
+    Connection to a device served by an :class:`OatmealBridge`, that can be
+    passed to :class:`OatmealPort` in place of a serial port.
+    """
+
+    def __init__(self, socket_path: str) -> None:
+        self.name = socket_path
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(socket_path)
+        self.sock.setblocking(False)
+        self.buf = bytearray()
+
+    @property
+    def in_waiting(self) -> int:
+        """ Number of bytes that can be read without blocking """
+        try:
+            self.buf += self.sock.recv(4096)
+        except (BlockingIOError, InterruptedError):
+            pass
+        return len(self.buf)
+
+    def read(self, n: int) -> bytes:
+        data = bytes(self.buf[:n])
+        del self.buf[:n]
+        return data
+
+    def write(self, data: bytes) -> int:
+        self.sock.sendall(data)
+        return len(data)
+
+    def close(self) -> None:
+        self.sock.close()
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(
+        description="Share Oatmeal devices between processes over "
+                    "Unix-domain sockets.")
+    parser.add_argument("paths", nargs="+",
+                        help="serial ports devices are connected to")
+    parser.add_argument("--baud", type=int, default=OATMEAL_BAUD_RATE,
+                        help="baud rate (default: %(default)s)")
+    parser.add_argument("--socket-dir", default="/tmp",
+                        help="directory to create <port name>.sock sockets "
+                             "in (default: %(default)s)")
+    parser.add_argument("--metrics-port", type=int,
+                        help="serve link statistics in the OpenMetrics "
+                             "format on this localhost TCP port")
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.INFO)
+
+    bridges = []
+    metrics = OatmealMetrics()
+    for path in args.paths:
+        serial_fh = serial.Serial(path, args.baud, timeout=0,
+                                  write_timeout=0.1, exclusive=True)
+        socket_path = os.path.join(args.socket_dir,
+                                   os.path.basename(path) + ".sock")
+        bridges.append(OatmealBridge(serial_fh, socket_path))
+        metrics.add_bridge(os.path.basename(path), bridges[-1])
+    server = None
+    if args.metrics_port is not None:
+        server = OatmealMetricsServer(metrics, ('127.0.0.1', args.metrics_port))
+        server.start()
+    for bridge in bridges:
+        bridge.start()
+    try:
+        Event().wait()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if server is not None:
+            server.stop()
+        for bridge in bridges:
+            bridge.stop()
+
+
+if __name__ == '__main__':
+    main()
@@ -4,14 +4,17 @@
 # Copyright 2019, Shield Diagnostics and the Oatmeal Protocol contributors
 # License: Apache 2.0
 
-from typing import Union, Tuple, Dict, List, Type, TypeVar, Optional
+from typing import Union, Tuple, Dict, List, Type, TypeVar, Optional, Any
 import serial.tools.list_ports
 from serial import SerialException
+from threading import Lock
 import logging
 import time
 import functools
+import json
 import serial
 import os
+import tempfile
 
 from .protocol import OatmealMsg, OatmealPort, OatmealBgMsgHandler, \
                       OatmealDeviceDetails, OATMEAL_BAUD_RATE, \
@@ -43,6 +46,15 @@ class OatmealDevice(OatmealBgMsgHandler):
     """ Warn if the time between heartbeats is greater than this time (seconds).
     If set to None, don't warn if no heartbeats seen. """
 
+    RETRY_SAME_TOKEN = False
+    """ Resend requests with the same token after a missed ack. Set to True for
+    devices that use a replay cache, so retries are not handled twice. """
+
+    identity_verified = True  # type: Optional[bool]
+    """ Whether the device confirmed `details` in response to a discovery
+    request. Devices opened from an :class:`OatmealDeviceCache` are None until
+    a check in the background sets this to True or False. """
+
     def __init__(self, *,
                  details: OatmealDeviceDetails,
                  port: OatmealPort = None,
@@ -58,7 +70,8 @@ class OatmealDevice(OatmealBgMsgHandler):
             self.port = OatmealPort(serial_fh,
                                     mirror_data=mirror_data,
                                     bg_msg_handler=self,
-                                    max_frame_len=max_frame_len)
+                                    max_frame_len=max_frame_len,
+                                    retry_same_token=self.RETRY_SAME_TOKEN)
 
     @classmethod
     def create(cls: Type[OatmealDevice_T], uart_path: str,
@@ -144,6 +157,33 @@ class OatmealDevice(OatmealBgMsgHandler):
         """
         return self.port.ask_who(timeout=timeout, n_retries=n_retries)
 
+    def sync_clock(self, timeout: float = OatmealPort.DEFAULT_ACK_TIMEOUT_SEC) \
+            -> bool:
+        """ Wrapper for :meth:`OatmealPort.sync_clock()` """
+        return self.port.sync_clock(timeout=timeout)
+
+    def get_vars(self, *names: str) -> Dict[str, Any]:
+        """ Wrapper for :meth:`OatmealPort.get_vars()` """
+        return self.port.get_vars(*names)
+
+    def set_vars(self, values: Dict[str, Any]) -> None:
+        """ Wrapper for :meth:`OatmealPort.set_vars()` """
+        self.port.set_vars(values)
+
+    def dump_vars(self) -> Dict[str, Any]:
+        """ Wrapper for :meth:`OatmealPort.dump_vars()` """
+        return self.port.dump_vars()
+
+    def watch_vars(self, *names: str, deadband: float = 0.0,
+                   min_interval: float = 0.1) -> None:
+        """ Wrapper for :meth:`OatmealPort.watch_vars()` """
+        self.port.watch_vars(*names, deadband=deadband,
+                             min_interval=min_interval)
+
+    def unwatch_vars(self, *names: str) -> None:
+        """ Wrapper for :meth:`OatmealPort.unwatch_vars()` """
+        self.port.unwatch_vars(*names)
+
     def halt(self) -> None:
         """
         Halt whatever the device is doing
@@ -235,7 +275,9 @@ def open_device(uart_path: str,
                 *,
                 baud_rate: int = None,
                 raise_on_unknown_role: bool = False,
-                extras: dict = None) -> Optional[OatmealDevice_T]:
+                extras: dict = None,
+                cache: 'OatmealDeviceCache' = None,
+                port_key: Optional[str] = None) -> Optional[OatmealDevice_T]:
     """
     Opens UART port, detects device, creates+returns appropriate class instance
 
@@ -247,6 +289,12 @@ def open_device(uart_path: str,
         baud_rate: serial baud rate to use
         raise_on_unknown_role: if `true` and device `role` is not in the
             device_map passed, raise an :exc:`OatmealError`.
+        cache: if this holds details for `port_key`, open the device without
+            a discovery request and verify them in the background (see
+            :meth:`OatmealDeviceCache.verify()`). Otherwise add the details
+            of the device discovered.
+        port_key: identifier of the port in `cache`, see
+            :meth:`OatmealDeviceCache.port_key()`
 
     Raises:
         OatmealError: on failure or OatmealTimeout on timeout
@@ -255,6 +303,17 @@ def open_device(uart_path: str,
         Instantiated class representing the new device or None
     """
     baud_rate = OATMEAL_BAUD_RATE if baud_rate is None else baud_rate
+    extras = extras if extras else {}
+
+    if cache is not None and port_key is not None:
+        details = cache.get(port_key)
+        if details is not None and details.role in device_map:
+            serial_fh = serial.Serial(uart_path, baud_rate, timeout=0,
+                                      exclusive=True)
+            d = device_map[details.role](details=details,
+                                         serial_fh=serial_fh, **extras)
+            cache.verify(port_key, d)
+            return d
 
     # read timeout of zero means non-blocking
     serial_fh = serial.Serial(uart_path, baud_rate,
@@ -285,10 +344,113 @@ def open_device(uart_path: str,
         return None
 
     serial_fh = serial.Serial(uart_path, baud_rate, timeout=0, exclusive=True)
-    extras = extras if extras else {}
+    if cache is not None and port_key is not None:
+        cache.put(port_key, device_details)
     return cls(details=device_details, serial_fh=serial_fh, **extras)
 
 
+class OatmealDeviceCache:
+    """ Persistent map from stable serial port identifiers to the details the
+    device on each port last reported in response to a discovery request.
+
+    Passed to :func:`detect_all_devices()`, devices on known ports are opened
+    at once, without waiting for a discovery request. Each is then checked
+    with a single discovery request in the background (see
+    :attr:`OatmealDevice.identity_verified`), and the cache updated.
+
+    Args:
+        path: JSON file to keep the cache in. Defaults to
+              `~/.cache/oatmeal/devices.json`, or `$OATMEAL_DEVICE_CACHE`.
+    """
+
+    DEFAULT_PATH = os.path.join("~", ".cache", "oatmeal", "devices.json")
+
+    def __init__(self, path: str = None) -> None:
+        if path is None:
+            path = os.environ.get("OATMEAL_DEVICE_CACHE", self.DEFAULT_PATH)
+        self.path = os.path.expanduser(path)
+        self._lock = Lock()
+        self._entries = {}  # type: Dict[str, Dict[str, Any]]
+        try:
+            with open(self.path) as fh:
+                entries = json.load(fh)
+            assert isinstance(entries, dict)
+            self._entries = entries
+        except FileNotFoundError:
+            pass
+        except (OSError, ValueError, AssertionError) as err:
+            logging.warning("Ignoring device cache %s: %r", self.path, err)
+
+    @staticmethod
+    def port_key(port_info) -> str:
+        """ Identifier of a serial port (a `ListPortInfo` from
+        :func:`serial.tools.list_ports.comports()`) that survives reboots:
+        the USB vendor, product and serial number if the adapter has a serial
+        number, otherwise the device path. """
+        if port_info.serial_number:
+            return "usb:%04x:%04x:%s" % (port_info.vid or 0,
+                                         port_info.pid or 0,
+                                         port_info.serial_number)
+        return "path:%s" % (port_info.device)
+
+    def get(self, key: str) -> Optional[OatmealDeviceDetails]:
+        """ Details last seen on a port, or None. """
+        with self._lock:
+            entry = self._entries.get(key)
+        if entry is None:
+            return None
+        try:
+            return OatmealDeviceDetails(**entry)
+        except TypeError:
+            return None
+
+    def put(self, key: str, details: OatmealDeviceDetails) -> None:
+        """ Record the details seen on a port. """
+        with self._lock:
+            self._entries[key] = dict(details.items())
+
+    def remove(self, key: str) -> None:
+        """ Forget a port. """
+        with self._lock:
+            self._entries.pop(key, None)
+
+    def save(self) -> None:
+        """ Write the cache to its file, replacing it atomically. """
+        with self._lock:
+            text = json.dumps(self._entries, indent=1, sort_keys=True)
+        dir_path = os.path.dirname(self.path) or "."
+        try:
+            os.makedirs(dir_path, exist_ok=True)
+            fd, tmp_path = tempfile.mkstemp(dir=dir_path, suffix=".tmp")
+            with os.fdopen(fd, "w") as fh:
+                fh.write(text)
+            os.replace(tmp_path, self.path)
+        except OSError as err:
+            logging.warning("Cannot save device cache %s: %r", self.path, err)
+
+    def verify(self, key: str, device: 'OatmealDevice') -> None:
+        """ Check in the background that the device opened on a port with
+        cached details still reports them, then update the cache. """
+        expected = dict(device.details.items())
+        device.identity_verified = None
+
+        def check(details: Optional[OatmealDeviceDetails]) -> None:
+            if details is None:
+                logging.warning("%s on %s did not confirm its identity",
+                                device.get_name(), device.get_path())
+                self.remove(key)
+            else:
+                if dict(details.items()) != expected:
+                    logging.warning("Device on %s is now %r, not %r",
+                                    device.get_path(), details, device.details)
+                self.put(key, details)
+            device.identity_verified = (details is not None and
+                                        dict(details.items()) == expected)
+            self.save()
+
+        device.port.ask_who_async(check)
+
+
 def _prioritise_serial_path(path: str) -> int:
     """ Approximate ordering over paths based on how likely they are to point
     to a USB -> UART adapter. This speeds up device discovery when looking for
@@ -320,7 +482,8 @@ def detect_all_devices(device_list: List[Type[OatmealDevice_T]],
                        *,
                        baud_rate: int = None,
                        fast_search: bool = False,
-                       extras: dict = None) \
+                       extras: dict = None,
+                       cache: OatmealDeviceCache = None) \
         -> Dict[str, List[OatmealDevice_T]]:
     """
     Autodetect and open Oatmeal devices.
@@ -333,6 +496,8 @@ def detect_all_devices(device_list: List[Type[OatmealDevice_T]],
         baud_rate: baud rate to use
         fast_search: return as soon as we find at least one of each device
         extras: key-value pairs to pass to the device constructor
+        cache: open devices on ports in this cache without a discovery
+               request, and add newly discovered devices to it
 
     Returns:
         dict: Mapping role to a list of devices opened::
@@ -344,7 +509,8 @@ def detect_all_devices(device_list: List[Type[OatmealDevice_T]],
     """
     # Can alternatively fall back to globbing (requires `import glob`) with:
     # ports = glob.glob("/dev/ttyUSB[0-9]*")
-    ports = [port.device for port in serial.tools.list_ports.comports()]
+    port_infos = serial.tools.list_ports.comports()
+    ports = [port.device for port in port_infos]
 
     if fast_search:
         # Speed up detection by trying most likely ports first
@@ -353,6 +519,17 @@ def detect_all_devices(device_list: List[Type[OatmealDevice_T]],
     device_map = _device_list_to_map(device_list)
     devices_by_role = {}  # type: Dict[str, List[OatmealDevice_T]]
 
+    port_keys = {}  # type: Dict[str, str]
+    if cache is not None:
+        known = set()
+        for info in port_infos:
+            port_keys[info.device] = key = cache.port_key(info)
+            details = cache.get(key)
+            if details is not None and details.role in device_map:
+                known.add(info.device)
+        # Open ports with known devices first
+        ports = sorted(ports, key=lambda port: port not in known)
+
     for port in ports:
         logging.debug("Trying to connect to %s..." % (port))
         d = None
@@ -361,7 +538,9 @@ def detect_all_devices(device_list: List[Type[OatmealDevice_T]],
                             device_map=device_map,
                             baud_rate=baud_rate,
                             raise_on_unknown_role=False,
-                            extras=extras)
+                            extras=extras,
+                            cache=cache,
+                            port_key=port_keys.get(port))
         except (IOError, OSError, EOFError, BlockingIOError, SerialException) as err:
             # Silently catch connection errors thrown by pyserial
             #  e.g. when the port is already held exclusively
@@ -378,6 +557,8 @@ def detect_all_devices(device_list: List[Type[OatmealDevice_T]],
                 # stop search as soon as we have at least one of each board
                 break
 
+    if cache is not None:
+        cache.save()
     return devices_by_role
 
 
@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+
+# export.py
+# Copyright 2019, Shield Diagnostics and the Oatmeal Protocol contributors
+# License: Apache 2.0
+
+"""
+Export the values in heartbeats and other background (`xxxB`) messages from
+capture files (see :class:`OatmealCaptureMirror`) into columns that numpy can
+memory-map. Each capture is scanned once. Usage::
+
+    python3 -m oatmeal.export out/ valve=valve.cap pump=pump.cap
+
+writes one `.npy` file per device and value to `out/<device>/`, named
+`<opcode>.<key>.npy` for dict values (e.g. `HRTB.T_mC.npy`) or
+`<opcode>.<index>.npy` for other args. Each holds a record per value with
+fields `t` (host time received, float64) and `v` (bool, int64 or float64)::
+
+    col = numpy.load("out/valve/HRTB.T_mC.npy", mmap_mode="r")
+    plot(col["t"], col["v"])
+"""
+
+from typing import Dict, List, Tuple, Any
+from array import array
+import argparse
+import logging
+import os
+import sys
+
+from .protocol import OatmealMsg, OatmealStats, OatmealProtocol, \
+                      OatmealCaptureMirror
+from .bridge import split_frames
+
+
+# (array typecode, numpy descr) of each column type, narrowest first
+_COLUMN_TYPES = [('b', '|b1'), ('q', '<i8'), ('d', '<f8')]
+_WIDTH = {typecode: i for i, (typecode, _) in enumerate(_COLUMN_TYPES)}
+
+
+class OatmealColumns:
+    """ Values collected from background messages, one column per device and
+    value name, ready to be written as `.npy` files.
+
+    Attributes:
+        columns (dict): maps (device, name) to (times, values) arrays
+        stats (OatmealStats): counts of good and bad frames scanned
+    """
+
+    SKIP_OPCODES = ('LOGB', 'SMPB', 'BSTB')
+    """ Background messages holding logs, sample batches and self-test data
+    rather than values. """
+
+    def __init__(self) -> None:
+        self.columns = {}  # type: Dict[Tuple[str, str], Tuple[array, array]]
+        self.stats = OatmealStats()
+
+    def add_value(self, device: str, name: str, t: float, value: Any) -> None:
+        """ Add a value to a column if it is a bool, int or float. A column
+        of bools or ints is widened when a wider type is added. """
+        if isinstance(value, bool):
+            typecode = 'b'
+        elif isinstance(value, int):
+            typecode = 'q'
+        elif isinstance(value, float):
+            typecode = 'd'
+        else:
+            return
+        col = self.columns.get((device, name))
+        if col is None:
+            col = self.columns[(device, name)] = (array('d'), array(typecode))
+        times, values = col
+        if _WIDTH[typecode] > _WIDTH[values.typecode]:
+            values = array(typecode, values)
+            self.columns[(device, name)] = (times, values)
+        if values.typecode == 'q' and not -2**63 <= value < 2**63:
+            return  # too wide for an int64 column
+        times.append(t)
+        values.append(value)
+
+    def add_msg(self, device: str, t: float, msg: OatmealMsg) -> None:
+        """ Add the values in a background message received at host time `t`.
+        """
+        if len(msg.args) == 1 and isinstance(msg.args[0], dict):
+            for key, value in msg.args[0].items():
+                self.add_value(device, "%s.%s" % (msg.opcode, key), t, value)
+        else:
+            for i, value in enumerate(msg.args):
+                self.add_value(device, "%s.%i" % (msg.opcode, i), t, value)
+
+    def add_capture(self, device: str, path: str,
+                    max_frame_len: int = OatmealMsg.DEFAULT_MAX_FRAME_LEN
+                    ) -> None:
+        """ Scan a capture file for background messages from a device. Frames
+        are timestamped with the time their last chunk was received. """
+        skip = [op.encode() for op in self.SKIP_OPCODES]
+        buf = bytearray()
+        for t, direction, data in OatmealCaptureMirror.read_records(path):
+            if direction != OatmealCaptureMirror.INCOMING:
+                continue
+            buf += data
+            frames, buf = split_frames(buf)
+            for frame in frames:
+                # Only decode frames holding values
+                if (len(frame) < OatmealMsg.MIN_FRAME_LEN or
+                        frame[4] != ord(OatmealProtocol.BACKGROUND_MSG_FLAG)
+                        or frame[1:5] in skip):
+                    continue
+                msg = OatmealProtocol.convert_frame(frame, self.stats,
+                                                    max_frame_len)
+                if msg is not None:
+                    self.add_msg(device, t, msg)
+
+    def write(self, out_dir: str) -> List[str]:
+        """ Write each column to `<out_dir>/<device>/<name>.npy`.
+
+        Returns:
+            Paths of the files written.
+        """
+        paths = []
+        for (device, name), (times, values) in sorted(self.columns.items()):
+            os.makedirs(os.path.join(out_dir, device), exist_ok=True)
+            path = os.path.join(out_dir, device, name + ".npy")
+            _write_npy(path, times, values)
+            paths.append(path)
+        return paths
+
+
+def _write_npy(path: str, times: array, values: array) -> None:
+    """ Write (t, v) records as an `.npy` file (format version 1.0) """
+    descr = dict(_COLUMN_TYPES)[values.typecode]
+    header = ("{'descr': [('t', '<f8'), ('v', '%s')], 'fortran_order': "
+              "False, 'shape': (%i,), }" % (descr, len(times))).encode()
+    # Pad so that data starts on a 64 byte boundary, header ends in newline
+    header += b' ' * (63 - (10 + len(header)) % 64) + b'\n'
+    if sys.byteorder == 'big':
+        times, values = array('d', times), array(values.typecode, values)
+        times.byteswap()
+        values.byteswap()
+    # Interleave the two columns into records, one byte lane at a time
+    t_bytes, v_bytes = times.tobytes(), values.tobytes()
+    t_size, v_size = times.itemsize, values.itemsize
+    rec_size = t_size + v_size
+    records = bytearray(rec_size * len(times))
+    for i in range(t_size):
+        records[i::rec_size] = t_bytes[i::t_size]
+    for i in range(v_size):
+        records[t_size+i::rec_size] = v_bytes[i::v_size]
+    with open(path, 'wb') as fh:
+        fh.write(b'\x93NUMPY\x01\x00')
+        fh.write(len(header).to_bytes(2, 'little'))
+        fh.write(header)
+        fh.write(records)
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(
+        description="Export heartbeat and background message values from "
+                    "Oatmeal captures into numpy .npy columns.")
+    parser.add_argument("out_dir", help="directory to write columns to")
+    parser.add_argument("captures", nargs="+",
+                        help="capture files, as [<device>=]<path>. Device "
+                             "defaults to the file name without extension")
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.WARNING)
+
+    columns = OatmealColumns()
+    for capture in args.captures:
+        device, sep, path = capture.partition("=")
+        if not sep:
+            path = capture
+            device = os.path.splitext(os.path.basename(path))[0]
+        columns.add_capture(device, path)
+    paths = columns.write(args.out_dir)
+    print("Wrote %i columns from %i frames (%i bad)" % (
+        len(paths), columns.stats.n_good_frames,
+        columns.stats.n_bad_checksums + columns.stats.n_misc_bad_frames))
+
+
+if __name__ == '__main__':
+    main()
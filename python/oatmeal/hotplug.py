@@ -0,0 +1,291 @@
+#!/usr/bin/env python3
+
+# hotplug.py
+# Copyright 2019, Shield Diagnostics and the Oatmeal Protocol contributors
+# License: Apache 2.0
+
+"""
+Track the Oatmeal devices connected as serial ports appear and disappear,
+without rescanning every port. Usage::
+
+    watcher = OatmealDeviceWatcher([Valve, Pump])
+    watcher.subscribe(lambda event, path, device: print(event, path, device))
+    watcher.start()
+    ...
+    watcher.devices()  # {'/dev/ttyUSB0': <Valve>, ...}
+
+On Linux, `/dev` is watched with inotify and discovery is only run on a port
+when its device node is created. Elsewhere, the list of serial ports is
+polled. Listing ports does not open them, so devices in use are not
+disturbed either way.
+"""
+
+from typing import Dict, List, Tuple, Type, Optional, Callable, Set
+from threading import Thread, Event, Lock
+import ctypes
+import ctypes.util
+import logging
+import os
+import select
+import struct
+import time
+
+import serial.tools.list_ports
+from serial import SerialException
+
+from .protocol import OatmealError
+from .device import OatmealDevice, OatmealDeviceCache, open_device
+
+
+# inotify event masks, from <sys/inotify.h>
+IN_MOVED_FROM = 0x40
+IN_MOVED_TO = 0x80
+IN_CREATE = 0x100
+IN_DELETE = 0x200
+IN_Q_OVERFLOW = 0x4000
+
+_EVENT_HEADER = struct.Struct('iIII')  # wd, mask, cookie, len(name)
+
+
+class OatmealInotify:
+    """ Files created in, moved into or out of, or removed from a directory,
+    reported by Linux inotify.
+
+    Raises:
+        OSError: if inotify is not available
+    """
+
+    def __init__(self, path: str) -> None:
+        libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno=True)
+        if not hasattr(libc, 'inotify_init1'):
+            raise OSError("inotify is not available")
+        fd = libc.inotify_init1(os.O_NONBLOCK | os.O_CLOEXEC)
+        if fd < 0:
+            err = ctypes.get_errno()
+            raise OSError(err, os.strerror(err))
+        mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+        if libc.inotify_add_watch(fd, os.fsencode(path), mask) < 0:
+            err = ctypes.get_errno()
+            os.close(fd)
+            raise OSError(err, os.strerror(err), path)
+        self.fd = fd
+
+    def read(self, timeout: float) -> List[Tuple[int, str]]:
+        """ Wait up to `timeout` seconds for events.
+
+        Returns:
+            (mask, file name) of each event. A mask with `IN_Q_OVERFLOW` set
+            means events were lost.
+        """
+        ready, _, _ = select.select([self.fd], [], [], timeout)
+        if not ready:
+            return []
+        try:
+            buf = os.read(self.fd, 65536)
+        except BlockingIOError:
+            return []
+        events = []
+        pos = 0
+        while pos + _EVENT_HEADER.size <= len(buf):
+            _, mask, _, name_len = _EVENT_HEADER.unpack_from(buf, pos)
+            pos += _EVENT_HEADER.size
+            name = os.fsdecode(buf[pos:pos+name_len].rstrip(b'\0'))
+            pos += name_len
+            events.append((mask, name))
+        return events
+
+    def close(self) -> None:
+        os.close(self.fd)
+
+
+class OatmealDeviceWatcher:
+    """ Live table of the Oatmeal devices connected, by serial port path.
+
+    Devices are opened on a background thread when their port appears, and
+    stopped when it disappears. Devices still open are stopped by
+    :meth:`stop()`.
+
+    Args:
+        device_list: device classes to open, see :func:`detect_all_devices()`
+        baud_rate: serial baud rate to use
+        extras: key-value pairs to pass to the device constructor
+        cache: open devices on known ports without a discovery request, see
+               :class:`OatmealDeviceCache`
+        dev_dir: directory of device nodes to watch with inotify
+        poll_interval: seconds between listings of the serial ports, when
+                       inotify is not available
+        settle_time: seconds to wait after a port appears before opening it,
+                     for udev to set its permissions. Ports that fail to open
+                     are retried `MAX_OPEN_ATTEMPTS` times, this far apart.
+    """
+
+    ADDED = 'added'
+    REMOVED = 'removed'
+    MAX_OPEN_ATTEMPTS = 3
+
+    def __init__(self, device_list: List[Type[OatmealDevice]], *,
+                 baud_rate: int = None,
+                 extras: dict = None,
+                 cache: OatmealDeviceCache = None,
+                 dev_dir: str = '/dev',
+                 poll_interval: float = 1.0,
+                 settle_time: float = 0.5) -> None:
+        self.device_map = {}  # type: Dict[str, Type[OatmealDevice]]
+        for cls in device_list:
+            assert cls.ROLE_STR is not None, \
+                "Class %s doesn't define 'ROLE_STR'" % (cls.__name__)
+            self.device_map[cls.ROLE_STR] = cls
+        self.baud_rate = baud_rate
+        self.extras = extras
+        self.cache = cache
+        self.dev_dir = dev_dir
+        self.poll_interval = poll_interval
+        self.settle_time = settle_time
+        self._devices = {}  # type: Dict[str, OatmealDevice]
+        self._lock = Lock()
+        self._subscribers = []  # type: List[Callable[[str, str, OatmealDevice], None]]
+        # Held while calling subscribers, so each sees changes in order
+        self._notify_lock = Lock()
+        # Ports listed at the last poll
+        self._listed = set()  # type: Set[str]
+        # Ports to open: (time due, number of attempts made)
+        self._pending = {}  # type: Dict[str, Tuple[float, int]]
+        self._exit = Event()
+        self._thread = None  # type: Optional[Thread]
+
+    def devices(self) -> Dict[str, OatmealDevice]:
+        """ Devices currently connected, by serial port path. """
+        with self._lock:
+            return dict(self._devices)
+
+    def subscribe(self,
+                  callback: Callable[[str, str, OatmealDevice], None]) -> None:
+        """ Call `callback(event, path, device)` on the watcher thread for
+        each device added or removed, with `event` being :attr:`ADDED` or
+        :attr:`REMOVED`. Devices already connected are passed at once as
+        :attr:`ADDED`. """
+        with self._notify_lock:
+            for path, device in sorted(self.devices().items()):
+                callback(self.ADDED, path, device)
+            self._subscribers.append(callback)
+
+    def unsubscribe(self,
+                    callback: Callable[[str, str, OatmealDevice], None]) -> None:
+        with self._notify_lock:
+            self._subscribers.remove(callback)
+
+    def _update(self, event: str, path: str, device: OatmealDevice) -> None:
+        """ Add or remove a device from the table and tell subscribers """
+        with self._notify_lock:
+            with self._lock:
+                if event == self.ADDED:
+                    self._devices[path] = device
+                else:
+                    del self._devices[path]
+            for callback in list(self._subscribers):
+                try:
+                    callback(event, path, device)
+                except Exception:
+                    logging.exception("Device watcher subscriber failed")
+
+    def _rescan(self) -> None:
+        """ Compare the serial ports listed with those at the last listing """
+        listed = {info.device for info in serial.tools.list_ports.comports()}
+        for path in sorted(listed - self._listed):
+            self._pending.setdefault(path, (time.time(), 0))
+        for path in sorted(self._listed - listed):
+            self._remove(path)
+        self._listed = listed
+
+    def _open(self, path: str, attempts: int) -> None:
+        """ Run discovery on a port that has appeared """
+        infos = [info for info in serial.tools.list_ports.comports()
+                 if info.device == path]
+        if not infos or path in self._devices:
+            return  # not a serial port, or already open
+        port_key = (self.cache.port_key(infos[0])
+                    if self.cache is not None else None)
+        logging.debug("Trying to connect to %s...", path)
+        try:
+            d = open_device(path, self.device_map, baud_rate=self.baud_rate,
+                            extras=self.extras, cache=self.cache,
+                            port_key=port_key)
+        except (OSError, EOFError, SerialException, OatmealError) as err:
+            logging.debug("Failed to connect to '%s': %r", path, err)
+            if attempts + 1 < self.MAX_OPEN_ATTEMPTS:
+                self._pending[path] = (time.time() + self.settle_time,
+                                       attempts + 1)
+            return
+        if self.cache is not None:
+            self.cache.save()
+        if d is None:
+            return
+        logging.info("Connected to %s on %s", d.get_name(), path)
+        self._update(self.ADDED, path, d)
+
+    def _remove(self, path: str) -> None:
+        """ Stop the device on a port that has disappeared """
+        self._pending.pop(path, None)
+        d = self._devices.get(path)
+        if d is None:
+            return
+        logging.info("Disconnected %s from %s", d.get_name(), path)
+        self._update(self.REMOVED, path, d)
+        d.stop()
+
+    def _watch_loop(self, inotify: Optional[OatmealInotify]) -> None:
+        next_poll = time.time() + self.poll_interval
+        while not self._exit.is_set():
+            now = time.time()
+            due = min([t for t, _ in self._pending.values()] +
+                      [now + self.poll_interval])
+            timeout = max(0.0, min(due - now, 0.5))
+            if inotify is not None:
+                for mask, name in inotify.read(timeout):
+                    path = os.path.join(self.dev_dir, name)
+                    if mask & IN_Q_OVERFLOW:
+                        self._rescan()
+                    elif mask & (IN_CREATE | IN_MOVED_TO):
+                        self._listed.add(path)
+                        self._pending[path] = (time.time() + self.settle_time,
+                                               0)
+                    elif mask & (IN_DELETE | IN_MOVED_FROM):
+                        self._listed.discard(path)
+                        self._remove(path)
+            else:
+                self._exit.wait(timeout)
+                if time.time() >= next_poll:
+                    self._rescan()
+                    next_poll = time.time() + self.poll_interval
+            now = time.time()
+            for path, (t, attempts) in sorted(self._pending.items()):
+                if t <= now and not self._exit.is_set():
+                    del self._pending[path]
+                    self._open(path, attempts)
+        if inotify is not None:
+            inotify.close()
+
+    def start(self) -> None:
+        """ Start a background thread that opens the devices connected now,
+        then watches for changes """
+        assert self._thread is None, "Watcher already started"
+        inotify = None
+        try:
+            inotify = OatmealInotify(self.dev_dir)
+        except (OSError, AttributeError, TypeError) as err:
+            logging.info("Polling for serial ports, cannot watch %s: %r",
+                         self.dev_dir, err)
+        self._exit.clear()
+        self._rescan()
+        self._thread = Thread(target=self._watch_loop, args=(inotify,),
+                              name="oatmeal-hotplug", daemon=True)
+        self._thread.start()
+
+    def stop(self) -> None:
+        """ Stop watching and stop every device in the table """
+        self._exit.set()
+        if self._thread is not None:
+            self._thread.join()
+            self._thread = None
+        for path in sorted(self.devices()):
+            self._remove(path)
@@ -0,0 +1,230 @@
+#!/usr/bin/env python3
+
+# metrics.py
+# Copyright 2019, Shield Diagnostics and the Oatmeal Protocol contributors
+# License: Apache 2.0
+
+"""
+Serve link health statistics of every connected device in the OpenMetrics
+text format, for scraping by Prometheus or similar. Usage::
+
+    metrics = OatmealMetrics()
+    metrics.add_port("valve", port)
+    server = OatmealMetricsServer(metrics, ("127.0.0.1", 9551))
+    server.start()
+
+Statistics are read from the objects that the I/O threads update, when
+scraped. The I/O threads never take a lock to update them.
+"""
+
+from typing import Dict, List, Tuple, Optional, Callable
+from socketserver import ThreadingMixIn
+from http.server import HTTPServer, BaseHTTPRequestHandler
+from threading import Thread
+import time
+
+from .protocol import OatmealStats, OatmealPort, OatmealLatencyStats, \
+                      OatmealBgMsgHandler
+
+
+Labels = Tuple[Tuple[str, str], ...]
+Sample = Tuple[str, Labels, float]  # (suffix, labels, value)
+
+HOST_STAT_ATTRS = [('n_frame_too_short', 'frame_too_short'),
+                   ('n_frame_too_long', 'frame_too_long'),
+                   ('n_missing_start_byte', 'missing_start_byte'),
+                   ('n_missing_end_byte', 'missing_end_byte'),
+                   ('n_invalid_bytes', 'invalid_bytes'),
+                   ('n_bad_checksums', 'bad_checksums'),
+                   ('n_misc_bad_frames', 'misc_bad_frames')]
+""" :class:`OatmealStats` attributes counting bad frames, and the `error`
+label each is exported with. """
+
+# (name, type, unit, help) of each metric family, in the order rendered
+FAMILIES = [
+    ('oatmeal_rx_frames', 'counter', '',
+     "Valid frames received. link is host (from the device) or client "
+     "(from bridge clients)."),
+    ('oatmeal_rx_errors', 'counter', '',
+     "Bad frames received. link is host (from the device), device (to the "
+     "device, as reported in heartbeats) or client (from bridge clients)."),
+    ('oatmeal_tx_too_long', 'counter', '',
+     "Frames the device refused to send or sent too long to receive."),
+    ('oatmeal_budget_hits', 'counter', '',
+     "Calls to check_for_msgs() on the device that ran out of time."),
+    ('oatmeal_missed_acks', 'counter', '',
+     "Requests that were not acknowledged in time."),
+    ('oatmeal_unroutable', 'counter', '',
+     "Responses from the device that the bridge had no client for."),
+    ('oatmeal_round_trip_seconds', 'summary', 'seconds',
+     "Round trip times of clock sync exchanges, less the time on the "
+     "device."),
+    ('oatmeal_round_trip_min_seconds', 'gauge', 'seconds',
+     "Shortest round trip time of clock sync exchanges."),
+    ('oatmeal_round_trip_max_seconds', 'gauge', 'seconds',
+     "Longest round trip time of clock sync exchanges."),
+    ('oatmeal_heartbeat_age_seconds', 'gauge', 'seconds',
+     "Time since the last heartbeat was received."),
+]
+
+
+def _escape(value: str) -> str:
+    return (value.replace('\\', '\\\\').replace('"', '\\"')
+            .replace('\n', '\\n'))
+
+
+def _format_value(value: float) -> str:
+    return repr(value) if isinstance(value, float) else str(int(value))
+
+
+class OatmealMetrics:
+    """ Collection of the statistics of any number of devices, ports and
+    bridges, rendered in the OpenMetrics text format by :meth:`render()`. """
+
+    CONTENT_TYPE = 'application/openmetrics-text; version=1.0.0; charset=utf-8'
+
+    def __init__(self) -> None:
+        # Functions adding samples for each family name
+        self._sources = []  # type: List[Callable[[Dict[str, List[Sample]]], None]]
+
+    def add_stats(self, device: str, stats: OatmealStats,
+                  link: str = 'host') -> None:
+        """ Export an :class:`OatmealStats` of frames received on a link. """
+        def collect(out: Dict[str, List[Sample]]) -> None:
+            labels = (('device', device), ('link', link))
+            out['oatmeal_rx_frames'].append(('_total', labels,
+                                             stats.n_good_frames))
+            for attr, error in HOST_STAT_ATTRS:
+                out['oatmeal_rx_errors'].append(
+                    ('_total', labels + (('error', error),),
+                     getattr(stats, attr)))
+        self._sources.append(collect)
+
+    def add_handler(self, device: str, handler: OatmealBgMsgHandler) -> None:
+        """ Export the error counts a device reports in its heartbeats, and
+        the time since its last heartbeat. """
+        def collect(out: Dict[str, List[Sample]]) -> None:
+            labels = (('device', device),)
+            device_stats = handler.device_stats.copy()
+            for name in sorted(handler.DEVICE_STAT_KEYS.values()):
+                value = device_stats.get(name, 0)
+                if name in ('tx_too_long', 'budget_hits'):
+                    out['oatmeal_' + name].append(('_total', labels, value))
+                else:
+                    out['oatmeal_rx_errors'].append(
+                        ('_total', labels + (('link', 'device'),
+                                             ('error', name)), value))
+            last = handler.last_heartbeat
+            if last is not None and last.recv_time is not None:
+                out['oatmeal_heartbeat_age_seconds'].append(
+                    ('', labels, time.time() - last.recv_time))
+        self._sources.append(collect)
+
+    def add_latency(self, device: str, latency: OatmealLatencyStats) -> None:
+        """ Export round trip times. """
+        def collect(out: Dict[str, List[Sample]]) -> None:
+            labels = (('device', device),)
+            n, total = latency.n, latency.total
+            out['oatmeal_round_trip_seconds'] += [('_count', labels, n),
+                                                  ('_sum', labels, total)]
+            lo, hi = latency.min, latency.max
+            if lo is not None and hi is not None:
+                out['oatmeal_round_trip_min_seconds'].append(('', labels, lo))
+                out['oatmeal_round_trip_max_seconds'].append(('', labels, hi))
+        self._sources.append(collect)
+
+    def add_port(self, device: str, port: OatmealPort) -> None:
+        """ Export the statistics of an :class:`OatmealPort`: frames received,
+        missed acks, round trip times and, if it has an
+        :class:`OatmealBgMsgHandler`, the stats in the device's heartbeats.
+        """
+        self.add_stats(device, port.stats)
+        self.add_latency(device, port.clock.round_trip)
+        if isinstance(port.bg_msg_handler, OatmealBgMsgHandler):
+            self.add_handler(device, port.bg_msg_handler)
+
+        def collect(out: Dict[str, List[Sample]]) -> None:
+            out['oatmeal_missed_acks'].append(
+                ('_total', (('device', device),), port.n_missed_acks))
+        self._sources.append(collect)
+
+    def add_bridge(self, device: str, bridge) -> None:
+        """ Export the statistics of an :class:`oatmeal.bridge.OatmealBridge`
+        """
+        self.add_stats(device, bridge.device_stats)
+        self.add_stats(device, bridge.client_stats, link='client')
+
+        def collect(out: Dict[str, List[Sample]]) -> None:
+            out['oatmeal_unroutable'].append(
+                ('_total', (('device', device),), bridge.n_unroutable))
+        self._sources.append(collect)
+
+    def render(self) -> str:
+        """ All statistics in the OpenMetrics text format. """
+        out = {name: [] for name, _, _, _ in FAMILIES}  # type: Dict[str, List[Sample]]
+        for collect in self._sources:
+            collect(out)
+        lines = []
+        for name, mtype, unit, doc in FAMILIES:
+            if not out[name]:
+                continue
+            lines.append('# TYPE %s %s' % (name, mtype))
+            if unit:
+                lines.append('# UNIT %s %s' % (name, unit))
+            lines.append('# HELP %s %s' % (name, _escape(doc)))
+            for suffix, labels, value in out[name]:
+                label_str = ','.join('%s="%s"' % (k, _escape(v))
+                                     for k, v in labels)
+                lines.append('%s%s{%s} %s' % (name, suffix, label_str,
+                                              _format_value(value)))
+        lines.append('# EOF\n')
+        return '\n'.join(lines)
+
+
+class _ThreadingHTTPServer(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+
+
+class OatmealMetricsServer:
+    """ Serve :class:`OatmealMetrics` over HTTP at any path, on a background
+    thread.
+
+    Args:
+        metrics: statistics to serve
+        addr: (host address string, port number)-tuple to listen on
+    """
+
+    def __init__(self, metrics: OatmealMetrics,
+                 addr: Tuple[str, int] = ('127.0.0.1', 9551)) -> None:
+        class Handler(BaseHTTPRequestHandler):
+            def do_GET(self) -> None:
+                body = metrics.render().encode()
+                self.send_response(200)
+                self.send_header('Content-Type', OatmealMetrics.CONTENT_TYPE)
+                self.send_header('Content-Length', str(len(body)))
+                self.end_headers()
+                self.wfile.write(body)
+
+            def log_message(self, *args) -> None:
+                pass
+
+        self.server = _ThreadingHTTPServer(addr, Handler)
+        self.thread = None  # type: Optional[Thread]
+
+    @property
+    def address(self) -> Tuple[str, int]:
+        """ (host, port) the server is listening on """
+        host, port = self.server.server_address[:2]
+        return str(host), int(port)
+
+    def start(self) -> None:
+        """ Start serving on a background thread """
+        self.thread = Thread(target=self.server.serve_forever, daemon=True)
+        self.thread.start()
+
+    def stop(self) -> None:
+        """ Stop serving and close the socket """
+        self.server.shutdown()
+        self.server.server_close()
+        if self.thread is not None:
+            self.thread.join()
@@ -0,0 +1,304 @@
+#!/usr/bin/env python3
+
+# pool.py
+# Copyright 2019, Shield Diagnostics and the Oatmeal Protocol contributors
+# License: Apache 2.0
+
+"""
+Decode frames and dispatch messages from many devices on a pool of worker
+processes, so that decoding and handling scale with the number of cores and
+I/O threads only split and validate frames. Usage::
+
+    def handle(device: str, msg: OatmealMsg) -> Any:
+        ...
+
+    pool = OatmealWorkerPool(handle, n_workers=4, on_result=print)
+    pool.start()
+    # on each device's I/O thread:
+    pool.read_port("valve", serial_port, exit_token)
+
+Each worker process has its own queue of devices with frames waiting, fed by
+a thread in the calling process. Each device is assigned a home worker. A
+device with frames waiting is held by one worker at a time, which is sent a
+batch of its frames, as validated bytes, to decode and handle in the order
+received. So the handler is never called concurrently for the same device. A
+worker with nothing to do steals waiting devices from the back of the other
+workers' queues, so that a burst from a few devices does not leave the other
+workers idle.
+
+The handler runs in the worker processes: state it changes is not seen by
+the calling process. It must be picklable if the multiprocessing start method
+is not "fork" (e.g. a module-level function). Its return values, if not
+None, are passed back to `on_result` in the calling process.
+"""
+
+from typing import Any, Dict, List, Optional, Callable, Tuple
+from collections import deque
+from threading import Thread, Condition, Event, Lock
+import logging
+import multiprocessing
+import os
+import signal
+import time
+
+from .protocol import OatmealMsg, OatmealStats, OatmealProtocol, \
+                      OatmealParseError, OatmealDataMirror
+
+
+def _worker_main(conn: Any,
+                 handler: Callable[[str, OatmealMsg], Any]) -> None:
+    """ Worker process: decode and handle batches of frames received on
+    `conn`, replying to each with its counts and results, until sent None.
+    """
+    # Ctrl-C is handled by the calling process, which stops the pool
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+    while True:
+        batch = conn.recv()
+        if batch is None:
+            return
+        device, frames = batch
+        n_good, n_bad, n_errors = 0, 0, 0
+        results = []  # type: List[Any]
+        for frame, recv_time in frames:
+            try:
+                msg = OatmealMsg.decode(frame)
+            except OatmealParseError:
+                logging.warning("Cannot parse frame from %s: %r", device,
+                                frame, exc_info=True)
+                n_bad += 1
+                continue
+            n_good += 1
+            msg.recv_time = recv_time
+            try:
+                result = handler(device, msg)
+            except Exception:
+                logging.exception("Handler failed on %r from %s", msg, device)
+                n_errors += 1
+                continue
+            if result is not None:
+                results.append(result)
+        conn.send((n_good, n_bad, n_errors, results))
+
+
+class _DeviceQueue:
+    """ Frames received from one device, waiting to be handled """
+
+    def __init__(self, name: str, home: int) -> None:
+        self.name = name
+        self.home = home
+        self.frames = deque()  # type: deque
+        self.stats = OatmealStats()
+        # Set while the device is on a run queue or held by a worker
+        self.scheduled = False
+        self.lock = Lock()
+
+
+class OatmealWorkerPool:
+    """ Pool of processes decoding frames and calling `handler(device, msg)`.
+
+    Args:
+        handler: called in a worker process with the device name and each
+                 message, in the order the device's frames were submitted.
+                 Messages have :attr:`OatmealMsg.recv_time` set.
+        n_workers: number of worker processes. Defaults to the number of CPUs.
+        batch_size: frames sent to a worker at once. The worker then moves on
+                    to the next waiting device.
+        on_result: called in the calling process with the device name and each
+                   value other than None returned by `handler`, in order
+        mp_context: multiprocessing context to start workers with, e.g.
+                    `multiprocessing.get_context("spawn")`. Defaults to the
+                    platform's default start method.
+
+    Attributes:
+        n_handler_errors (int): exceptions raised by the handler or
+            `on_result`, which are logged and otherwise ignored
+        n_worker_restarts (int): worker processes that died and were
+            restarted. The frames of the batch they held are lost.
+    """
+
+    def __init__(self, handler: Callable[[str, OatmealMsg], Any],
+                 n_workers: Optional[int] = None,
+                 batch_size: int = 64,
+                 on_result: Optional[Callable[[str, Any], None]] = None,
+                 mp_context: Any = None) -> None:
+        n_workers = n_workers or os.cpu_count() or 1
+        assert batch_size > 0
+        self.handler = handler
+        self.batch_size = batch_size
+        self.on_result = on_result
+        self.n_handler_errors = 0
+        self.n_worker_restarts = 0
+        self._mp = mp_context or multiprocessing.get_context()
+        self._devices = {}  # type: Dict[str, _DeviceQueue]
+        self._devices_lock = Lock()
+        # Devices waiting for a worker, by home worker. Workers take from the
+        # front of their own queue and steal from the back of others'.
+        self._run_queues = [deque() for _ in range(n_workers)]  # type: List[deque]
+        self._wakeup = Condition()
+        self._exit = Event()
+        # Per worker: process, and connection to it used by its feeder thread
+        self._workers = []  # type: List[Tuple[Any, Any]]
+        self._threads = []  # type: List[Thread]
+
+    @property
+    def n_workers(self) -> int:
+        return len(self._run_queues)
+
+    def _device(self, device: str) -> _DeviceQueue:
+        dq = self._devices.get(device)
+        if dq is None:
+            with self._devices_lock:
+                dq = self._devices.get(device)
+                if dq is None:
+                    # Spread devices over workers as they are first seen
+                    home = len(self._devices) % self.n_workers
+                    dq = self._devices[device] = _DeviceQueue(device, home)
+        return dq
+
+    def stats(self, device: str) -> OatmealStats:
+        """ Statistics of the frames received from a device. Pass these to
+        :meth:`OatmealProtocol.read_frame_loop()` so that one object counts
+        both validation (I/O thread) and decoding (worker) errors. """
+        return self._device(device).stats
+
+    def submit(self, device: str, frame: bytes,
+               recv_time: Optional[float] = None) -> None:
+        """ Queue a validated frame (see :meth:`OatmealProtocol.validate_frame()`)
+        received from a device at host time `recv_time` (defaults to now).
+        Thread-safe, but each device's frames should be submitted from one
+        thread for their order to be meaningful. """
+        dq = self._device(device)
+        dq.frames.append((bytes(frame), time.time() if recv_time is None
+                          else recv_time))
+        with dq.lock:
+            if dq.scheduled:
+                return  # the worker holding the device will see the frame
+            dq.scheduled = True
+        self._run_queues[dq.home].append(dq)
+        with self._wakeup:
+            self._wakeup.notify()
+
+    def read_port(self, device: str, serial_port, exit_token: Event,
+                  data_mirror: OatmealDataMirror = None,
+                  max_frame_len: int = OatmealMsg.DEFAULT_MAX_FRAME_LEN
+                  ) -> None:
+        """ Read and validate frames from a serial port and submit them, until
+        `exit_token` is set. Runs on the calling (I/O) thread. """
+        frames = OatmealProtocol.read_frame_loop(
+            serial_port, exit_token, data_mirror=data_mirror,
+            stats=self.stats(device), max_frame_len=max_frame_len,
+            decode=False)
+        for frame in frames:
+            self.submit(device, frame)
+
+    def _next_device(self, worker: int) -> Optional[_DeviceQueue]:
+        try:
+            return self._run_queues[worker].popleft()
+        except IndexError:
+            pass
+        n = self.n_workers
+        for i in range(1, n):
+            try:
+                return self._run_queues[(worker + i) % n].pop()
+            except IndexError:
+                pass
+        return None
+
+    def _start_worker(self) -> Tuple[Any, Any]:
+        conn, worker_conn = self._mp.Pipe()
+        process = self._mp.Process(target=_worker_main,
+                                   args=(worker_conn, self.handler),
+                                   daemon=True)
+        process.start()
+        worker_conn.close()
+        return process, conn
+
+    def _handle_frames(self, worker: int, dq: _DeviceQueue) -> None:
+        """ Have a worker handle up to `batch_size` frames of a device held by
+        its feeder thread (the calling thread) """
+        frames = []
+        for _ in range(self.batch_size):
+            try:
+                frames.append(dq.frames.popleft())
+            except IndexError:
+                break
+        if not frames:
+            return
+        process, conn = self._workers[worker]
+        try:
+            conn.send((dq.name, frames))
+            n_good, n_bad, n_errors, results = conn.recv()
+        except (EOFError, OSError):
+            logging.error("Worker %i died handling frames from %s, "
+                          "restarting it", worker, dq.name)
+            process.join()
+            conn.close()
+            self._workers[worker] = self._start_worker()
+            with self._devices_lock:
+                self.n_worker_restarts += 1
+            return
+        dq.stats.n_good_frames += n_good
+        dq.stats.n_misc_bad_frames += n_bad
+        for result in results:
+            try:
+                if self.on_result is not None:
+                    self.on_result(dq.name, result)
+            except Exception:
+                logging.exception("Result handler failed on %r from %s",
+                                  result, dq.name)
+                n_errors += 1
+        if n_errors:
+            with self._devices_lock:
+                self.n_handler_errors += n_errors
+
+    def _feed_loop(self, worker: int) -> None:
+        while True:
+            dq = self._next_device(worker)
+            if dq is None:
+                if self._exit.is_set():
+                    return
+                with self._wakeup:
+                    # Timeout covers a wakeup sent before we started waiting
+                    self._wakeup.wait(0.05)
+                continue
+            self._handle_frames(worker, dq)
+            with dq.lock:
+                if not dq.frames:
+                    dq.scheduled = False
+                    continue
+            # More frames waiting: requeue behind the other waiting devices
+            self._run_queues[dq.home].append(dq)
+
+    def start(self) -> None:
+        """ Start the worker processes and the threads feeding them """
+        assert not self._threads, "Pool already started"
+        self._exit.clear()
+        self._workers = [self._start_worker() for _ in range(self.n_workers)]
+        self._threads = [Thread(target=self._feed_loop, args=(i,),
+                                name="oatmeal-feeder-%i" % (i), daemon=True)
+                         for i in range(self.n_workers)]
+        for thread in self._threads:
+            thread.start()
+
+    def stop(self) -> None:
+        """ Handle all submitted frames, then stop the worker processes """
+        self._exit.set()
+        with self._wakeup:
+            self._wakeup.notify_all()
+        for thread in self._threads:
+            thread.join()
+        self._threads = []
+        for process, conn in self._workers:
+            try:
+                conn.send(None)
+            except OSError:
+                pass
+            process.join()
+            conn.close()
+        self._workers = []
+
+    def n_pending(self) -> int:
+        """ Number of submitted frames waiting for a worker """
+        with self._devices_lock:
+            devices = list(self._devices.values())
+        return sum(len(dq.frames) for dq in devices)
@@ -5,7 +5,7 @@
 # License: Apache 2.0
 
 from typing import Tuple, Dict, List, Sequence, Iterator, Iterable, Optional, \
-                   Union, TypeVar, Type, ItemsView, Any
+                   Union, TypeVar, Type, ItemsView, Any, Callable
 from abc import ABC, abstractmethod
 import re
 import os
@@ -18,6 +18,9 @@ import platform
 import warnings
 import hashlib
 import binascii
+import struct
+from array import array
+from collections import deque
 from enum import Enum
 
 import serial
@@ -26,7 +29,7 @@ import serial
 # Interactive version
 from multiprocessing import Pipe
 from multiprocessing.connection import Connection
-from threading import Thread, Event, Lock
+from threading import Thread, Timer, Event, Lock
 
 
 # Forward UART data over UDP to the following ports on localhost.
@@ -124,6 +127,9 @@ class OatmealMsg:
         args (tuple): arguments of this command
         heartbeat (Optional[dict]): key=val string args into a dict if and only
            if this is a valid heartbeat message. Otherwise None.
+        recv_time (Optional[float]): host time (:func:`time.time()`) at which
+           this message was read from the serial port. None for messages
+           that were not received.
     """
     MIN_FRAME_LEN = 10
     """ Minimum frame length. """
@@ -148,6 +154,7 @@ class OatmealMsg:
         self.args = list(args)
         self.token = token
         self.heartbeat = OatmealMsg._parse_heartbeat(self)
+        self.recv_time = None  # type: Optional[float]
 
     @staticmethod
     def _traverse_args(args: Iterable) -> Iterator[OatmealItem]:
@@ -659,6 +666,259 @@ class OatmealStats:
         logging.log(level, "  # good frames: %i", self.n_good_frames)
 
 
+class OatmealSampleBatch:
+    """ Batch of timestamped samples sent by a device in an `SMPB` message.
+
+    Devices buffer samples with the C++ `OatmealSampleBatch` class and send
+    them with `OatmealPort::send_samples()`. Each `SMPB` message has the args
+    `<t0_us:int>,<n_values:int>,[<dt_us>,<v_0>,...,<v_n-1>,<dt_us>,...]`.
+
+    Attributes:
+        timestamps_us (array): device timestamp of each sample in microseconds
+            (from `micros()` on the device). Not wrapped at 2**32 within a
+            batch.
+        values (List[array]): one array per value channel, each holding one
+            value per sample.
+    """
+
+    OPCODE = 'SMPB'
+    """ Opcode of messages holding a batch of samples. """
+
+    def __init__(self, timestamps_us: array, values: List[array]) -> None:
+        self.timestamps_us = timestamps_us
+        self.values = values
+
+    def __len__(self) -> int:
+        return len(self.timestamps_us)
+
+    @classmethod
+    def from_msg(cls, msg: OatmealMsg) -> 'OatmealSampleBatch':
+        """ Unpack the samples in an `SMPB` message into arrays.
+
+        Raises:
+            OatmealParseError: if the message is not a valid sample batch
+        """
+        if msg.opcode != cls.OPCODE or len(msg.args) != 3:
+            raise OatmealParseError("Not a sample batch: %r" % (msg))
+        t0_us, n_values, flat = msg.args
+        if (not isinstance(t0_us, int) or not isinstance(n_values, int) or
+                not isinstance(flat, list) or n_values < 0 or
+                len(flat) % (n_values+1) != 0 or
+                not all(isinstance(x, int) for x in flat)):
+            raise OatmealParseError("Invalid sample batch: %r" % (msg))
+        stride = n_values+1
+        timestamps_us = array('q')
+        t_us = t0_us
+        for dt_us in flat[0::stride]:
+            t_us += dt_us
+            timestamps_us.append(t_us)
+        values = [array('q', flat[i+1::stride]) for i in range(n_values)]
+        return cls(timestamps_us, values)
+
+    def __repr__(self) -> str:
+        return "%s(%r, %r)" % (self.__class__.__name__,
+                               self.timestamps_us, self.values)
+
+
+class OatmealLatencyStats:
+    """ Running statistics over a series of latencies (seconds). """
+
+    def __init__(self) -> None:
+        self.n = 0
+        self.total = 0.0
+        self.min = None  # type: Optional[float]
+        self.max = None  # type: Optional[float]
+        self.last = None  # type: Optional[float]
+
+    def add(self, latency: float) -> None:
+        """ Record a new latency measurement in seconds. """
+        self.n += 1
+        self.total += latency
+        self.min = latency if self.min is None else min(self.min, latency)
+        self.max = latency if self.max is None else max(self.max, latency)
+        self.last = latency
+
+    @property
+    def mean(self) -> Optional[float]:
+        """ Mean of all latencies recorded, or None if there are none. """
+        return self.total / self.n if self.n else None
+
+    def __repr__(self) -> str:
+        return "%s(n=%i, min=%r, mean=%r, max=%r)" % (
+            self.__class__.__name__, self.n, self.min, self.mean, self.max)
+
+
+class OatmealClockSync:
+    """ Estimate a device's clock relative to host time from `TIM` exchanges.
+
+    Each exchange gives four timestamps, as in NTP: the host sends a `TIMR` at
+    host time `t1`, the device reads it at device time `rx_us` and starts its
+    `TIMA` reply at `tx_us`, which the host reads at host time `t4`. The device
+    clock is `micros()`, which wraps every 2**32 microseconds.
+
+    The estimate is a least squares fit of device time against host time over
+    the recent exchanges with the shortest round trips, giving an offset and a
+    drift (relative clock rate error) that are refined with every exchange.
+
+    Args:
+        max_samples: number of recent exchanges to fit the clock model to.
+
+    Attributes:
+        upstream (OatmealLatencyStats): host -> device one-way latencies
+        downstream (OatmealLatencyStats): device -> host one-way latencies
+        round_trip (OatmealLatencyStats): round trip times less the time
+            spent on the device
+    """
+
+    DEVICE_CLOCK_WRAP_US = 2**32
+    """ Device timestamps (`micros()`) wrap at this value. """
+
+    def __init__(self, max_samples: int = 32) -> None:
+        # (host_mid_time, device_mid_time, round_trip) in seconds
+        self.samples = deque(maxlen=max_samples)  # type: deque
+        self._device_base_us = 0
+        self._last_device_us = None  # type: Optional[int]
+        self._ref_host = 0.0  # host time the fit is relative to
+        self._ref_device = 0.0  # device time (sec) at _ref_host
+        self._rate = 1.0  # device seconds per host second
+        self.upstream = OatmealLatencyStats()
+        self.downstream = OatmealLatencyStats()
+        self.round_trip = OatmealLatencyStats()
+
+    @property
+    def synced(self) -> bool:
+        """ Whether at least one exchange has been recorded. """
+        return len(self.samples) > 0
+
+    @property
+    def drift(self) -> float:
+        """ Device clock rate error relative to the host e.g. 1e-4 means the
+        device clock runs 100ppm fast. """
+        return self._rate - 1.0
+
+    def offset(self, host_time: float = None) -> float:
+        """ Device time minus host time in seconds, at the host time given
+        (defaults to now). Device time is the unwrapped device clock. """
+        if host_time is None:
+            host_time = time.time()
+        return self.host_to_device(host_time) - host_time
+
+    def _unwrap(self, device_us: int) -> int:
+        """ Unwrap a device timestamp that follows the previous one. """
+        device_us %= self.DEVICE_CLOCK_WRAP_US
+        if self._last_device_us is not None:
+            last_raw = self._last_device_us - self._device_base_us
+            if device_us < last_raw - self.DEVICE_CLOCK_WRAP_US // 2:
+                self._device_base_us += self.DEVICE_CLOCK_WRAP_US
+        self._last_device_us = self._device_base_us + device_us
+        return self._last_device_us
+
+    def _nearest_unwrapped(self, device_us: int) -> int:
+        """ Unwrap a device timestamp to the value nearest the last exchange,
+        without changing any state. """
+        device_us %= self.DEVICE_CLOCK_WRAP_US
+        if self._last_device_us is None:
+            return device_us
+        half = self.DEVICE_CLOCK_WRAP_US // 2
+        n_wraps = (self._last_device_us - device_us + half) // self.DEVICE_CLOCK_WRAP_US
+        return device_us + n_wraps * self.DEVICE_CLOCK_WRAP_US
+
+    def _fit(self) -> None:
+        """ Fit device time against host time over the exchanges with the
+        shortest round trips (these have the least queuing delay). """
+        min_rtt = min(rtt for _, _, rtt in self.samples)
+        best = [(h, d) for h, d, rtt in self.samples if rtt <= min_rtt * 1.5 + 1e-4]
+        ref_host = sum(h for h, _ in best) / len(best)
+        ref_device = sum(d for _, d in best) / len(best)
+        var_host = sum((h - ref_host)**2 for h, _ in best)
+        # Need a long enough baseline before we can estimate the drift
+        if len(best) > 1 and var_host > 0 and best[-1][0] - best[0][0] > 1.0:
+            cov = sum((h - ref_host) * (d - ref_device) for h, d in best)
+            self._rate = cov / var_host
+        self._ref_host, self._ref_device = ref_host, ref_device
+
+    def add_exchange(self, t1: float, rx_us: int, tx_us: int, t4: float) -> None:
+        """ Record a completed time sync exchange.
+
+        Args:
+            t1: host time the request was sent (seconds)
+            rx_us: device time the request was received (microseconds)
+            tx_us: device time the response was sent (microseconds)
+            t4: host time the response was received (seconds)
+        """
+        rx = self._unwrap(rx_us) / 1e6
+        tx = self._unwrap(tx_us) / 1e6
+        rtt = (t4 - t1) - (tx - rx)
+        self.samples.append(((t1 + t4) / 2, (rx + tx) / 2, rtt))
+        self._fit()
+        self.round_trip.add(rtt)
+        self.upstream.add(self.device_to_host(rx_us) - t1)
+        self.downstream.add(t4 - self.device_to_host(tx_us))
+
+    def device_to_host(self, device_us: int) -> float:
+        """ Convert a device timestamp (e.g. from a heartbeat or
+        :class:`OatmealSampleBatch`) into host time in seconds. """
+        device = self._nearest_unwrapped(device_us) / 1e6
+        return self._ref_host + (device - self._ref_device) / self._rate
+
+    def host_to_device(self, host_time: float) -> float:
+        """ Convert a host time into (unwrapped) device time in seconds. """
+        return self._ref_device + (host_time - self._ref_host) * self._rate
+
+    def __repr__(self) -> str:
+        return "%s(offset=%r, drift=%r, rtt=%r)" % (
+            self.__class__.__name__,
+            self.offset() if self.synced else None,
+            self.drift, self.round_trip)
+
+
+class OatmealBurstResult:
+    """ Results of a link saturation test run with
+    :meth:`OatmealPort.burst_test()`.
+
+    Attributes:
+        n_frames (int): number of frames the device sent
+        frame_len (int): length of each frame in bytes (excluding the newline)
+        device_elapsed (float): seconds the device took to write all frames
+        host_elapsed (float): seconds between receiving the ack and receiving
+            the done message on the host
+        n_received (Optional[int]): number of burst frames received intact,
+            or None if the port does not queue background messages
+    """
+
+    def __init__(self, n_frames: int, frame_len: int, device_elapsed: float,
+                 host_elapsed: float, n_received: Optional[int]) -> None:
+        self.n_frames = n_frames
+        self.frame_len = frame_len
+        self.device_elapsed = device_elapsed
+        self.host_elapsed = host_elapsed
+        self.n_received = n_received
+
+    @property
+    def n_bytes(self) -> int:
+        """ Bytes sent in burst frames, including the newline after each """
+        return self.n_frames * (self.frame_len + 1)
+
+    @property
+    def device_bytes_per_sec(self) -> Optional[float]:
+        """ Rate at which the device wrote out bytes """
+        return (self.n_bytes / self.device_elapsed
+                if self.device_elapsed > 0 else None)
+
+    @property
+    def host_bytes_per_sec(self) -> Optional[float]:
+        """ Rate at which the host received bytes """
+        return (self.n_bytes / self.host_elapsed
+                if self.host_elapsed > 0 else None)
+
+    def __repr__(self) -> str:
+        return "%s(n_frames=%i, frame_len=%i, n_received=%r, " \
+               "device_bytes_per_sec=%r, host_bytes_per_sec=%r)" % (
+                   self.__class__.__name__, self.n_frames, self.frame_len,
+                   self.n_received, self.device_bytes_per_sec,
+                   self.host_bytes_per_sec)
+
+
 class OatmealDataMirror(ABC):
     """ Abstract class that describes a handler that mirrors data sent between
     this computer and the UART device it is communicating with. """
@@ -720,6 +980,61 @@ class OatmealUDPMirror(OatmealDataMirror):
             self.udp_sock_outgoing.close()
 
 
+class OatmealCaptureMirror(OatmealDataMirror):
+    """ Record incoming and outgoing UART data to a capture file, with the
+    host time each chunk of data was read or written. Read captures back
+    with :meth:`read_records()`, or export the values they hold with
+    :mod:`oatmeal.export`.
+
+    A capture is a sequence of records, each a header (`RECORD_HEADER`:
+    host time in seconds as a double, direction, data length) followed by
+    the data, all little endian.
+
+    Args:
+        path: file to write the capture to. Appended to if it exists.
+    """
+
+    RECORD_HEADER = struct.Struct('<dBI')
+    INCOMING = 0
+    OUTGOING = 1
+
+    def __init__(self, path: str) -> None:
+        self.fh = open(path, 'ab')
+
+    def _write(self, direction: int, data: bytes) -> None:
+        self.fh.write(self.RECORD_HEADER.pack(time.time(), direction,
+                                              len(data)))
+        self.fh.write(data)
+
+    def incoming_data(self, data: bytes) -> None:
+        self._write(self.INCOMING, data)
+
+    def outgoing_data(self, data: bytes) -> None:
+        self._write(self.OUTGOING, data)
+
+    def close(self) -> None:
+        self.fh.close()
+
+    @classmethod
+    def read_records(cls, path: str) -> Iterator[Tuple[float, int, bytes]]:
+        """ Read a capture file, stopping at a truncated final record.
+
+        Returns:
+            Iterator of (host_time, direction, data) tuples.
+        """
+        header = cls.RECORD_HEADER
+        with open(path, 'rb') as fh:
+            while True:
+                head = fh.read(header.size)
+                if len(head) < header.size:
+                    return
+                t, direction, n_bytes = header.unpack(head)
+                data = fh.read(n_bytes)
+                if len(data) < n_bytes:
+                    return
+                yield t, direction, data
+
+
 class _PortState(Enum):
     WAIT_ON_START = 0
     WAIT_ON_END = 1
@@ -745,23 +1060,24 @@ class OatmealProtocol:
     """
 
     @staticmethod
-    def convert_frame(frame: bytearray, stats: OatmealStats,
-                      max_frame_len: int) -> Optional[OatmealMsg]:
+    def validate_frame(frame: ByteLike, stats: OatmealStats,
+                       max_frame_len: int) -> bool:
         """
-        Check frame is valid, convert to OatmealMsg
+        Check a frame's length, start and end bytes and checksums, without
+        decoding its arguments.
 
         Args:
             frame: bytes that represent this Oatmeal Protocol frame
-            stats: statistics to update while parsing this frame
+            stats: statistics to update with any error found
 
         Returns:
-            OatmealMsg or None on error
+            True if the frame can be passed to :meth:`OatmealMsg.decode()`
         """
         if len(frame) < OatmealMsg.MIN_FRAME_LEN:
             logging.warning("Frame too short: (%i < %i) %r",
                             len(frame), OatmealMsg.MIN_FRAME_LEN, frame)
             stats.n_frame_too_short += 1
-            return None  # BAD frame: too short
+            return False  # BAD frame: too short
 
         if len(frame) > max_frame_len:
             stats.n_frame_too_long += 1
@@ -769,29 +1085,47 @@ class OatmealProtocol:
                             len(frame), max_frame_len, frame)
             if len(frame) > _max_frame_hard_limit(max_frame_len):
                 logging.warning("Discarding frame.")
-                return None  # BAD frame: too long
+                return False  # BAD frame: too long
 
         if frame[0] != OatmealMsg.FRAME_START_BYTE:
             logging.warning("Bad start byte: %r", frame)
             stats.n_missing_start_byte += 1
-            return None  # BAD frame: missing start byte
+            return False  # BAD frame: missing start byte
 
         if frame[-3] != OatmealMsg.FRAME_END_BYTE:
             logging.warning("Bad end byte: %r", frame)
             stats.n_missing_end_byte += 1
-            return None  # BAD frame: missing end byte
+            return False  # BAD frame: missing end byte
 
         checklen = OatmealMsg.length_checksum(len(frame))
         if frame[-2] != checklen:
             logging.warning("Bad checklen: %r", frame)
             stats.n_bad_checksums += 1
-            return None  # BAD frame: checklen
+            return False  # BAD frame: checklen
 
         checksum = OatmealMsg.calc_checksum(frame[:-1])
         if frame[-1] != checksum:
             logging.warning("Bad checksum: %r", frame)
             stats.n_bad_checksums += 1
-            return None  # BAD frame: checksum
+            return False  # BAD frame: checksum
+
+        return True
+
+    @staticmethod
+    def convert_frame(frame: bytearray, stats: OatmealStats,
+                      max_frame_len: int) -> Optional[OatmealMsg]:
+        """
+        Check frame is valid, convert to OatmealMsg
+
+        Args:
+            frame: bytes that represent this Oatmeal Protocol frame
+            stats: statistics to update while parsing this frame
+
+        Returns:
+            OatmealMsg or None on error
+        """
+        if not OatmealProtocol.validate_frame(frame, stats, max_frame_len):
+            return None
 
         try:
             msg = OatmealMsg.decode(frame)
@@ -808,14 +1142,18 @@ class OatmealProtocol:
                         exit_token: Event, outgoing_msg_pipe: Connection = None,
                         data_mirror: OatmealDataMirror = None,
                         stats: OatmealStats = None,
-                        max_frame_len: int = OatmealMsg.DEFAULT_MAX_FRAME_LEN) \
-            -> Iterator[OatmealMsg]:
+                        max_frame_len: int = OatmealMsg.DEFAULT_MAX_FRAME_LEN,
+                        decode: bool = True) -> Iterator[Any]:
         """
         Looping UART read/write method. Called by a background process.
         Frames are read from the `serial_port`, parsed and yielded. Blocks
         until a message is read and yielded or `exit_token` is set.
         Outgoing frames (bytearrays) are read from `outgoing_msg_pipe` and
         written to the serial port.
+
+        If `decode` is False, frames are only validated (see
+        :meth:`validate_frame()`) and yielded as bytes, for decoding
+        elsewhere (see :class:`oatmeal.pool.OatmealWorkerPool`).
         """
         # stats
         if stats is None:
@@ -876,10 +1214,16 @@ class OatmealProtocol:
                     elif state == _PortState.WAIT_ON_CHECKSUM:
                         # We've just read the checksum which completes a frame
                         frame_in.append(b)
-                        msg = OatmealProtocol.convert_frame(frame_in, stats,
-                                                            max_frame_len)
-                        if msg is not None:
-                            yield msg
+                        if not decode:
+                            if OatmealProtocol.validate_frame(frame_in, stats,
+                                                              max_frame_len):
+                                yield bytes(frame_in)
+                        else:
+                            msg = OatmealProtocol.convert_frame(
+                                frame_in, stats, max_frame_len)
+                            if msg is not None:
+                                msg.recv_time = time.time()
+                                yield msg
                         frame_in.clear()
                         state = _PortState.WAIT_ON_START
 
@@ -937,6 +1281,11 @@ class _OatmealPortThread:
         self.msg_pipe = msg_pipe_fg
         self.other_pipe = other_pipe_fg
         self.exit_token = Event()
+        # Only updated by the background thread, read without locking
+        self.stats = OatmealStats()
+        # Functions to call with the response with each token, instead of
+        # passing it to msg_pipe. Entries are removed when called.
+        self.intercepts = {}  # type: Dict[str, Callable[[OatmealMsg], None]]
         # Encapsulate a thread rather than extend to ensure we only pass
         # instance variables to the background thread that we intend to
         self.thread = Thread(target=_OatmealPortThread._read_msgs_loop,
@@ -944,7 +1293,9 @@ class _OatmealPortThread:
                              kwargs=dict(other_pipe=other_pipe_bg,
                                          discard_bg_msgs=discard_bg_msgs,
                                          data_mirror=data_mirror,
-                                         max_frame_len=max_frame_len),
+                                         stats=self.stats,
+                                         max_frame_len=max_frame_len,
+                                         intercepts=self.intercepts),
                              daemon=True)  # die on program exit
 
     @staticmethod
@@ -954,12 +1305,16 @@ class _OatmealPortThread:
                         other_pipe: Connection = None,
                         discard_bg_msgs: bool = False,
                         data_mirror: OatmealDataMirror = None,
-                        max_frame_len: int = OatmealMsg.DEFAULT_MAX_FRAME_LEN):
+                        stats: OatmealStats = None,
+                        max_frame_len: int = OatmealMsg.DEFAULT_MAX_FRAME_LEN,
+                        intercepts: Dict[str, Callable[[OatmealMsg], None]] = None):
         """
         Looping UART read/write method. Called by a background process.
         Outgoing frames (bytearrays) are read from `msg_pipe` and written to
         the serial port. Frames are read from the `serial_port`, parsed,
-        and placed in `msg_pipe` or `other_pipe` as :class:`OatmealMsg`.
+        and placed in `msg_pipe` or `other_pipe` as :class:`OatmealMsg`,
+        except for responses whose token is in `intercepts`, which are passed
+        to the function stored there instead.
         """
         # Don't forward signals to this process from the parent
         # (doesn't work on windows, so test)
@@ -970,21 +1325,32 @@ class _OatmealPortThread:
                 warnings.warn("Cannot call setpgrp()")
                 pass
 
-        stats = OatmealStats()
+        if stats is None:
+            stats = OatmealStats()
         msg_iter = OatmealProtocol.read_frame_loop(serial_port,
                                                    exit_token, msg_pipe,
                                                    data_mirror,
                                                    stats,
                                                    max_frame_len)
 
-        for msg in msg_iter:
-            if msg.flag == OatmealProtocol.BACKGROUND_MSG_FLAG:
-                if other_pipe is not None:
-                    other_pipe.send(msg)
-                elif not discard_bg_msgs:
-                    msg_pipe.send(msg)
-            else:
-                msg_pipe.send(msg)
+        try:
+            for msg in msg_iter:
+                if msg.flag == OatmealProtocol.BACKGROUND_MSG_FLAG:
+                    if other_pipe is not None:
+                        other_pipe.send(msg)
+                    elif not discard_bg_msgs:
+                        msg_pipe.send(msg)
+                else:
+                    callback = (intercepts.pop(msg.token, None) if intercepts
+                                else None)
+                    if callback is not None:
+                        callback(msg)
+                    else:
+                        msg_pipe.send(msg)
+        except (OSError, serial.SerialException) as err:
+            # e.g. the device was unplugged
+            logging.warning("Lost connection to %s: %r",
+                            getattr(serial_port, 'name', None), err)
 
         logging.info("Stopped reading/writing UART.")
         stats.log_stats()
@@ -1100,6 +1466,23 @@ class OatmealBgMsgHandlerBase(ABC):
         """
         raise NotImplementedError
 
+    def handle_sample_batch(self, msg: OatmealMsg,
+                            batch: OatmealSampleBatch) -> None:
+        """
+        Handler called with every valid SMPB message received and the samples
+        unpacked from it. Defaults to calling :meth:`handle_misc_update()`.
+        """
+        self.handle_misc_update(msg)
+
+    def handle_var_update(self, msg: OatmealMsg,
+                          values: Dict[str, Any]) -> None:
+        """
+        Handler called with every valid VARB message received and the dict of
+        watched variables that changed. Defaults to calling
+        :meth:`handle_misc_update()`.
+        """
+        self.handle_misc_update(msg)
+
 
 class OatmealBgMsgHandler(OatmealBgMsgHandlerBase):
     """
@@ -1108,6 +1491,12 @@ class OatmealBgMsgHandler(OatmealBgMsgHandlerBase):
     - Logs log messages using the built-in :mod:`logging` module.
     - Exposes a `last_heartbeat` attribute by which the most recently received
       heartbeat message can be accessed.
+    - Exposes a `var_values` dict holding the latest value reported for each
+      watched variable.
+    - Records heartbeat values in `timeseries`, an
+      :class:`~oatmeal.timeseries.OatmealTimeSeriesStore`, if one is given.
+    - Exposes a `device_stats` dict of the totals of the error counts the
+      device reports in its heartbeats (see `DEVICE_STAT_KEYS`).
     - Considers a heartbeat to have been lost after 5 seconds, and logs this.
     """
 
@@ -1116,16 +1505,42 @@ class OatmealBgMsgHandler(OatmealBgMsgHandlerBase):
     this time (in seconds). If set to None, do not raise call
     missing_heartbeat() if we don't see heartbeats. """
 
+    DEVICE_STAT_KEYS = {'sh': 'frame_too_short',
+                        'lg': 'frame_too_long',
+                        'ms': 'missing_start_byte',
+                        'me': 'missing_end_byte',
+                        'bc': 'bad_checksums',
+                        'bb': 'illegal_character',
+                        'uo': 'unknown_opcode',
+                        'bm': 'bad_messages',
+                        'tx_too_long': 'tx_too_long',
+                        'budget_hits': 'budget_hits'}
+    """ Heartbeat keys of the counts the C++ `OatmealPort` reports and resets
+    with every heartbeat, and the `device_stats` keys they are summed in. """
+
     def __init__(self, *,
                  board_name: str,
-                 max_gap_sec: Optional[float] = MAX_HEARTBEAT_GAP_SEC) -> None:
+                 max_gap_sec: Optional[float] = MAX_HEARTBEAT_GAP_SEC,
+                 timeseries: Any = None) -> None:
         self.board_name = board_name
         self.last_heartbeat = None  # type: Optional[OatmealMsg]
+        self.var_values = {}  # type: Dict[str, Any]
+        self.device_stats = {}  # type: Dict[str, int]
+        self.timeseries = timeseries
         self.MAX_HEARTBEAT_GAP_SEC = max_gap_sec
 
     def handle_heartbeat(self, msg: OatmealMsg) -> None:
-        """ Store a new heartbeat as `self.last_heartbeat` """
+        """ Store a new heartbeat as `self.last_heartbeat`, add its error
+        counts to `self.device_stats` and record its values in
+        `self.timeseries` if set. """
         self.last_heartbeat = msg  # atomic update
+        for key, value in (msg.heartbeat or {}).items():
+            name = self.DEVICE_STAT_KEYS.get(key)
+            if name is not None and isinstance(value, int):
+                self.device_stats[name] = self.device_stats.get(name, 0) + value
+        if self.timeseries is not None and msg.heartbeat is not None:
+            self.timeseries.add_heartbeat(self.board_name, msg.heartbeat,
+                                          msg.recv_time)
 
     def missing_heartbeat(self, time_passed_sec: float) -> None:
         """ Warn that we've not seen a heartbeat in a while. """
@@ -1147,6 +1562,11 @@ class OatmealBgMsgHandler(OatmealBgMsgHandlerBase):
             logging.log(log_level, '[%s] %s',  # type: ignore
                         self.board_name, msg.args[1])  # type: ignore
 
+    def handle_var_update(self, msg: OatmealMsg,
+                          values: Dict[str, Any]) -> None:
+        """ Store updated values of watched variables in `self.var_values` """
+        self.var_values.update(values)
+
     def handle_misc_update(self, msg: OatmealMsg) -> None:
         """ Log message with :func:`logging.debug()` """
         logging.debug("[%s] misc update: %r" % (self.board_name, msg))
@@ -1217,7 +1637,8 @@ class OatmealPort:
                  mirror_data: Union[OatmealDataMirror, bool] = True,
                  max_frame_len: int = OatmealMsg.DEFAULT_MAX_FRAME_LEN,
                  bg_msg_handler: OatmealBgMsgHandler = None,
-                 queue_bg_msgs: bool = False) -> None:
+                 queue_bg_msgs: bool = False,
+                 retry_same_token: bool = False) -> None:
         """
         Create a new OatmealPort to listen for and send Oatmeal messages.
 
@@ -1237,6 +1658,11 @@ class OatmealPort:
                 messages. If set to `True`, the caller _must_ call
                 `read_bg_msg()` to clear the queue, otherwise memory will
                 eventually be exhausted and python will crash.
+            retry_same_token: resend requests with the same token when an ack
+                is missed, rather than a new one. Devices with a replay cache
+                (`OatmealPort::set_replay_cache()`) then recognize the
+                retransmission and resend their response instead of handling
+                the request again.
         """
         assert max_frame_len > OatmealMsg.MIN_FRAME_LEN
 
@@ -1281,6 +1707,7 @@ class OatmealPort:
         )
 
         # Set up beackground messsages (e.g. heartbeats) handling thread
+        self.bg_msg_handler = bg_msg_handler
         self.bg_stop = None  # type: Optional[Event]
         self.bg_thread = None   # type: Optional[Thread]
 
@@ -1294,6 +1721,11 @@ class OatmealPort:
                       bg_msg_handler),
                 daemon=True)  # die on program exit
 
+        # Device clock estimate, updated by sync_clock()
+        self.clock = OatmealClockSync()
+
+        self.retry_same_token = retry_same_token
+
         # stats
         self.n_missed_acks = 0
         self._start()
@@ -1302,6 +1734,12 @@ class OatmealPort:
         """ Get path for this serial port device """
         return self.serial_path
 
+    @property
+    def stats(self) -> OatmealStats:
+        """ Statistics on frames received from the device. Updated by the
+        background thread. """
+        return self.uart_port.stats
+
     def _start(self) -> None:
         """
         Start listening/sending packets and handling background messages
@@ -1356,6 +1794,16 @@ class OatmealPort:
                     last_hb_time = time.time()
                 elif msg.opcode == 'LOGB':
                     bg_msg_handler.handle_log_msg(msg)
+                elif msg.opcode == OatmealSampleBatch.OPCODE:
+                    try:
+                        batch = OatmealSampleBatch.from_msg(msg)
+                        bg_msg_handler.handle_sample_batch(msg, batch)
+                    except OatmealParseError:
+                        logging.warning("Invalid sample batch: %r", msg)
+                        bg_msg_handler.handle_misc_update(msg)
+                elif (msg.opcode == 'VARB' and len(msg.args) == 1 and
+                      isinstance(msg.args[0], dict)):
+                    bg_msg_handler.handle_var_update(msg, msg.args[0])
                 else:
                     bg_msg_handler.handle_misc_update(msg)
                 triggered_warning = False
@@ -1421,8 +1869,9 @@ class OatmealPort:
                 pass
             logging.debug("Missed ack: %r", msg)
             self.n_missed_acks += 1
-            # Set new token
-            msg.token = self.next_token()
+            # Set new token, unless the device should recognize the retry
+            if not self.retry_same_token:
+                msg.token = self.next_token()
 
         raise OatmealTimeout("No ACK! (%s retries, %s timeout)" % (
                           str(n_retries), str(timeout)))
@@ -1546,6 +1995,241 @@ class OatmealPort:
             self.tokenid = (self.tokenid + 1) % (len(letters)**n)
         return letters[t // len(letters)] + letters[t % len(letters)]
 
+    def sync_clock(self, timeout: float = DEFAULT_ACK_TIMEOUT_SEC) -> bool:
+        """
+        Run a single time sync exchange with the device and use it to refine
+        the estimate of the device clock in `self.clock`. Call regularly to
+        track the clock drift.
+
+        Exchanges are not retried since a retry would not give a usable
+        timing measurement.
+
+        Returns:
+            `True` if the exchange completed, `False` on timeout.
+
+        See also:
+            :class:`OatmealClockSync`
+        """
+        command = OatmealMsg("TIMR")
+        t1 = time.time()
+        try:
+            ack = self.send_and_ack(command, timeout=timeout, n_retries=0)
+        except OatmealTimeout:
+            return False
+        t4 = ack.recv_time if ack.recv_time is not None else time.time()
+        if (len(ack.args) != 2 or
+                not all(isinstance(x, int) for x in ack.args)):
+            raise OatmealError("Bad response: %r" % (ack))
+        rx_us, tx_us = ack.args
+        self.clock.add_exchange(t1, rx_us, tx_us, t4)
+        return True
+
+    def echo(self, *args: Any,
+             timeout: float = DEFAULT_ACK_TIMEOUT_SEC) -> float:
+        """
+        Send an echo request (`ECHR`) and wait for the device to send the
+        arguments back.
+
+        Args:
+            args: arguments for the device to echo back
+            timeout: How many seconds to wait for the echo
+
+        Raises:
+            OatmealTimeout: if no echo was received
+            OatmealError: if the echoed arguments differ from those sent
+
+        Returns:
+            Round trip time in seconds.
+        """
+        command = OatmealMsg("ECHR", *args)
+        t1 = time.time()
+        ack = self.send_and_ack(command, timeout=timeout, n_retries=0)
+        t2 = ack.recv_time if ack.recv_time is not None else time.time()
+        # Compare with the args as encoded, since floats are rounded
+        if ack.args != OatmealMsg.decode(bytearray(command.encode())).args:
+            raise OatmealError("Bad echo of %r: %r" % (command, ack))
+        return t2 - t1
+
+    def burst_test(self, n_frames: int, frame_len: int,
+                   timeout: float = None) -> OatmealBurstResult:
+        """
+        Ask the device to send `n_frames` frames of `frame_len` bytes as fast as
+        it can (`BSTR`), to measure the throughput of the link.
+
+        Burst frames are background messages (`BSTB`). They are only counted if
+        this port was created with `queue_bg_msgs=True`, in which case any
+        other background messages queued are discarded.
+
+        Args:
+            n_frames: number of frames to send. The device limits this, to 256
+                by default.
+            frame_len: length of each frame in bytes. The device limits this to
+                between the length of its shortest burst frame and its
+                maximum frame length.
+            timeout: seconds to wait for the burst to finish. Defaults to twice
+                the time it takes at the default baud rate, plus a second.
+
+        Raises:
+            OatmealTimeout: if the device did not ack or finish the burst
+
+        Returns:
+            :class:`OatmealBurstResult` describing the burst, with the number
+            and length of the frames the device actually sent.
+        """
+        if timeout is None:
+            timeout = 1 + 2 * n_frames * (frame_len + 1) * 10 / OATMEAL_BAUD_RATE
+        command = OatmealMsg("BSTR", n_frames, frame_len)
+        ack, done = self.send_and_done(command, n_ack_retries=0,
+                                       done_timeout=timeout)
+        if (len(ack.args) != 2 or len(done.args) != 2 or
+                not all(isinstance(x, int) for x in ack.args + done.args)):
+            raise OatmealError("Bad response: %r, %r" % (ack, done))
+        n_sent, frame_len = ack.args
+        host_elapsed = done.recv_time - ack.recv_time \
+            if done.recv_time and ack.recv_time else 0.0
+
+        n_received = None  # type: Optional[int]
+        if self.queue_bg_msgs:
+            n_received = 0
+            # Burst frames were read before the done message
+            while True:
+                msg = self.read_bg_msg(timeout=0.1)
+                if msg is None:
+                    break
+                n_received += (msg.opcode == "BSTB" and msg.token == ack.token)
+
+        return OatmealBurstResult(n_frames=n_sent, frame_len=frame_len,
+                                  device_elapsed=done.args[1] / 1e6,
+                                  host_elapsed=host_elapsed,
+                                  n_received=n_received)
+
+    def _send_var_request(self, msg: OatmealMsg, timeout: float,
+                          n_retries: int = DEFAULT_N_RETRIES) \
+            -> List[OatmealMsg]:
+        """ Send a variable registry request and read every frame of the
+        response, resending the request on a timeout like
+        :meth:`send_and_ack()`. Responses to other requests are dropped.
+
+        Raises:
+            OatmealError: if the device failed the request
+            OatmealTimeout: if no complete response was read
+
+        Returns:
+            The frames of the response. All but the last have args
+            `<vars:dict>,T`.
+        """
+        for _ in range(n_retries+1):
+            self.send(msg)
+            resps = []  # type: List[OatmealMsg]
+            try:
+                while True:
+                    resp = self.read(timeout=timeout)
+                    if (resp.command != msg.command or
+                            resp.token != msg.token):
+                        logging.warning("Dropped response %r while waiting "
+                                        "for a response to %r", resp, msg)
+                        continue
+                    if resp.flag == 'F':
+                        raise OatmealError("Device failed %r: variable %r" % (
+                            msg, resp.args[0] if resp.args else None))
+                    resps.append(resp)
+                    if len(resp.args) != 2 or resp.args[1] is not True:
+                        return resps
+            except OatmealTimeout:
+                pass
+            logging.debug("Missed response: %r", msg)
+            self.n_missed_acks += 1
+            # Set new token, unless the device should recognize the retry
+            if not self.retry_same_token:
+                msg.token = self.next_token()
+
+        raise OatmealTimeout("No response to %r (%s retries, %s timeout)" % (
+                             msg, str(n_retries), str(timeout)))
+
+    def _read_var_dicts(self, msg: OatmealMsg,
+                        timeout: float) -> Dict[str, Any]:
+        """ Send a variable registry request and merge the dicts of variable
+        values from all the frames of the response. """
+        values = {}  # type: Dict[str, Any]
+        for resp in self._send_var_request(msg, timeout):
+            if (resp.flag != 'A' or len(resp.args) != 2 or
+                    not isinstance(resp.args[0], dict)):
+                raise OatmealError("Bad response: %r" % (resp))
+            values.update(resp.args[0])
+        return values
+
+    def get_vars(self, *names: str,
+                 timeout: float = DEFAULT_ACK_TIMEOUT_SEC) -> Dict[str, Any]:
+        """
+        Get the values of variables registered on the device with an
+        `OatmealVarRegistry`, in a single request (`VGTR`).
+
+        Raises:
+            OatmealError: if a variable is not known to the device
+
+        Returns:
+            dict of variable names to values
+        """
+        return self._read_var_dicts(OatmealMsg("VGTR", *names), timeout)
+
+    def set_vars(self, values: Dict[str, Any],
+                 timeout: float = DEFAULT_ACK_TIMEOUT_SEC) -> None:
+        """
+        Set variables registered on the device with an `OatmealVarRegistry`,
+        in a single request (`VSTR`). Either all are set, or none are.
+
+        Args:
+            values: dict of variable names to values
+
+        Raises:
+            OatmealError: if a variable is not known, is read-only or the
+                value is of the wrong type
+        """
+        msg = OatmealMsg("VSTR", values)
+        self._send_var_request(msg, timeout)
+
+    def dump_vars(self, timeout: float = DEFAULT_ACK_TIMEOUT_SEC) \
+            -> Dict[str, Any]:
+        """
+        Get the values of all variables registered on the device with an
+        `OatmealVarRegistry` (`VDMR`).
+
+        Returns:
+            dict of variable names to values
+        """
+        return self._read_var_dicts(OatmealMsg("VDMR"), timeout)
+
+    def watch_vars(self, *names: str, deadband: float = 0.0,
+                   min_interval: float = 0.1,
+                   timeout: float = DEFAULT_ACK_TIMEOUT_SEC) -> None:
+        """
+        Ask the device to send a `VARB` background message whenever any of
+        the named registered variables changes (`VWTR`). Updates are passed
+        to :meth:`OatmealBgMsgHandlerBase.handle_var_update()`.
+
+        Args:
+            deadband: numeric variables must change by more than this since
+                they were last sent before a new update is sent
+            min_interval: minimum time in seconds between updates of the
+                same variable
+
+        Raises:
+            OatmealError: if a variable is not known or the device has no
+                room for more watches
+        """
+        msg = OatmealMsg("VWTR", int(min_interval * 1000), float(deadband),
+                         *names)
+        self._send_var_request(msg, timeout)
+
+    def unwatch_vars(self, *names: str,
+                     timeout: float = DEFAULT_ACK_TIMEOUT_SEC) -> None:
+        """
+        Stop watching the named variables (`VUWR`), or all watched variables
+        if no names are given.
+        """
+        msg = OatmealMsg("VUWR", *names)
+        self._send_var_request(msg, timeout)
+
     def ask_who(self, timeout: float = 1, n_retries: int = 2) \
             -> OatmealDeviceDetails:
         """
@@ -1563,3 +2247,38 @@ class OatmealPort:
             raise OatmealError("Bad response: %r" % (ack))
         role, instance_idx, hardware_id, version = ack.args
         return OatmealDeviceDetails(role, instance_idx, hardware_id, version)
+
+    def ask_who_async(self,
+                      callback: Callable[[Optional[OatmealDeviceDetails]], None],
+                      timeout: float = 1) -> None:
+        """
+        Send a single discovery request without waiting for the response.
+        The response is not returned by :meth:`read()`, so this may be called
+        while other requests are in flight.
+
+        Args:
+            callback: called once, on a background thread, with the device
+                      details or None if no valid response arrived within
+                      `timeout` seconds
+        """
+        msg = OatmealMsg("DISR", token=self.next_token())
+        intercepts = self.uart_port.intercepts
+
+        def on_response(ack: OatmealMsg) -> None:
+            timer.cancel()
+            if ack.opcode != "DISA" or len(ack.args) != 4:
+                logging.warning("Bad response: %r", ack)
+                callback(None)
+            else:
+                callback(OatmealDeviceDetails(*ack.args))
+
+        def on_timeout() -> None:
+            # Whichever of the reader and the timer removes the entry wins
+            if intercepts.pop(msg.token, None) is not None:
+                callback(None)
+
+        timer = Timer(timeout, on_timeout)
+        timer.daemon = True
+        intercepts[msg.token] = on_response
+        timer.start()
+        self.send(msg)
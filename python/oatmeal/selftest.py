@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+
+# selftest.py
+# Copyright 2019, Shield Diagnostics and the Oatmeal Protocol contributors
+# License: Apache 2.0
+
+"""
+Measure the latency and throughput of the link to any Oatmeal device, using
+the built-in echo (`ECHR`) and burst (`BSTR`) commands. Usage::
+
+    python3 -m oatmeal.selftest /dev/ttyUSB0
+"""
+
+import argparse
+import logging
+import random
+import string
+
+import serial
+
+from .protocol import OatmealPort, OatmealLatencyStats, OatmealBurstResult, \
+                      OATMEAL_BAUD_RATE, OatmealTimeout
+
+
+def measure_latency(port: OatmealPort, n_echos: int = 100,
+                    payload_len: int = 32) -> OatmealLatencyStats:
+    """
+    Measure round trip times with echo requests carrying a random string.
+
+    Args:
+        port: port connected to the device
+        n_echos: number of echo requests to send
+        payload_len: number of characters in the string echoed
+
+    Returns:
+        Round trip times of the echos that were returned. Echos that timed out
+        are not included.
+    """
+    stats = OatmealLatencyStats()
+    for _ in range(n_echos):
+        payload = ''.join(random.choice(string.ascii_letters)
+                          for _ in range(payload_len))
+        try:
+            stats.add(port.echo(payload))
+        except OatmealTimeout:
+            logging.warning("Echo timed out")
+    return stats
+
+
+def measure_throughput(port: OatmealPort, n_frames: int = 200,
+                       frame_len: int = 127) -> OatmealBurstResult:
+    """
+    Measure the throughput of the link from the device to the host.
+
+    See :meth:`OatmealPort.burst_test()`.
+    """
+    return port.burst_test(n_frames, frame_len)
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(
+        description="Measure the latency and throughput of the link to an "
+                    "Oatmeal device.")
+    parser.add_argument("path", help="serial port the device is connected to")
+    parser.add_argument("--baud", type=int, default=OATMEAL_BAUD_RATE,
+                        help="baud rate (default: %(default)s)")
+    parser.add_argument("--echos", type=int, default=100,
+                        help="number of echo requests (default: %(default)s)")
+    parser.add_argument("--payload-len", type=int, default=32,
+                        help="length of string echoed (default: %(default)s)")
+    parser.add_argument("--frames", type=int, default=200,
+                        help="number of burst frames (default: %(default)s)")
+    parser.add_argument("--frame-len", type=int, default=127,
+                        help="length of burst frames (default: %(default)s)")
+    args = parser.parse_args()
+
+    serial_fh = serial.Serial(args.path, args.baud, timeout=0, exclusive=True)
+    port = OatmealPort(serial_fh, mirror_data=False, queue_bg_msgs=True)
+    try:
+        port.flush()
+        rtt = measure_latency(port, args.echos, args.payload_len)
+        print("Echo: %i/%i returned" % (rtt.n, args.echos))
+        if rtt.min is not None and rtt.max is not None and rtt.mean:
+            print("  round trip ms: min %.2f, mean %.2f, max %.2f" % (
+                rtt.min * 1e3, rtt.mean * 1e3, rtt.max * 1e3))
+
+        burst = measure_throughput(port, args.frames, args.frame_len)
+        print("Burst: %i frames of %i bytes, %r received" % (
+            burst.n_frames, burst.frame_len, burst.n_received))
+        print("  device sent: %.0f bytes/sec" % (burst.device_bytes_per_sec or 0))
+        print("  host received: %.0f bytes/sec" % (burst.host_bytes_per_sec or 0))
+    finally:
+        port.stop()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,250 @@
+#!/usr/bin/env python3
+
+# timeseries.py
+# Copyright 2019, Shield Diagnostics and the Oatmeal Protocol contributors
+# License: Apache 2.0
+
+"""
+In-memory store of heartbeat values over time, for plotting device state
+without reparsing logs. Every numeric heartbeat value is kept per device and
+key in fixed-size rings: one of raw samples and one per downsampling window
+(e.g. 10s, 1min, 10min) holding the min, max and mean of each window. Older
+data is only kept at coarser resolutions. Usage::
+
+    store = OatmealTimeSeriesStore()
+    handler = OatmealBgMsgHandler(board_name="Valve", timeseries=store)
+    ...
+    points = store.query("Valve", "T_mC", time.time() - 3600, max_points=200)
+"""
+
+from typing import Dict, List, Optional, Sequence, Any, NamedTuple
+from array import array
+from threading import Lock
+import time
+
+
+OatmealSeriesPoint = NamedTuple('OatmealSeriesPoint', [('t', float),
+                                                       ('min', float),
+                                                       ('max', float),
+                                                       ('mean', float),
+                                                       ('n', int)])
+""" Summary of the samples in one window starting at host time `t`. Raw
+samples have `min == max == mean` and `n == 1`. """
+
+
+class OatmealRing:
+    """ Fixed-size ring of rows of floats, ordered by their first column.
+    Once full, adding a row overwrites the oldest.
+
+    Args:
+        capacity: number of rows kept
+        n_cols: number of columns in each row
+    """
+
+    def __init__(self, capacity: int, n_cols: int) -> None:
+        assert capacity > 0
+        self.capacity = capacity
+        self.cols = [array('d', [0.0]) * capacity for _ in range(n_cols)]
+        self._start = 0
+        self._len = 0
+
+    def __len__(self) -> int:
+        return self._len
+
+    def append(self, *row: float) -> None:
+        """ Add a row. Its first column must not be less than the last's. """
+        i = (self._start + self._len) % self.capacity
+        for col, x in zip(self.cols, row):
+            col[i] = x
+        if self._len < self.capacity:
+            self._len += 1
+        else:
+            self._start = (self._start + 1) % self.capacity
+
+    def key(self, i: int) -> float:
+        """ First column of the `i`th oldest row. """
+        return self.cols[0][(self._start + i) % self.capacity]
+
+    def bisect(self, x: float) -> int:
+        """ Index of the first row whose first column is >= `x`. """
+        lo, hi = 0, self._len
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self.key(mid) < x:
+                lo = mid + 1
+            else:
+                hi = mid
+        return lo
+
+    def rows(self, lo: int, hi: int) -> List[tuple]:
+        """ Rows `lo` to `hi`-1, oldest first. """
+        idx = [(self._start + i) % self.capacity for i in range(lo, hi)]
+        return list(zip(*[[col[i] for i in idx] for col in self.cols]))
+
+
+class OatmealSeries:
+    """ Values of one heartbeat key from one device.
+
+    Args:
+        capacity: number of raw samples and of windows kept at each resolution
+        windows: downsampling window lengths in seconds, shortest first
+
+    Attributes:
+        n_dropped (int): samples ignored for being older than the last one
+    """
+
+    def __init__(self, capacity: int, windows: Sequence[float]) -> None:
+        self.raw = OatmealRing(capacity, 2)  # t, value
+        self.windows = list(windows)
+        # t, min, max, mean, n of each closed window
+        self.tiers = [OatmealRing(capacity, 5) for _ in self.windows]
+        # open window of each tier: [t, min, max, total, n]
+        self._open = [None] * len(self.windows)  # type: List[Optional[list]]
+        self._last_t = None  # type: Optional[float]
+        self.n_dropped = 0
+
+    def add(self, t: float, value: float) -> None:
+        """ Record a sample taken at host time `t` (seconds). """
+        if self._last_t is not None and t < self._last_t:
+            self.n_dropped += 1
+            return
+        self._last_t = t
+        self.raw.append(t, value)
+        for tier, window in enumerate(self.windows):
+            acc = self._open[tier]
+            if acc is not None and t >= acc[0] + window:
+                self.tiers[tier].append(acc[0], acc[1], acc[2],
+                                        acc[3] / acc[4], acc[4])
+                acc = None
+            if acc is None:
+                self._open[tier] = [(t // window) * window,
+                                    value, value, value, 1]
+            else:
+                acc[1] = min(acc[1], value)
+                acc[2] = max(acc[2], value)
+                acc[3] += value
+                acc[4] += 1
+
+    def _covers(self, tier: int, t: float) -> bool:
+        """ Whether a resolution (0 = raw) still holds every sample since
+        host time `t`. """
+        ring = self.raw if tier == 0 else self.tiers[tier-1]
+        return len(ring) < ring.capacity or ring.key(0) <= t
+
+    def _query_tier(self, tier: int, t0: float,
+                    t1: float) -> List[OatmealSeriesPoint]:
+        if tier == 0:
+            lo, hi = self.raw.bisect(t0), self.raw.bisect(t1)
+            return [OatmealSeriesPoint(t, v, v, v, 1)
+                    for t, v in self.raw.rows(lo, hi)]
+        window = self.windows[tier-1]
+        ring = self.tiers[tier-1]
+        # Include the window that t0 falls in
+        lo, hi = ring.bisect(t0 - window), ring.bisect(t1)
+        points = [OatmealSeriesPoint(t, mn, mx, mean, int(n))
+                  for t, mn, mx, mean, n in ring.rows(lo, hi)
+                  if t + window > t0]
+        acc = self._open[tier-1]
+        if acc is not None and acc[0] < t1 and acc[0] + window > t0:
+            points.append(OatmealSeriesPoint(acc[0], acc[1], acc[2],
+                                             acc[3] / acc[4], acc[4]))
+        return points
+
+    def _count(self, tier: int, t0: float, t1: float) -> int:
+        """ Upper bound on the points a query at a resolution returns. """
+        if tier == 0:
+            return self.raw.bisect(t1) - self.raw.bisect(t0)
+        ring = self.tiers[tier-1]
+        return (ring.bisect(t1) - ring.bisect(t0 - self.windows[tier-1]) +
+                (self._open[tier-1] is not None))
+
+    def query(self, t0: float, t1: float,
+              max_points: Optional[int] = None) -> List[OatmealSeriesPoint]:
+        """ Samples from host time `t0` up to (excluding) `t1`, at the finest
+        resolution that has not yet overwritten data since `t0` and returns
+        at most `max_points` points. Falls back to the coarsest resolution.
+        """
+        coarsest = len(self.windows)
+        for tier in range(coarsest):
+            if (self._covers(tier, t0) and
+                    (max_points is None or
+                     self._count(tier, t0, t1) <= max_points)):
+                return self._query_tier(tier, t0, t1)
+        return self._query_tier(coarsest, t0, t1)
+
+
+class OatmealTimeSeriesStore:
+    """ Thread-safe in-memory store of heartbeat values, keyed by device name
+    and heartbeat key. Only int, float and bool values are recorded (bools as
+    0 and 1).
+
+    Args:
+        capacity: number of raw samples and of windows kept per key at each
+                  resolution
+        windows: downsampling window lengths in seconds, shortest first.
+                 With the defaults and 1 heartbeat per second, a key keeps
+                 17 minutes of raw samples, 2.8 hours of 10s windows, 17
+                 hours of 1 minute windows and 7 days of 10 minute windows.
+    """
+
+    DEFAULT_CAPACITY = 1024
+    DEFAULT_WINDOWS = (10.0, 60.0, 600.0)
+
+    def __init__(self, capacity: int = DEFAULT_CAPACITY,
+                 windows: Sequence[float] = DEFAULT_WINDOWS) -> None:
+        assert all(w > 0 for w in windows)
+        assert list(windows) == sorted(windows)
+        self.capacity = capacity
+        self.windows = tuple(windows)
+        self._series = {}  # type: Dict[str, Dict[str, OatmealSeries]]
+        self._lock = Lock()
+
+    def add(self, device: str, key: str, t: float, value: float) -> None:
+        """ Record a value of a heartbeat key at host time `t` (seconds). """
+        with self._lock:
+            keys = self._series.setdefault(device, {})
+            series = keys.get(key)
+            if series is None:
+                series = keys[key] = OatmealSeries(self.capacity, self.windows)
+            series.add(t, value)
+
+    def add_heartbeat(self, device: str, heartbeat: Dict[str, Any],
+                      t: Optional[float] = None) -> None:
+        """ Record every numeric value in a heartbeat (e.g.
+        :attr:`OatmealMsg.heartbeat`) received at host time `t` (defaults to
+        now). """
+        t = time.time() if t is None else t
+        for key, value in heartbeat.items():
+            if isinstance(value, (bool, int, float)):
+                self.add(device, key, t, float(value))
+
+    def devices(self) -> List[str]:
+        """ Names of the devices with recorded values. """
+        with self._lock:
+            return sorted(self._series)
+
+    def keys(self, device: str) -> List[str]:
+        """ Heartbeat keys recorded for a device. """
+        with self._lock:
+            return sorted(self._series.get(device, {}))
+
+    def query(self, device: str, key: str, t0: float,
+              t1: Optional[float] = None,
+              max_points: Optional[int] = None) -> List[OatmealSeriesPoint]:
+        """ Values of a heartbeat key between host times `t0` and `t1`.
+
+        Args:
+            t0: start of the range (seconds, as :func:`time.time()`)
+            t1: end of the range, exclusive. Defaults to now.
+            max_points: use the finest resolution that returns at most this
+                        many points. If None, use the finest resolution that
+                        still holds data back to `t0`.
+
+        Returns:
+            Points oldest first. Windows overlapping the range are included.
+            Empty if nothing was recorded for this device and key.
+        """
+        t1 = time.time() if t1 is None else t1
+        with self._lock:
+            series = self._series.get(device, {}).get(key)
+            return [] if series is None else series.query(t0, t1, max_points)
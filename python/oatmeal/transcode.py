@@ -0,0 +1,302 @@
+#!/usr/bin/env python3
+
+# transcode.py
+# Copyright 2019, Shield Diagnostics and the Oatmeal Protocol contributors
+# License: Apache 2.0
+
+"""
+Convert Oatmeal arguments to JSON and back in one pass over the text, without
+building Python objects for the values. For bridging devices to JSON tooling
+this does the work of `json.dumps(OatmealMsg.decode(frame).args)` (and the
+reverse) at a fraction of the cost::
+
+    frame_to_json(b'<HRTBaa{T=21.5,on=T}>..')
+    # '{"opcode":"HRTB","token":"aa","args":[{"T":21.5,"on":true}]}'
+
+Values map as: ints and floats to numbers (`nan` and `inf` to `NaN` and
+`Infinity`, as `json.dumps()` does), `T`/`F`/`N` to `true`/`false`/`null`,
+strings to strings, lists to arrays and dicts to objects. Bytes map to
+`{"$b64": "<base64>"}`, which cannot be confused with an Oatmeal dict as `$`
+is not allowed in dict keys.
+"""
+
+from typing import List
+import base64
+import json
+import re
+
+from .protocol import OatmealMsg, OatmealParseError, ByteLike, \
+                      ESCAPING_BYTES, ESCAPED_BYTES
+
+
+BYTES_KEY = '$b64'
+""" Key of the JSON object that holds a bytes value, base64 encoded. """
+
+_STR_RE = re.compile(rb'0?"((?:[^"\\]|\\.)*)"', re.S)
+_ATOM_RE = re.compile(rb'[^,\]}]+')
+_KEY_RE = re.compile(rb'([a-zA-Z0-9_]+)=')
+_UNESCAPE_RE = re.compile(rb'\\(.)', re.S)
+_ESCAPE_RE = re.compile(rb'[\\"<>\n\r\0]')
+_JSON_NUM_RE = re.compile(r'-?(?:0|[1-9][0-9]*)(?:\.[0-9]+)?(?:[eE][-+]?[0-9]+)?')
+# JSON tokens, numbered by group
+_JSON_TOKEN_RE = re.compile(r'''[ \t\n\r]*(?:
+     "([a-zA-Z0-9_]+)"[ \t\n\r]*:             # valid Oatmeal dict key
+    |"([^"\\\x00-\x1f<>]*)"                   # string needing no escaping
+    |(")                                       # any other string
+    |(-?(?:0|[1-9][0-9]*)(?:\.[0-9]+)?(?:[eE][-+]?[0-9]+)?)
+    |([\[{])
+    |([\]}])
+    |(,)
+    |(true|false|null|NaN|Infinity|-Infinity))''', re.X)
+_J_KEY, _J_STR, _J_ESC_STR, _J_NUM, _J_OPEN, _J_CLOSE, _J_SEP, _J_LITERAL = \
+    range(1, 9)
+_VALUE, _KEY, _SEP = range(3)  # what json_to_args() expects next
+_JSON_BYTES_RE = re.compile(r'[ \t\n\r]*:[ \t\n\r]*"([A-Za-z0-9+/=]*)"[ \t\n\r]*}')
+
+_ATOMS = {b'T': 'true', b'F': 'false', b'N': 'null'}
+_JSON_LITERALS = {'true': b'T', 'false': b'F', 'null': b'N',
+                  'NaN': b'nan', 'Infinity': b'inf', '-Infinity': b'-inf'}
+# Oatmeal open bracket: (Oatmeal close bracket, JSON open bracket)
+_CLOSERS = {ord('['): (ord(']'), '['), ord('{'): (ord('}'), '{')}
+
+_json_str = json.encoder.encode_basestring_ascii  # type: ignore
+
+
+def _unescape(match) -> bytes:
+    b = ESCAPED_BYTES.get(match.group(1)[0])
+    if b is None:
+        raise OatmealParseError("Invalid escaped character %r" %
+                                (match.group(0)))
+    return bytes([b])
+
+
+def _atom_to_json(atom: bytes) -> str:
+    """ Convert an unquoted Oatmeal value, as :meth:`OatmealMsg.decode()` then
+    :func:`json.dumps()` would. """
+    try:
+        text = atom.decode('ascii')
+    except UnicodeDecodeError:
+        raise OatmealParseError("Invalid item: %r" % (atom))
+    if _JSON_NUM_RE.fullmatch(text):
+        return text
+    literal = _ATOMS.get(atom)
+    if literal is not None:
+        return literal
+    try:
+        return str(int(text))
+    except ValueError:
+        pass
+    try:
+        return json.dumps(float(text))
+    except ValueError:
+        return _json_str(text)
+
+
+def args_to_json(buf: ByteLike) -> str:
+    """ Convert the arguments of an Oatmeal frame (between the token and the
+    frame end byte) to a JSON array.
+
+    Raises:
+        OatmealParseError: if the arguments are not valid
+    """
+    b = b'[' + bytes(buf) + b']'
+    out = []  # type: List[str]
+    closers = []  # type: List[int]
+    pos, end = 0, len(b)
+    expect_value = True
+    while pos < end:
+        c = b[pos]
+        if not expect_value:
+            if c == ord(','):
+                out.append(',')
+                pos += 1
+                if closers[-1] == ord('}'):
+                    pos = _dict_key(b, pos, out)
+                expect_value = True
+            elif c == closers[-1]:
+                out.append(']' if closers.pop() == ord(']') else '}')
+                pos += 1
+                if not closers:
+                    break
+            else:
+                raise OatmealParseError("Missing separator: %r" % (b))
+            continue
+        if c in _CLOSERS:
+            closer, json_open = _CLOSERS[c]
+            closers.append(closer)
+            out.append(json_open)
+            pos += 1
+            if pos < end and b[pos] == closer:
+                expect_value = False  # empty
+            elif closer == ord('}'):
+                pos = _dict_key(b, pos, out)
+            continue
+        if c == ord('"') or (c == ord('0') and b[pos+1:pos+2] == b'"'):
+            m = _STR_RE.match(b, pos)
+            if m is None:
+                raise OatmealParseError("String didn't end: %r" % (b))
+            data = m.group(1)
+            if b'\\' in data:
+                data = _UNESCAPE_RE.sub(_unescape, data)
+            if c == ord('0'):
+                out.append('{"%s":"%s"}' % (
+                    BYTES_KEY, base64.b64encode(data).decode('ascii')))
+            else:
+                try:
+                    out.append(_json_str(data.decode('utf-8')))
+                except UnicodeDecodeError:
+                    raise OatmealParseError("Frame wasn't valid UTF-8")
+        else:
+            m = _ATOM_RE.match(b, pos)
+            if m is None:
+                raise OatmealParseError("Missing/invalid item: %r" % (b))
+            out.append(_atom_to_json(m.group(0)))
+        pos = m.end()
+        expect_value = False
+    if closers or pos != end:
+        raise OatmealParseError("Unbalanced brackets: %r" % (b))
+    return ''.join(out)
+
+
+def _dict_key(b: bytes, pos: int, out: List[str]) -> int:
+    """ Convert the `key=` at `pos` to `"key":`, returning the end position """
+    m = _KEY_RE.match(b, pos)
+    if m is None:
+        raise OatmealParseError("Invalid dict key name: %r" % (b))
+    out.append('"%s":' % (m.group(1).decode('ascii')))
+    return m.end()
+
+
+def _escape(match) -> bytes:
+    return ESCAPING_BYTES[match.group(0)[0]]
+
+
+def json_to_args(text: str) -> bytes:
+    """ Convert a JSON array to the arguments of an Oatmeal frame.
+
+    Raises:
+        OatmealParseError: if `text` is not a JSON array, or holds an object
+            with a key that is not a valid Oatmeal dict key
+    """
+    out = []  # type: List[bytes]
+    closers = []  # type: List[str]
+    pos = 0
+    expect = _VALUE
+    match = _JSON_TOKEN_RE.match
+    while True:
+        m = match(text, pos)
+        if m is None:
+            raise OatmealParseError("Invalid JSON at %i: %r" % (pos, text))
+        pos = m.end()
+        token = m.lastindex
+        if expect == _SEP:
+            if token == _J_SEP and closers:
+                out.append(b',')
+                expect = _KEY if closers[-1] == '}' else _VALUE
+                continue
+            if token != _J_CLOSE or m.group(token) != closers[-1]:
+                raise OatmealParseError("Unexpected %r at %i" %
+                                        (m.group(0), pos))
+        elif expect == _KEY:
+            if token == _J_KEY:
+                out.append(m.group(token).encode('ascii') + b'=')
+                expect = _VALUE
+                continue
+            if token == _J_STR and m.group(token) == BYTES_KEY and \
+                    out[-1] == b'{':
+                m = _JSON_BYTES_RE.match(text, pos)
+                if m is None:
+                    raise OatmealParseError("Invalid bytes: %r" % (text))
+                data = base64.b64decode(m.group(1))
+                out[-1] = b'0"' + _ESCAPE_RE.sub(_escape, data) + b'"'
+                closers.pop()
+                pos, expect = m.end(), _SEP
+                continue
+            if token != _J_CLOSE or out[-1] != b'{':
+                raise OatmealParseError("Invalid dict key at %i: %r" %
+                                        (pos, text))
+        elif token == _J_CLOSE:
+            if out[-1] != b'[':
+                raise OatmealParseError("Unexpected %r at %i" %
+                                        (m.group(0), pos))
+        elif token == _J_OPEN:
+            bracket = m.group(token)
+            out.append(bracket.encode('ascii'))
+            closers.append(']' if bracket == '[' else '}')
+            expect = _KEY if bracket == '{' else _VALUE
+            continue
+        elif token == _J_STR or token == _J_KEY:
+            if token == _J_KEY:
+                raise OatmealParseError("Unexpected ':' at %i" % (pos))
+            out.append(b'"' + m.group(token).encode('utf-8') + b'"')
+            expect = _SEP
+            continue
+        elif token == _J_NUM:
+            out.append(m.group(token).encode('ascii'))
+            expect = _SEP
+            continue
+        elif token == _J_LITERAL:
+            out.append(_JSON_LITERALS[m.group(token)])
+            expect = _SEP
+            continue
+        elif token == _J_ESC_STR:
+            try:
+                s, pos = json.decoder.scanstring(text, pos)  # type: ignore
+            except ValueError as err:
+                raise OatmealParseError("Invalid JSON string: %s" % (err))
+            out.append(b'"' + _ESCAPE_RE.sub(_escape, s.encode('utf-8')) +
+                       b'"')
+            expect = _SEP
+            continue
+        else:
+            raise OatmealParseError("Unexpected %r at %i" % (m.group(0), pos))
+        # Close a list or dict
+        closers.pop()
+        out.append(m.group(token).encode('ascii'))
+        expect = _SEP
+        if not closers:
+            break
+    if out[0] != b'[' or text[pos:].strip(' \t\n\r'):
+        raise OatmealParseError("Not a JSON array: %r" % (text))
+    return b''.join(out[1:-1])
+
+
+def frame_to_json(frame: ByteLike) -> str:
+    """ Convert a frame to a JSON object with keys `opcode`, `token` and
+    `args`. The frame is assumed to have been validated (see
+    :meth:`OatmealProtocol.convert_frame()`), checksums are not checked.
+
+    Raises:
+        OatmealParseError: if the frame's arguments are not valid
+    """
+    if len(frame) < OatmealMsg.MIN_FRAME_LEN:
+        raise OatmealParseError("Frame too short: %r" % (frame))
+    try:
+        head = bytes(frame[1:7]).decode('ascii')
+    except UnicodeDecodeError:
+        raise OatmealParseError('Frame contained non-ASCII characters: %r'
+                                % frame)
+    return '{"opcode":%s,"token":%s,"args":%s}' % (
+        _json_str(head[:4]), _json_str(head[4:]), args_to_json(frame[7:-3]))
+
+
+def json_to_frame(opcode: str, token: str, args_json: str) -> bytearray:
+    """ Build a frame from an opcode, token and a JSON array of arguments.
+
+    Raises:
+        OatmealParseError: if `args_json` cannot be converted
+        ValueError: if the opcode or token are not valid
+    """
+    if not OatmealMsg.is_valid_opcode(opcode):
+        raise ValueError("Bad opcode: %r" % (opcode))
+    if not OatmealMsg.is_valid_token(token):
+        raise ValueError("Bad token: %r" % (token))
+    frame = bytearray(b'<')
+    frame += opcode.encode('ascii')
+    frame += token.encode('ascii')
+    frame += json_to_args(args_json)
+    frame_len = len(frame) + 3
+    frame.append(OatmealMsg.FRAME_END_BYTE)
+    frame.append(OatmealMsg.length_checksum(frame_len))
+    frame.append(OatmealMsg.calc_checksum(frame))
+    return frame
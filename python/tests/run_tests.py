@@ -1,13 +1,29 @@
 #!/usr/bin/env python3
 
-from typing import Union
+from typing import Any, Union, Dict, List, Set, Callable
+from threading import Lock
 import unittest
 import itertools
+import json
+import os
 import random
+import struct
 import sys
+import tempfile
+import time
+import urllib.request
 sys.path.append('..')  # noqa: E402
 
-from oatmeal import OatmealMsg, OatmealParseError
+from oatmeal import OatmealMsg, OatmealParseError, OatmealSampleBatch, \
+    OatmealClockSync, OatmealBurstResult, OatmealBgMsgHandler, \
+    OatmealTimeSeriesStore, OatmealCaptureMirror, OatmealStats, \
+    OatmealMetrics, OatmealMetricsServer, OatmealWorkerPool, OatmealProtocol, \
+    OatmealDeviceCache, OatmealDeviceDetails, OatmealPort, OatmealError
+from oatmeal.bridge import OatmealTokenRouter, split_frames
+from oatmeal.export import OatmealColumns
+from oatmeal.transcode import args_to_json, json_to_args, frame_to_json, \
+    json_to_frame
+from oatmeal.hotplug import OatmealInotify, IN_CREATE, IN_DELETE, IN_MOVED_TO
 
 
 def random_unicode_string(n: int) -> str:
@@ -24,6 +40,53 @@ def random_bytearray(n: int) -> bytearray:
     return bytearray([random.randint(0, 255) for _ in range(n)])
 
 
+class ScriptedSerial:
+    """ Serial port to a pretend device, which answers each frame written
+    with the messages returned by `respond(msg)` """
+
+    name = 'scripted'
+
+    def __init__(self,
+                 respond: Callable[[OatmealMsg], List[OatmealMsg]]) -> None:
+        self.respond = respond
+        self.rx = bytearray()
+        self.lock = Lock()
+
+    @property
+    def in_waiting(self) -> int:
+        with self.lock:
+            n = len(self.rx)
+        if not n:
+            time.sleep(0.001)
+        return n
+
+    def read(self, n: int) -> bytes:
+        with self.lock:
+            data = bytes(self.rx[:n])
+            del self.rx[:n]
+        return data
+
+    def write(self, data: bytes) -> int:
+        msg = OatmealMsg.decode(bytearray(data.rstrip(b'\n')))
+        with self.lock:
+            for resp in self.respond(msg):
+                self.rx += resp.encode() + b'\n'
+        return len(data)
+
+    def close(self) -> None:
+        pass
+
+
+def pool_handler(device: str, msg: OatmealMsg) -> Any:
+    """ Worker pool handler: fails on frame 13 and kills its worker process on
+    frame 99 of device d4 """
+    if msg.args[0] == 13:
+        raise ValueError("unlucky")
+    if msg.args[0] == 99 and device == "d4":
+        os._exit(1)
+    return msg.args[0], os.getpid()
+
+
 class TestOatmealProtocol(unittest.TestCase):
     def _assert_valid_frame(self, frame: Union[bytes, bytearray]) -> None:
         self.assertTrue(all(b > 0 for b in frame))
@@ -235,6 +298,360 @@ class TestOatmealProtocol(unittest.TestCase):
         self.assertEqual(repr(eval(msg4_str)), msg4_str)
         self.assertEqual(repr(eval(msg5_str)), msg5_str)
 
+    def test_sample_batch(self) -> None:
+        """ Unpack a sample batch frame generated by the C++ library """
+        frame = b'<SMPB039000,2,[0,8,-800,1000,9,-900,500,10,-1000]>{}'
+        msg = OatmealMsg.decode(bytearray(frame))
+        self.assertEqual(msg.encode(), frame)
+        batch = OatmealSampleBatch.from_msg(msg)
+        self.assertEqual(len(batch), 3)
+        self.assertEqual(list(batch.timestamps_us), [9000, 10000, 10500])
+        self.assertEqual([list(v) for v in batch.values],
+                         [[8, 9, 10], [-800, -900, -1000]])
+        # Wrong number of items for the number of values
+        with self.assertRaises(OatmealParseError):
+            OatmealSampleBatch.from_msg(OatmealMsg("SMPB", 0, 2, [0, 1],
+                                                   token='aa'))
+
+    def test_clock_sync(self) -> None:
+        """ Estimate a drifting device clock that wraps around """
+        offset, drift = 3200.5, 50e-6  # device 50ppm fast
+        wrap = OatmealClockSync.DEVICE_CLOCK_WRAP_US
+
+        def device_us(t: float) -> int:
+            return int(round((t * (1 + drift) + offset) * 1e6)) % wrap
+
+        clock = OatmealClockSync()
+        for i in range(20):
+            t1 = 1000.0 + i * 10
+            # 2ms upstream, 1ms on the device, 3ms downstream, plus noise
+            jitter = 0.005 if i % 3 == 0 else 0
+            rx, tx = t1 + 0.002 + jitter, t1 + 0.003 + jitter
+            clock.add_exchange(t1, device_us(rx), device_us(tx), tx + 0.003)
+        self.assertAlmostEqual(clock.drift, drift, delta=1e-6)
+        t = 1200.0  # device clock has wrapped at least once by now
+        self.assertLess(device_us(t), device_us(1000.0))
+        # Symmetric link assumption: error is half the latency asymmetry
+        self.assertAlmostEqual(clock.device_to_host(device_us(t)), t,
+                               delta=0.001)
+        assert clock.round_trip.min is not None
+        self.assertAlmostEqual(clock.round_trip.min, 0.005, delta=1e-5)
+        self.assertEqual(clock.round_trip.n, 20)
+
+    def test_self_test_frames(self) -> None:
+        """ Decode echo and burst frames generated by the C++ library """
+        echo = OatmealMsg.decode(bytearray(b'<ECHAab1,"hi\\(\\)",[2.5]>}"'))
+        self.assertEqual(echo.args, [1, "hi<>", [2.5]])
+        frame = b'<BSTBcd0,"xxxxxxxxxxxxxxxx">;n'
+        burst = OatmealMsg.decode(bytearray(frame))
+        self.assertEqual(burst.args, [0, "x" * 16])
+        done = OatmealMsg.decode(bytearray(b'<BSTDcd3,0>~('))
+        res = OatmealBurstResult(n_frames=done.args[0], frame_len=len(frame),
+                                 device_elapsed=0.5, host_elapsed=0,
+                                 n_received=3)
+        self.assertEqual(res.n_bytes, 3 * 31)
+        self.assertEqual(res.device_bytes_per_sec, 3 * 31 * 2)
+        self.assertIsNone(res.host_bytes_per_sec)
+
+    def test_var_dicts(self) -> None:
+        """ Decode variable registry frames generated by the C++ library """
+        get = OatmealMsg.decode(bytearray(b'<VGTAaa{x=5,gain=0.5},F>}%'))
+        self.assertEqual(get.args, [{'x': 5, 'gain': 0.5}, False])
+        dump = OatmealMsg.decode(bytearray(
+            b'<VDMAaf{gain=2.5,on=F,ro=7,v00=-1000000000,v01=-1000000001,'
+            b'v02=-1000000002,v03=-1000000003,v04=-1000000004},T>S|'))
+        self.assertEqual(dump.args[0]['on'], False)
+        self.assertEqual(dump.args[0]['v04'], -1000000004)
+        self.assertEqual(dump.args[1], True)
+        # Set request as encoded by the host
+        self.assertEqual(OatmealMsg("VSTR", {'x': 9, 'on': False},
+                                    token='ac').encode(),
+                         b'<VSTRac{on=F,x=9}>S%')
+
+    def test_var_watches(self) -> None:
+        """ Decode change notifications generated by the C++ library """
+        self.assertEqual(OatmealMsg("VWTR", 100, 0.0, 'x', 'on',
+                                    token='aa').encode(),
+                         b'<VWTRaa100,0,"x","on">o_')
+        handler = OatmealBgMsgHandler(board_name='test')
+        for frame in (b'<VARB01{x=5,on=T}>SJ', b'<VARB04{g=1.6}>=('):
+            msg = OatmealMsg.decode(bytearray(frame))
+            handler.handle_var_update(msg, msg.args[0])
+        self.assertEqual(handler.var_values, {'x': 5, 'on': True, 'g': 1.6})
+
+    def test_var_requests(self) -> None:
+        """ Variable requests are resent on a timeout, and responses to other
+        requests are dropped """
+        requests = []  # type: List[OatmealMsg]
+
+        def respond(msg: OatmealMsg) -> List[OatmealMsg]:
+            requests.append(msg)
+            if msg.opcode == 'VGTR' and len(requests) == 1:
+                return []  # lost
+            if msg.opcode == 'VGTR':
+                return [OatmealMsg("ECHA", token='zz'),
+                        OatmealMsg("VGTA", {'x': 5}, True, token=msg.token),
+                        OatmealMsg("VGTA", {'y': 6}, False, token=msg.token)]
+            if msg.opcode == 'VSTR':
+                return [OatmealMsg("VSTF", 'ro', token=msg.token)]
+            return [OatmealMsg(msg.command + 'A', token=msg.token)]
+
+        port = OatmealPort(ScriptedSerial(respond), mirror_data=False)
+        try:
+            self.assertEqual(port.get_vars('x', 'y', timeout=0.2),
+                             {'x': 5, 'y': 6})
+            self.assertEqual(port.n_missed_acks, 1)
+            self.assertEqual(len(requests), 2)
+            self.assertNotEqual(requests[0].token, requests[1].token)
+            port.watch_vars('x', timeout=0.2)
+            with self.assertRaisesRegex(OatmealError, "'ro'"):
+                port.set_vars({'ro': 1}, timeout=0.2)
+            self.assertEqual(port.n_missed_acks, 1)
+        finally:
+            port.stop()
+
+    def test_bridge_routing(self) -> None:
+        """ Bridge remaps tokens from several clients and routes responses """
+        frames, rest = split_frames(bytearray(
+            b'xx<TSTRaa1>Xy\n<TS<TSTRab2>Yz<TST'))
+        self.assertEqual(frames, [b'<TSTRaa1>Xy', b'<TSTRab2>Yz'])
+        self.assertEqual(rest, b'<TST')
+
+        router = OatmealTokenRouter(max_routes=2)
+        tok0 = router.to_device(0, OatmealMsg("BSTR", token='aa'))
+        tok1 = router.to_device(1, OatmealMsg("BSTR", token='aa'))
+        self.assertNotEqual(tok0, tok1)
+        # Retransmission keeps its token
+        self.assertEqual(router.to_device(1, OatmealMsg("BSTR", token='aa')),
+                         tok1)
+        self.assertEqual(router.to_client(OatmealMsg("BSTA", token=tok0)),
+                         (0, 'aa'))
+        self.assertEqual(router.to_client(OatmealMsg("BSTB", token=tok1)),
+                         (1, 'aa'))
+        # Background messages from other commands are not routed
+        self.assertIsNone(router.to_client(OatmealMsg("HRTB", token=tok1)))
+        # Least recently used route is dropped when full
+        router.to_device(2, OatmealMsg("TSTR", token='aa'))
+        self.assertIsNone(router.to_client(OatmealMsg("BSTA", token=tok0)))
+        router.drop_client(1)
+        self.assertIsNone(router.to_client(OatmealMsg("BSTA", token=tok1)))
+
+    def test_timeseries(self) -> None:
+        """ Heartbeats are stored raw and downsampled into windows """
+        store = OatmealTimeSeriesStore(capacity=50, windows=(10.0, 100.0))
+        handler = OatmealBgMsgHandler(board_name='dev', timeseries=store)
+        for i in range(200):
+            msg = OatmealMsg("HRTB", {'T': i % 10, 'on': i % 2 == 0,
+                                      'role': 'dev'}, token='aa')
+            msg.recv_time = 1000.0 + i
+            handler.handle_heartbeat(msg)
+        self.assertEqual(store.devices(), ['dev'])
+        self.assertEqual(store.keys('dev'), ['T', 'on'])
+        # Last 50 raw samples are kept
+        raw = store.query('dev', 'T', 1150.0, 1200.0)
+        self.assertEqual([p.t for p in raw], [1150.0 + i for i in range(50)])
+        self.assertEqual(raw[3].mean, 3)
+        # Older data only at 10s resolution, including the open window
+        windows = store.query('dev', 'T', 1005.0, 1200.0)
+        self.assertEqual(windows[0].t, 1000.0)
+        self.assertEqual(len(windows), 20)
+        self.assertEqual((windows[1].min, windows[1].max, windows[1].mean,
+                          windows[1].n), (0, 9, 4.5, 10))
+        # Fewest points at the coarsest resolution
+        coarse = store.query('dev', 'on', 1150.0, 1200.0, max_points=5)
+        self.assertEqual([(p.t, p.mean) for p in coarse], [(1100.0, 0.5)])
+        self.assertEqual(store.query('dev', 'role', 0, 2000.0), [])
+
+    def test_export_columns(self) -> None:
+        """ Values in captured background messages are exported as columns """
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            path = os.path.join(tmp_dir, 'dev.cap')
+            mirror = OatmealCaptureMirror(path)
+            mirror.outgoing_data(b'<HRTRaa>iX\n')
+            # Frames split across chunks, a bad frame and a log message
+            mirror.incoming_data(b'<HRTB01{T=2,on=T}>Sp\n<HRTB02{T=3,o')
+            mirror.incoming_data(b'n=F}>Sh\n<HRTB02{T=3,on=F}>Sx\n'
+                                 b'<LOGB03"INFO","hi">Zo\n')
+            mirror.incoming_data(b'<HRTB04{T=4.5,on=T}>aV\n<VARB05{x=7}>.M')
+            mirror.close()
+            columns = OatmealColumns()
+            columns.add_capture('dev', path)
+            self.assertEqual(columns.stats.n_good_frames, 4)
+            self.assertEqual(columns.stats.n_bad_checksums, 1)
+            out_dir = os.path.join(tmp_dir, 'out')
+            self.assertEqual([os.path.relpath(p, out_dir)
+                              for p in columns.write(out_dir)],
+                             [os.path.join('dev', name) for name in
+                              ('HRTB.T.npy', 'HRTB.on.npy', 'VARB.x.npy')])
+
+            def load(name: str, fmt: str) -> list:
+                with open(os.path.join(out_dir, 'dev', name), 'rb') as fh:
+                    data = fh.read()
+                header_len = struct.unpack('<H', data[8:10])[0]
+                self.assertEqual((10 + header_len) % 64, 0)
+                return list(struct.iter_unpack(fmt, data[10+header_len:]))
+
+            temps = load('HRTB.T.npy', '<dd')
+            self.assertEqual([v for _, v in temps], [2.0, 3.0, 4.5])
+            self.assertLessEqual(temps[0][0], temps[2][0])
+            self.assertEqual([v for _, v in load('HRTB.on.npy', '<d?')],
+                             [True, False, True])
+            self.assertEqual([v for _, v in load('VARB.x.npy', '<dq')], [7])
+
+    def test_metrics(self) -> None:
+        """ Host and device stats are served in the OpenMetrics format """
+        stats = OatmealStats()
+        stats.n_good_frames = 12
+        stats.n_bad_checksums = 1
+        handler = OatmealBgMsgHandler(board_name='dev')
+        # Heartbeats from the C++ library hold counts since the last one
+        for frame in (b'<HRTBaa{oatmeal_errs=3,bc=2,uo=1,loop_ms=5}>Qa',
+                      b'<HRTBab{oatmeal_errs=1,uo=1,tx_too_long=1}>J`'):
+            handler.handle_heartbeat(OatmealMsg.decode(bytearray(frame)))
+        self.assertEqual(handler.device_stats, {
+            'bad_checksums': 2, 'unknown_opcode': 2, 'tx_too_long': 1})
+        metrics = OatmealMetrics()
+        metrics.add_stats('dev "a"', stats)
+        metrics.add_handler('dev', handler)
+        text = metrics.render()
+        lines = text.splitlines()
+        self.assertIn('# TYPE oatmeal_rx_frames counter', lines)
+        self.assertIn('oatmeal_rx_frames_total{device="dev \\"a\\"",'
+                      'link="host"} 12', lines)
+        self.assertIn('oatmeal_rx_errors_total{device="dev \\"a\\"",'
+                      'link="host",error="bad_checksums"} 1', lines)
+        self.assertIn('oatmeal_rx_errors_total{device="dev",link="device",'
+                      'error="unknown_opcode"} 2', lines)
+        self.assertIn('oatmeal_tx_too_long_total{device="dev"} 1', lines)
+        self.assertEqual(lines[-1], '# EOF')
+
+        server = OatmealMetricsServer(metrics, ('127.0.0.1', 0))
+        server.start()
+        try:
+            url = 'http://%s:%i/metrics' % server.address
+            with urllib.request.urlopen(url, timeout=5) as resp:
+                self.assertEqual(resp.headers['Content-Type'],
+                                 OatmealMetrics.CONTENT_TYPE)
+                self.assertEqual(resp.read().decode(), text)
+        finally:
+            server.stop()
+
+    def test_json_transcode(self) -> None:
+        """ Args convert to the same JSON as decoding then json.dumps() """
+        all_args = [[], [1, -2, 3.5, True, False, None, ""],
+                    ["a \"<q>\"\n\r\0\\ \u00e9"], [[], {}, [[1], [2, {'a': []}]]],
+                    [{'a': 1, 'b_2': "x", 'c': {'d': None}}],
+                    [float('inf'), 1e-07, 2.5]]  # type: List[List[Any]]
+        for args in all_args:
+            frame = OatmealMsg("TSTR", *args, token='aa').encode()
+            text = args_to_json(frame[7:-3])
+            self.assertEqual(json.loads(text), OatmealMsg.decode(frame).args)
+            self.assertEqual(json_to_frame('TSTR', 'aa', text), frame)
+            self.assertEqual(json_to_args(json.dumps(args, indent=1)),
+                             frame[7:-3])
+        # Bytes round trip as base64 in an object
+        self.assertEqual(args_to_json(b'0"\\0<\\(\xff"'),
+                         '[{"$b64":"ADw8/w=="}]')
+        self.assertEqual(json_to_args('[{"$b64": "ADw8/w=="}]'),
+                         b'0"\\0\\(\\(\xff"')
+        self.assertEqual(
+            frame_to_json(b'<HRTBaa{oatmeal_errs=3,bc=2,uo=1,loop_ms=5}>Qa'),
+            '{"opcode":"HRTB","token":"aa","args":[{"oatmeal_errs":3,'
+            '"bc":2,"uo":1,"loop_ms":5}]}')
+        for bad in (b'1,,2', b'[1', b'1]', b'{a=1,}', b'{=1}', b'"\\q"'):
+            with self.assertRaises(OatmealParseError):
+                args_to_json(bad)
+        for text in ('{"a":1}', '[1,]', '[{"a b":1}]', '[1] x', '[1 2]'):
+            with self.assertRaises(OatmealParseError):
+                json_to_args(text)
+
+    def test_worker_pool(self) -> None:
+        """ Pool handles each device's frames in order, in worker processes """
+        received = {}  # type: Dict[str, List[int]]
+        pids = set()  # type: Set[int]
+
+        def on_result(device: str, result: Any) -> None:
+            arg, pid = result
+            received.setdefault(device, []).append(arg)
+            pids.add(pid)
+
+        pool = OatmealWorkerPool(pool_handler, n_workers=3, batch_size=4,
+                                 on_result=on_result)
+        pool.start()
+        bad = bytearray(b'<TSTRaa1,,2>')
+        bad.append(OatmealMsg.length_checksum(len(bad) + 2))
+        bad.append(OatmealMsg.calc_checksum(bad))
+        stats = pool.stats("d0")
+        self.assertTrue(OatmealProtocol.validate_frame(bad, stats, 100))
+        self.assertFalse(OatmealProtocol.validate_frame(bad[:-1] + b'x',
+                                                        stats, 100))
+        self.assertEqual(stats.n_bad_checksums, 1)
+        pool.submit("d0", bytes(bad), recv_time=1.0)
+        for i in range(200):
+            for device in ("d0", "d1", "d2", "d3", "d4"):
+                frame = OatmealMsg("TSTR", i, token='aa').encode()
+                pool.submit(device, bytes(frame))
+        pool.stop()
+        self.assertEqual(pool.n_pending(), 0)
+        for device in ("d0", "d1", "d2", "d3"):
+            self.assertEqual(received[device],
+                             [i for i in range(200) if i != 13])
+            self.assertEqual(pool.stats(device).n_good_frames, 200)
+        self.assertEqual(stats.n_misc_bad_frames, 1)
+        self.assertEqual(pool.n_handler_errors, 5)
+        self.assertNotIn(os.getpid(), pids)
+        # The worker that died on d4's frame 99 lost the rest of its batch
+        self.assertEqual(pool.n_worker_restarts, 1)
+        self.assertEqual(received["d4"], sorted(received["d4"]))
+        self.assertNotIn(99, received["d4"])
+        self.assertEqual(received["d4"][-1], 199)
+        self.assertGreater(len(received["d4"]), 190)
+
+    def test_device_cache(self) -> None:
+        """ Device cache round trips details by stable port key """
+        class PortInfo:
+            device, vid, pid, serial_number = '/dev/ttyUSB3', 0x0403, 0x6001, ''
+        info = PortInfo()
+        self.assertEqual(OatmealDeviceCache.port_key(info), 'path:/dev/ttyUSB3')
+        info.serial_number = 'A10K'
+        key = OatmealDeviceCache.port_key(info)
+        self.assertEqual(key, 'usb:0403:6001:A10K')
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            path = os.path.join(tmp_dir, 'sub', 'devices.json')
+            cache = OatmealDeviceCache(path)
+            self.assertIsNone(cache.get(key))
+            cache.put(key, OatmealDeviceDetails('Valve', 2, 'f00d', '1.3'))
+            cache.put('path:/dev/ttyS0', OatmealDeviceDetails('Pump', 0, 'x', ''))
+            cache.remove('path:/dev/ttyS0')
+            cache.save()
+            details = OatmealDeviceCache(path).get(key)
+            assert details is not None
+            self.assertEqual(dict(details.items()),
+                             dict(role='Valve', instance_idx=2,
+                                  hardware_id='f00d', version='1.3'))
+            self.assertIsNone(OatmealDeviceCache(path).get('path:/dev/ttyS0'))
+            # A corrupt cache is ignored rather than failing startup
+            with open(path, 'w') as fh:
+                fh.write('{"usb:0403:6001:A10K": {"role": ')
+            self.assertIsNone(OatmealDeviceCache(path).get(key))
+
+    @unittest.skipUnless(sys.platform.startswith('linux'), "needs inotify")
+    def test_inotify(self) -> None:
+        """ Inotify reports files created, moved into and removed from a dir """
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            inotify = OatmealInotify(tmp_dir)
+            self.assertEqual(inotify.read(0), [])
+            open(os.path.join(tmp_dir, 'ttyUSB0'), 'w').close()
+            os.rename(os.path.join(tmp_dir, 'ttyUSB0'),
+                      os.path.join(tmp_dir, 'ttyACM1'))
+            os.remove(os.path.join(tmp_dir, 'ttyACM1'))
+            events = [(mask & (IN_CREATE | IN_DELETE | IN_MOVED_TO), name)
+                      for mask, name in inotify.read(1)]
+            inotify.close()
+        self.assertEqual([e for e in events if e[0]],
+                         [(IN_CREATE, 'ttyUSB0'), (IN_MOVED_TO, 'ttyACM1'),
+                          (IN_DELETE, 'ttyACM1')])
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -73,6 +73,24 @@ clock speeds. */
   #define OATMEAL_MAX_MSG_LEN 127
 #endif
 
+#ifndef OATMEAL_COMPACT
+  /** Set to 1 to trade speed for flash (program memory).
+
+By default each integer type a sketch formats, parses or appends (`int`,
+`long`, `uint16_t`, ...) gets its own copy of the code. In compact mode the
+templates only convert to a wide type (`long`, `unsigned long`, `long long` or
+`unsigned long long`) and call one shared, non-inlined worker per wide type.
+Small integers are then formatted with 32-bit arithmetic, which is slower on
+8-bit chips. Worth setting on boards with 32 KB of flash or less. */
+  #define OATMEAL_COMPACT 0
+#endif
+
+#if OATMEAL_COMPACT
+  #define OATMEAL_WORKER __attribute__((noinline))
+#else
+  #define OATMEAL_WORKER
+#endif
+
 const int OATMEAL_CHECKLEN_COEFF = 7;
 const int OATMEAL_CHECKSUM_COEFF = 31;
 
@@ -84,6 +102,23 @@ const int OATMEAL_CHECKSUM_COEFF = 31;
 #include <float.h>
 #include <limits.h>
 
+#ifdef ARDUINO
+  /* __FlashStringHelper, F(), PROGMEM and pgm_read_byte() */
+  #include <Arduino.h>
+#else
+  /* Off the device (e.g. in the unit tests) "flash" strings are in RAM */
+  class __FlashStringHelper;
+  #ifndef F
+    #define F(str) (reinterpret_cast<const __FlashStringHelper*>(str))
+  #endif
+  #ifndef PROGMEM
+    #define PROGMEM
+  #endif
+  #ifndef pgm_read_byte
+    #define pgm_read_byte(addr) (*reinterpret_cast<const uint8_t*>(addr))
+  #endif
+#endif
+
 #ifndef LLONG_MAX
   #define ULLONG_MAX (~(unsigned long long)0)
   #define LLONG_MIN ((long long)(ULLONG_MAX))
@@ -209,6 +244,98 @@ class OatmealFmt {
     return n+2;
   }
 
+  /** Read character `i` of a string stored in flash (PROGMEM), e.g. `F("x")`.
+  Flash strings are read a byte at a time and never copied into RAM. */
+  static char flash_char(const __FlashStringHelper *str, size_t i) {
+    return pgm_read_byte(reinterpret_cast<const char*>(str) + i);
+  }
+
+  /** Check if the first `n` chars of `str` match a string stored in flash.
+  @returns `true` if they match, as `strncmp(str, flash_str, n) == 0` */
+  static bool flash_match(const char *str, const __FlashStringHelper *flash_str,
+                          size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      char c = flash_char(flash_str, i);
+      if (str[i] != c) { return false; }
+      if (!c) { break; }
+    }
+    return true;
+  }
+
+  /** Format a (utf-8) string stored in flash (PROGMEM) as a message argument.
+  @see format(char*, size_t, const char*, int v) */
+  static size_t format(char *dst, size_t dlen, const __FlashStringHelper *src,
+                       int v = 0) {
+    (void)v;  /* ignore last parameter */
+    if (src == nullptr) { return format_none(dst, dlen); }
+    if (dlen < 3) { return 0; }
+    size_t n = 0;
+    char c;
+    dst[n++] = '"';
+    for (size_t i = 0; (c = flash_char(src, i)); i++) {
+      /* Leave room for the closing quote and nul-byte */
+      size_t m = OatmealFmt::encode_bytes(dst+n, dlen-2-n,
+                                          (const uint8_t*)&c, 1);
+      if (!m) { dst[0] = '\0'; return 0; }
+      n += m;
+    }
+    dst[n++] = '"';
+    dst[n] = '\0';
+    return n;
+  }
+
+  /* Compile-time string escaping, used by `OATMEAL_STR()`.
+  These mirror `encode_bytes()` and `OatmealMsg::compute_checksum()` as
+  recursive constexpr functions (C++11), so literals are escaped by the
+  compiler rather than a byte at a time at runtime. */
+
+  /** Check if a byte must be escaped in a str/data argument */
+  static constexpr bool needs_escape(char c) {
+    return c == '\\' || c == '"' || c == '<' || c == '>' ||
+           c == '\n' || c == '\r' || c == '\0';
+  }
+
+  /** Get the byte that follows a backslash to encode byte `c` */
+  static constexpr char escape_code(char c) {
+    return c == '<' ? '(' : c == '>' ? ')' : c == '\n' ? 'n' :
+           c == '\r' ? 'r' : c == '\0' ? '0' : c;
+  }
+
+  /** Number of bytes needed to encode `n` bytes from `src` (without quotes) */
+  static constexpr size_t escaped_len(const char *src, size_t n) {
+    return n == 0 ? 0 : (needs_escape(*src) ? 2 : 1) + escaped_len(src+1, n-1);
+  }
+
+  /** Byte `i` of the encoding of `n` bytes from `src` (without quotes) */
+  static constexpr char escaped_char(const char *src, size_t n, size_t i) {
+    return n == 0 ? '\0' :
+           !needs_escape(*src) ?
+             (i == 0 ? *src : escaped_char(src+1, n-1, i-1)) :
+           i == 0 ? '\\' :
+           i == 1 ? escape_code(*src) : escaped_char(src+1, n-1, i-2);
+  }
+
+  /** Update a running checksum with one more byte of a frame */
+  static constexpr uint8_t checksum_add(uint8_t checksum, char c) {
+    return static_cast<uint8_t>((checksum + c) * OATMEAL_CHECKSUM_COEFF);
+  }
+
+  /** Update a running checksum with the encoding of `n` bytes from `src` */
+  static constexpr uint8_t escaped_checksum(const char *src, size_t n,
+                                            uint8_t checksum) {
+    return n == 0 ? checksum :
+           escaped_checksum(src+1, n-1, needs_escape(*src) ?
+             checksum_add(checksum_add(checksum, '\\'), escape_code(*src)) :
+             checksum_add(checksum, *src));
+  }
+
+  /** `OATMEAL_CHECKSUM_COEFF` to the power of `n`, modulo 256.
+  After `n` bytes a running checksum `c` has been multiplied by this much. */
+  static constexpr uint8_t checksum_coeff_pow(size_t n) {
+    return n == 0 ? 1 : static_cast<uint8_t>(checksum_coeff_pow(n-1) *
+                                             OATMEAL_CHECKSUM_COEFF);
+  }
+
   /** Format raw bytes as a message argument.
 
   @param dst: memory to format into.
@@ -319,6 +446,53 @@ class OatmealFmt {
   template<typename T>
   static size_t format(char *dst, size_t dlen, T val, int v = 0) {
     (void)v; /* Ignore last parameter */
+    #if OATMEAL_COMPACT
+      /* Widen to one of four shared workers */
+      const bool is_signed = static_cast<T>(-1) < static_cast<T>(0);
+      if (sizeof(T) <= sizeof(long)) {
+        return is_signed ? format_long(dst, dlen, static_cast<long>(val))
+                         : format_ulong(dst, dlen,
+                                        static_cast<unsigned long>(val));
+      } else {
+        return is_signed ? format_llong(dst, dlen, static_cast<long long>(val))
+                         : format_ullong(dst, dlen,
+                                         static_cast<unsigned long long>(val));
+      }
+    #else
+      return _format_int(dst, dlen, val);
+    #endif
+  }
+
+  /** Format a `long` as a message argument.
+  @see format(char*, size_t, T, int) */
+  static OATMEAL_WORKER size_t format_long(char *dst, size_t dlen, long val) {
+    return _format_int(dst, dlen, val);
+  }
+
+  /** Format an `unsigned long` as a message argument.
+  @see format(char*, size_t, T, int) */
+  static OATMEAL_WORKER size_t format_ulong(char *dst, size_t dlen,
+                                            unsigned long val) {
+    return _format_int(dst, dlen, val);
+  }
+
+  /** Format a `long long` as a message argument.
+  @see format(char*, size_t, T, int) */
+  static OATMEAL_WORKER size_t format_llong(char *dst, size_t dlen,
+                                            long long val) {
+    return _format_int(dst, dlen, val);
+  }
+
+  /** Format an `unsigned long long` as a message argument.
+  @see format(char*, size_t, T, int) */
+  static OATMEAL_WORKER size_t format_ullong(char *dst, size_t dlen,
+                                             unsigned long long val) {
+    return _format_int(dst, dlen, val);
+  }
+
+ private:
+  template<typename T>
+  static size_t _format_int(char *dst, size_t dlen, T val) {
     char buf[41];  // long enough for -2**127 (128 bit)
     char *ptr = buf;
     bool neg = false;
@@ -338,6 +512,7 @@ class OatmealFmt {
     return nbytes;
   }
 
+ public:
   /** Format a missing value (None/NULL/nil).
 
   @param dst: memory to format None into.
@@ -391,24 +566,34 @@ class OatmealFmt {
   `len` bytes, it is considered an error.
   @returns The number of bytes parsed or 0 on error.
   */
-  template<typename T>
-  static inline size_t _parse_signed(T *result, const char *str, size_t len,
-                                     T min_val, T max_val) {
+  #ifdef OATMEAL_NO_LLONG
+    typedef long WideInt;
+  #else
+    typedef long long WideInt;
+  #endif
+
+  /** Parse a signed integer into the widest type, checking its range.
+  Shared by all signed integer types. */
+  static OATMEAL_WORKER size_t _parse_wide(WideInt *result,
+                                           const char *str, size_t len,
+                                           WideInt min_val, WideInt max_val) {
     *result = 0;
     char *endptr = NULL;
     #ifdef OATMEAL_NO_LLONG
-      long tmp = strtol(str, &endptr, 10);
+      WideInt tmp = strtol(str, &endptr, 10);
     #else
-      long long tmp = strtoll(str, &endptr, 10);
+      WideInt tmp = strtoll(str, &endptr, 10);
     #endif
     if (!(min_val <= tmp && tmp <= max_val && endptr <= str+len)) { return 0; }
     *result = tmp;
     return endptr-str;
   }
 
-  template<typename T>
-  static inline size_t _parse_unsigned(T *result, const char *str, size_t len,
-                                       T max_val) {
+  /** Parse an unsigned integer, checking its range.
+  Shared by all unsigned integer types. */
+  static OATMEAL_WORKER size_t _parse_wide(unsigned long *result,
+                                           const char *str, size_t len,
+                                           unsigned long max_val) {
     *result = 0;
     char *endptr = NULL;
     unsigned long tmp = strtoul(str, &endptr, 10);
@@ -417,6 +602,24 @@ class OatmealFmt {
     return endptr-str;
   }
 
+  template<typename T>
+  static inline size_t _parse_signed(T *result, const char *str, size_t len,
+                                     T min_val, T max_val) {
+    WideInt tmp;
+    size_t n = _parse_wide(&tmp, str, len, min_val, max_val);
+    *result = tmp;
+    return n;
+  }
+
+  template<typename T>
+  static inline size_t _parse_unsigned(T *result, const char *str, size_t len,
+                                       T max_val) {
+    unsigned long tmp;
+    size_t n = _parse_wide(&tmp, str, len, max_val);
+    *result = tmp;
+    return n;
+  }
+
  public:
   /** Parse an integer (signed char) from the start of a string.
 
@@ -505,7 +708,7 @@ class OatmealFmt {
   @param len: max number of bytes of `str` to use (not including any nul-byte).
   @returns The number of bytes parsed or 0 on failure. */
   static inline size_t parse(float *result, const char *str, size_t len) {
-    return parse_decimal(result, str, len, FLT_MIN, FLT_MAX);
+    return parse_decimal(result, str, len, -FLT_MAX, FLT_MAX);
   }
 
   /** Parse a real value message argument (double) from the start of a string.
@@ -514,7 +717,7 @@ class OatmealFmt {
   @param len: max number of bytes of `str` to use (not including any nul-byte).
   @returns The number of bytes parsed or 0 on failure. */
   static inline size_t parse(double *result, const char *str, size_t len) {
-    return parse_decimal(result, str, len, DBL_MIN, DBL_MAX);
+    return parse_decimal(result, str, len, -DBL_MAX, DBL_MAX);
   }
 
   /** Parse a boolean message argument from the start of a string.
@@ -664,6 +867,66 @@ class OatmealFmt {
 };
 
 
+/** The indices 0..N-1 as a parameter pack, for building arrays at compile
+time: `OatmealMakeIndices<N>::type` is `OatmealIndices<0, 1, ..., N-1>`. */
+template<size_t... I> struct OatmealIndices {};
+template<size_t N, size_t... I>
+struct OatmealMakeIndices : OatmealMakeIndices<N-1, N-1, I...> {};
+template<size_t... I>
+struct OatmealMakeIndices<0, I...> { typedef OatmealIndices<I...> type; };
+
+/**
+A string argument that was escaped and quoted at compile time. Create one with
+`OATMEAL_STR("text")`, then pass it to `append()`, `write()` or
+`append_dict_key_value()` of `OatmealMsg` or `OatmealPort`.
+
+Appending it is a single copy of `N` bytes. `OatmealPort` also updates its
+running checksum in one step, using the checksum of the literal computed at
+compile time.
+
+Unlike `F()` strings, literals are kept in RAM: use `F()` where RAM is tight
+and `OATMEAL_STR()` where time spent sending is.
+*/
+template<size_t N>
+class OatmealStrLiteral {
+ public:
+  /* <, cmd, flag, token, >, checklen, checksum */
+  static_assert(N + 10 <= OATMEAL_MAX_MSG_LEN,
+                "String literal too long to fit in an Oatmeal frame");
+
+  /** Encoded string with quotes, e.g. `"a\"b"`, nul-terminated */
+  const char str[N+1];
+  /** Checksum of `str` starting from a running checksum of 0 */
+  const uint8_t checksum;
+  /** Factor a running checksum is multiplied by over the `N` bytes of `str` */
+  const uint8_t checksum_coeff;
+
+  template<size_t... I>
+  constexpr OatmealStrLiteral(const char *src, size_t srclen,
+                              OatmealIndices<I...>)
+    : str{(I == 0 || I == N-1 ? '"' :
+           OatmealFmt::escaped_char(src, srclen, I-1))..., '\0'},
+      checksum(OatmealFmt::checksum_add(
+        OatmealFmt::escaped_checksum(src, srclen,
+                                     OatmealFmt::checksum_add(0, '"')), '"')),
+      checksum_coeff(OatmealFmt::checksum_coeff_pow(N)) {}
+
+  /** Number of bytes in the encoded string, including quotes */
+  static constexpr size_t length() { return N; }
+};
+
+/** Escape and quote a string literal at compile time.
+@param s: a string literal e.g. `OATMEAL_STR("busy")`
+@returns a reference to a `const OatmealStrLiteral` */
+#define OATMEAL_STR(s) \
+  ([]() -> const OatmealStrLiteral<OatmealFmt::escaped_len(s, sizeof(s)-1)+2>& { \
+    static constexpr OatmealStrLiteral< \
+      OatmealFmt::escaped_len(s, sizeof(s)-1)+2> lit( \
+      s, sizeof(s)-1, \
+      OatmealMakeIndices<OatmealFmt::escaped_len(s, sizeof(s)-1)+2>::type()); \
+    return lit; \
+  }())
+
 /**
 An immutable Oatmeal message that doesn't store it's own frame data. Instead
 it points to a buffer it does not own.
@@ -704,12 +967,25 @@ class OatmealMsgReadonly {
     return strncmp(opcode(), opcode_str, OPCODE_LEN) == 0;
   }
 
+  /** Check if this message has the given opcode stored in flash, e.g.
+  `msg.is_opcode(F("HALR"))`.
+  @returns `true` if this message has the given opcode (cmd+flag: 4 bytes) */
+  bool is_opcode(const __FlashStringHelper *opcode_str) const {
+    return OatmealFmt::flash_match(opcode(), opcode_str, OPCODE_LEN);
+  }
+
   /** Check if this message has the given command.
   @returns `true` if this message has the given command (3 bytes) */
   bool is_command(const char *command) const {
     return strncmp(opcode(), command, CMD_LEN) == 0;
   }
 
+  /** Check if this message has the given command stored in flash.
+  @returns `true` if this message has the given command (3 bytes) */
+  bool is_command(const __FlashStringHelper *command) const {
+    return OatmealFmt::flash_match(opcode(), command, CMD_LEN);
+  }
+
   /** Get a point to this message's underlying frame (byte representation) */
   const char* frame() const { return frameptr; }
 
@@ -838,16 +1114,28 @@ class OatmealMsg : public OatmealMsgReadonly {
   @returns the number of bytes written (no nul-byte) or 0 on failure. */
   template<typename T>
   size_t _append_val(T val, int sig_figs = OatmealFmt::DEFAULT_SIG_FIGS) {
+    // Both calls increment len if successful
+    size_t orig_len = _start_val();
+    return _finish_val(orig_len, _write_val(val, sig_figs));
+  }
+
+  /** Start appending an argument: add a separator if needed.
+  @returns the length of the frame before the argument */
+  OATMEAL_WORKER size_t _start_val() {
     size_t orig_len = len;
-    // Next two lines increment len if successful
     separator_if_needed();
-    size_t n = _write_val(val, sig_figs);
+    return orig_len;
+  }
+
+  /** Finish appending an argument of `n` bytes, undoing it if `n` is 0.
+  @returns the number of bytes appended (no nul-byte) or 0 on failure. */
+  OATMEAL_WORKER size_t _finish_val(size_t orig_len, size_t n) {
     if (!n) { return reset_len(orig_len); }
     return len - orig_len;
   }
 
-  template<typename T>
-  size_t _append_dict_key_value(const char *key, T val,
+  template<typename K, typename T>
+  size_t _append_dict_key_value(K key, T val,
                                 int sig_figs = OatmealFmt::DEFAULT_SIG_FIGS) {
     size_t orig_len = len;
     if (!append_dict_key(key) || !_append_val(val, sig_figs)) {
@@ -915,6 +1203,18 @@ class OatmealMsg : public OatmealMsgReadonly {
     return orig_len - len;
   }
 
+  /** Write a string stored in flash onto the end of the message.
+  @returns the number of bytes written (no nul-byte) or 0 on failure.
+  @see OatmealPort::write(const __FlashStringHelper*) */
+  size_t write(const __FlashStringHelper *str) {
+    size_t orig_len = len;
+    char c;
+    for (size_t i = 0; (c = OatmealFmt::flash_char(str, i)); i++) {
+      if (!write(c)) { return reset_len(orig_len); }
+    }
+    return len - orig_len;
+  }
+
   /** Append a `n` bytes pointed to by `ptr`.
   @returns the number of bytes written (no nul-byte) or 0 on failure.
   @see OatmealPort::write(const char*, size_t) */
@@ -925,6 +1225,17 @@ class OatmealMsg : public OatmealMsgReadonly {
     return n;
   }
 
+  /** Append a string literal escaped at compile time by `OATMEAL_STR()`.
+  @returns the number of bytes written (no nul-byte) or 0 on failure.
+  @see OatmealPort::write(const OatmealStrLiteral<N>&) */
+  template<size_t N>
+  size_t write(const OatmealStrLiteral<N> &str) {
+    if (len + N > MAX_FRAME_END_OFFSET) { return 0; }
+    memcpy(buf+len, str.str, N+1);
+    len += N;
+    return N;
+  }
+
   /** Encode and write a byte to this frame as part of a str/data message argument.
   @returns the number of bytes written (1 on success, 0 on failure).
   @see OatmealPort::write_encoded(const char c) */
@@ -1007,6 +1318,25 @@ class OatmealMsg : public OatmealMsgReadonly {
     return _append_val(str);
   }
 
+  /** Append a null terminated string argument stored in flash, e.g. `F("hi")`.
+  @returns Number of frame bytes written out, or 0 on failure
+  @see OatmealPort::append(const __FlashStringHelper*) */
+  size_t append(const __FlashStringHelper *str) {
+    return _append_val(str);
+  }
+
+  /** Append a string argument escaped at compile time, e.g.
+  `append(OATMEAL_STR("busy"))`.
+  @returns Number of frame bytes written out, or 0 on failure
+  @see OatmealPort::append(const OatmealStrLiteral<N>&) */
+  template<size_t N>
+  size_t append(const OatmealStrLiteral<N> &str) {
+    size_t orig_len = len;
+    separator_if_needed();
+    if (!write(str)) { return reset_len(orig_len); }
+    return len - orig_len;
+  }
+
   /** Append a data bytes argument to the message.
   @returns Number of frame bytes written out, or 0 on failure
   @see OatmealPort::append(const uint8_t*, size_t) */
@@ -1090,6 +1420,19 @@ class OatmealMsg : public OatmealMsgReadonly {
     return len - orig_len;
   }
 
+  /** Append (separator if needed then) a dictionary key stored in flash and
+  equals sign.
+  @returns the number of bytes written (no nul-byte) or 0 on failure.
+  @see OatmealPort::append_dict_key(const __FlashStringHelper*) */
+  size_t append_dict_key(const __FlashStringHelper *key) {
+    size_t orig_len = len;
+    separator_if_needed();
+    if (!write(key) || !write(OatmealFmt::DICT_KV_SEP)) {
+      return reset_len(orig_len);
+    }
+    return len - orig_len;
+  }
+
   /** Append a key=value pair to a dictionary for a float value.
   @returns the number of bytes written (no nul-byte) or 0 on failure.
   @see OatmealPort::append_dict_key_value(const char*, float, int) */
@@ -1114,16 +1457,48 @@ class OatmealMsg : public OatmealMsgReadonly {
     return _append_dict_key_value(key, val);
   }
 
+  /** Append a key=value pair to a dictionary with a key stored in flash, e.g.
+  `append_dict_key_value(F("loop_ms"), 12)`.
+  @returns the number of bytes written (no nul-byte) or 0 on failure.
+  @see OatmealPort::append_dict_key_value(const __FlashStringHelper*, T) */
+  template<typename T>
+  size_t append_dict_key_value(const __FlashStringHelper *key, T val) {
+    return _append_dict_key_value(key, val);
+  }
+
+  /** Append a key=value pair to a dictionary for a string value escaped at
+  compile time by `OATMEAL_STR()`.
+  @returns the number of bytes written (no nul-byte) or 0 on failure.
+  @see OatmealPort::append_dict_key_value(const char*, const OatmealStrLiteral<N>&) */
+  template<size_t N>
+  size_t append_dict_key_value(const char *key,
+                               const OatmealStrLiteral<N> &val) {
+    size_t orig_len = len;
+    if (!append_dict_key(key) || !write(val)) { return reset_len(orig_len); }
+    return len - orig_len;
+  }
+
+  /** Append a key=value pair to a dictionary with a key stored in flash for a
+  string value escaped at compile time by `OATMEAL_STR()`.
+  @returns the number of bytes written (no nul-byte) or 0 on failure. */
+  template<size_t N>
+  size_t append_dict_key_value(const __FlashStringHelper *key,
+                               const OatmealStrLiteral<N> &val) {
+    size_t orig_len = len;
+    if (!append_dict_key(key) || !write(val)) { return reset_len(orig_len); }
+    return len - orig_len;
+  }
+
   /** Append a key=value pair to a dictionary for a bytes value.
   @param key: null termintated string to use as the key
   @param data: bytes to use as the value
-  @param len: number of bytes to represent in the value
+  @param n_bytes: number of bytes to represent in the value
   @returns the number of bytes written (no nul-byte) or 0 on failure.
   @see OatmealPort::append_dict_key_value(const char*, const uint8_t*, size_t) */
   size_t append_dict_key_value(const char *key,
-                               const uint8_t *data, size_t len) {
+                               const uint8_t *data, size_t n_bytes) {
     size_t orig_len = len;
-    if (!append_dict_key(key) || !append(data, len)) {
+    if (!append_dict_key(key) || !append(data, n_bytes)) {
       return reset_len(orig_len);
     }
     return len - orig_len;
@@ -1141,6 +1516,233 @@ class OatmealMsg : public OatmealMsgReadonly {
 };
 
 
+/**
+Computes the exact length of a frame without building or sending it, so that a
+sender can split or shorten a message before it starts sending. Has the same
+methods for constructing a message as `OatmealMsg` and `OatmealPort`, each
+returning the number of bytes the call would add. Unlike `OatmealMsg`, there is
+no limit on the length.
+
+Example:
+
+    OatmealSizer size;
+    size.start("LOG", 'B', "xx");  // token bytes don't change the length
+    size.append(text);
+    size.finish();
+    if (size.fits()) {
+      // Refuses (and counts) frames too long for the receiver
+      port.start("LOG", 'B', port.next_token(tok), size.length());
+      ...
+*/
+class OatmealSizer {
+ private:
+  size_t len = 0;
+  bool need_sep = false;
+
+  /* Add a value, after which a separator is needed */
+  size_t add_val(size_t n) { len += n; need_sep = true; return n; }
+  /* Add a dict key or list/dict start, which a value follows directly */
+  size_t add_key(size_t n) { len += n; need_sep = false; return n; }
+
+ public:
+  /* Lengths of single arguments */
+
+  /** Length of data once encoded (escaped), without quotes */
+  static size_t encoded_len(const uint8_t *data, size_t n_bytes) {
+    size_t n = n_bytes;
+    for (size_t i = 0; i < n_bytes; i++) {
+      n += OatmealFmt::needs_escape(data[i]);
+    }
+    return n;
+  }
+
+  /** Length of a null terminated string once encoded, without quotes */
+  static size_t encoded_len(const char *str) {
+    size_t n = 0;
+    for (; *str; str++) { n += 1 + OatmealFmt::needs_escape(*str); }
+    return n;
+  }
+
+  /** Length of a null terminated string stored in flash once encoded, without
+  quotes */
+  static size_t encoded_len(const __FlashStringHelper *str) {
+    size_t n = 0;
+    char c;
+    for (size_t i = 0; (c = OatmealFmt::flash_char(str, i)); i++) {
+      n += 1 + OatmealFmt::needs_escape(c);
+    }
+    return n;
+  }
+
+  /** Length of a string argument, including quotes */
+  static size_t arg_len(const char *str) {
+    return str ? encoded_len(str) + 2 : 1;
+  }
+
+  /** Length of a string argument stored in flash, including quotes */
+  static size_t arg_len(const __FlashStringHelper *str) {
+    return str ? encoded_len(str) + 2 : 1;
+  }
+
+  /** Length of a bytes argument, including `0""` */
+  static size_t arg_len(const uint8_t *data, size_t n_bytes) {
+    return data ? encoded_len(data, n_bytes) + 3 : 1;
+  }
+
+  /** Length of a string argument escaped at compile time */
+  template<size_t N>
+  static size_t arg_len(const OatmealStrLiteral<N> &str) {
+    (void)str;
+    return N;
+  }
+
+  /** Length of an integer, float, double or boolean argument.
+  Formats the value to measure it. */
+  template<typename T>
+  static size_t arg_len(T val, int sig_figs = OatmealFmt::DEFAULT_SIG_FIGS) {
+    char tmp[41];
+    return OatmealFmt::format(tmp, sizeof(tmp), val, sig_figs);
+  }
+
+  /* Frame construction, mirroring OatmealMsg */
+
+  /** Start sizing a frame with a given command, flag and token
+  @returns the number of bytes the frame starts with
+  @see OatmealMsg::start(const char*, char, const char*) */
+  size_t start(const char *cmd, char flag, const char *token) {
+    (void)cmd; (void)flag; (void)token;
+    len = OatmealMsg::ARGS_OFFSET;
+    need_sep = false;
+    return len;
+  }
+
+  /** @see OatmealMsg::separator() */
+  size_t separator() {
+    len++;
+    need_sep = false;
+    return 1;
+  }
+
+  /** @see OatmealMsg::separator_if_needed() */
+  size_t separator_if_needed() {
+    return need_sep ? separator() : 0;
+  }
+
+  /** @see OatmealMsg::append(const char*) */
+  size_t append(const char *str) {
+    return separator_if_needed() + add_val(arg_len(str));
+  }
+
+  /** @see OatmealMsg::append(const __FlashStringHelper*) */
+  size_t append(const __FlashStringHelper *str) {
+    return separator_if_needed() + add_val(arg_len(str));
+  }
+
+  /** @see OatmealMsg::append(const uint8_t*, size_t) */
+  size_t append(const uint8_t *data, size_t n_bytes) {
+    return separator_if_needed() + add_val(arg_len(data, n_bytes));
+  }
+
+  /** @see OatmealMsg::append(const OatmealStrLiteral<N>&) */
+  template<size_t N>
+  size_t append(const OatmealStrLiteral<N> &str) {
+    return separator_if_needed() + add_val(arg_len(str));
+  }
+
+  /** @see OatmealMsg::append(double, int) */
+  size_t append(double val, int sig_figs = OatmealFmt::DEFAULT_SIG_FIGS) {
+    return separator_if_needed() + add_val(arg_len(val, sig_figs));
+  }
+
+  /** @see OatmealMsg::append(float, int) */
+  size_t append(float val, int sig_figs = OatmealFmt::DEFAULT_SIG_FIGS) {
+    return separator_if_needed() + add_val(arg_len(val, sig_figs));
+  }
+
+  /** @see OatmealMsg::append(T) */
+  template<typename T>
+  size_t append(T val) {
+    return separator_if_needed() + add_val(arg_len(val));
+  }
+
+  /** @see OatmealMsg::append_none() */
+  size_t append_none() {
+    return separator_if_needed() + add_val(1);
+  }
+
+  /** @see OatmealMsg::append_list_start() */
+  size_t append_list_start() {
+    return separator_if_needed() + add_key(1);
+  }
+
+  /** @see OatmealMsg::append_list_end() */
+  size_t append_list_end() { return add_val(1); }
+
+  /** @see OatmealMsg::append_dict_start() */
+  size_t append_dict_start() { return append_list_start(); }
+
+  /** @see OatmealMsg::append_dict_end() */
+  size_t append_dict_end() { return add_val(1); }
+
+  /** @see OatmealMsg::append_dict_key(const char*) */
+  size_t append_dict_key(const char *key) {
+    size_t n = strlen(key) + 1;
+    return separator_if_needed() + add_key(n);
+  }
+
+  /** @see OatmealMsg::append_dict_key(const __FlashStringHelper*) */
+  size_t append_dict_key(const __FlashStringHelper *key) {
+    size_t n = 1;
+    for (size_t i = 0; OatmealFmt::flash_char(key, i); i++) { n++; }
+    return separator_if_needed() + add_key(n);
+  }
+
+  /** @see OatmealMsg::append_dict_key_value(const char*, float, int) */
+  size_t append_dict_key_value(const char *key, float val,
+                               int sig_figs = OatmealFmt::DEFAULT_SIG_FIGS) {
+    return append_dict_key(key) + append(val, sig_figs);
+  }
+
+  /** @see OatmealMsg::append_dict_key_value(const char*, double, int) */
+  size_t append_dict_key_value(const char *key, double val,
+                               int sig_figs = OatmealFmt::DEFAULT_SIG_FIGS) {
+    return append_dict_key(key) + append(val, sig_figs);
+  }
+
+  /** @see OatmealMsg::append_dict_key_value(const char*, T) */
+  template<typename T>
+  size_t append_dict_key_value(const char *key, T val) {
+    return append_dict_key(key) + append(val);
+  }
+
+  /** @see OatmealMsg::append_dict_key_value(const __FlashStringHelper*, T) */
+  template<typename T>
+  size_t append_dict_key_value(const __FlashStringHelper *key, T val) {
+    return append_dict_key(key) + append(val);
+  }
+
+  /** @see OatmealMsg::append_dict_key_value(const char*, const uint8_t*, size_t) */
+  size_t append_dict_key_value(const char *key,
+                               const uint8_t *data, size_t n_bytes) {
+    return append_dict_key(key) + append(data, n_bytes);
+  }
+
+  /** Add the frame end byte and checksum bytes.
+  @returns the number of bytes added (3)
+  @see OatmealMsg::finish() */
+  size_t finish() {
+    len += 3;
+    return 3;
+  }
+
+  /** Length of the frame so far, or of the whole frame after `finish()` */
+  size_t length() const { return len; }
+
+  /** Whether the frame is short enough to be received.
+  @returns `true` if the frame is at most `OatmealMsg::MAX_MSG_LEN` bytes */
+  bool fits() const { return len <= OatmealMsg::MAX_MSG_LEN; }
+};
+
 class OatmealArgParser {
  private:
   const char *args = nullptr;
@@ -1193,6 +1795,23 @@ class OatmealArgParser {
     remchars -= n;
   }
 
+  /** Check if another argument can be parsed.
+  @param sep: set to the number of separator chars before the argument
+  @returns `true` if the next argument can be parsed */
+  OATMEAL_WORKER bool _start_arg(size_t *sep) {
+    *sep = need_sep;
+    return able_to_parse_next_arg();
+  }
+
+  /** Consume an argument of `n` chars after `sep` separator chars.
+  @returns `false` if `n` is 0 i.e. the argument failed to parse */
+  OATMEAL_WORKER bool _finish_arg(size_t n, size_t sep) {
+    if (n == 0) { return false; }
+    chomp(n+sep);
+    args_parsed = need_sep = true;
+    return true;
+  }
+
  public:
   /** Start parsing a message if it has the correct opcode.
 
@@ -1357,14 +1976,10 @@ class OatmealArgParser {
   @returns `true` on success, otherwise this object remains unchanged. */
   template<typename T>
   bool parse_arg(T *result) {
-    if (!able_to_parse_next_arg()) { return false; }
-    size_t n, sep = need_sep;
+    size_t sep;
+    if (!_start_arg(&sep)) { return false; }
     // printf("  parsing '%.*s'\n", (int)(remchars-sep), args+sep);
-    n = OatmealFmt::parse(result, args+sep, remchars-sep);
-    if (n == 0) { return false; }
-    chomp(n+sep);
-    args_parsed = need_sep = true;
-    return true;
+    return _finish_arg(OatmealFmt::parse(result, args+sep, remchars-sep), sep);
   }
 
   /** Parse a string argument (returned string is utf-8 encoded).
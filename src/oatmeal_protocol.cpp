@@ -25,17 +25,16 @@ size_t OatmealStats::format_stats(OatmealMsg *msg) const {
   size_t orig_msg_len = msg->length();
 
   if (n_oatmeal_errs) {
-    msg->append("oatmeal_errs=");
-    msg->append(n_oatmeal_errs);
-
-    if (n_frame_too_short)   { msg->append(",sh="); msg->append(n_frame_too_short); }
-    if (n_frame_too_long)    { msg->append(",lg="); msg->append(n_frame_too_long); }
-    if (n_missing_start_byte){ msg->append(",ms="); msg->append(n_missing_start_byte); }
-    if (n_missing_end_byte)  { msg->append(",me="); msg->append(n_missing_end_byte); }
-    if (n_bad_checksums)     { msg->append(",bc="); msg->append(n_bad_checksums); }
-    if (n_illegal_character) { msg->append(",bb="); msg->append(n_illegal_character); }
-    if (n_unknown_opcode)    { msg->append(",uo="); msg->append(n_unknown_opcode); }
-    if (n_bad_messages)      { msg->append(",bm="); msg->append(n_bad_messages); }
+    msg->append_dict_key_value(F("oatmeal_errs"), n_oatmeal_errs);
+
+    if (n_frame_too_short)   { msg->append_dict_key_value(F("sh"), n_frame_too_short); }
+    if (n_frame_too_long)    { msg->append_dict_key_value(F("lg"), n_frame_too_long); }
+    if (n_missing_start_byte){ msg->append_dict_key_value(F("ms"), n_missing_start_byte); }
+    if (n_missing_end_byte)  { msg->append_dict_key_value(F("me"), n_missing_end_byte); }
+    if (n_bad_checksums)     { msg->append_dict_key_value(F("bc"), n_bad_checksums); }
+    if (n_illegal_character) { msg->append_dict_key_value(F("bb"), n_illegal_character); }
+    if (n_unknown_opcode)    { msg->append_dict_key_value(F("uo"), n_unknown_opcode); }
+    if (n_bad_messages)      { msg->append_dict_key_value(F("bm"), n_bad_messages); }
   }
 
   return msg->length() - orig_msg_len;
@@ -43,7 +42,7 @@ size_t OatmealStats::format_stats(OatmealMsg *msg) const {
 
 /*
 Increment the OatmealPort token and return a pointer to it.
-Not threadsafe.
+Not threadsafe: use next_token(char*) from other tasks.
 */
 const char* OatmealPort::next_token() {
   // Increment token and convert to string
@@ -55,11 +54,19 @@ const char* OatmealPort::next_token() {
   return token_str;
 }
 
+char* OatmealPort::next_token(char *dst) {
+  OATMEAL_TX_LOCK();
+  memcpy(dst, next_token(), OatmealMsg::TOKEN_LEN+1);
+  OATMEAL_TX_UNLOCK();
+  return dst;
+}
+
 
 bool OatmealPort::_read_uart_data() {
   // If we've read the start of a frame and it's already at max length and not
   // a complete message, reset buffer
   if (b_mid - b_start >= OatmealMsg::MAX_MSG_LEN) {
+    if (stream_on) { _stream_abort(); }
     b_start = b_mid;
     state = WaitingOnStart;
   }
@@ -73,13 +80,20 @@ bool OatmealPort::_read_uart_data() {
     b_end -= b_start;
     b_start = 0;
   }
-  // Get the number of bytes waiting from the serial port
-  size_t nbytes_avail = port->available();
   // Get space remaining in the input buffer
   size_t nbuf_rem = sizeof(buf) - b_end;
-  // Get the min of the two above numbers
-  size_t n = nbuf_rem < nbytes_avail ? nbuf_rem : nbytes_avail;
-  b_end += port->readBytes(buf+b_end, n);
+  size_t n;
+  if (rx_ring != nullptr) {
+    // Bytes were received by an ISR into the ring
+    n = rx_ring->ready() ? rx_ring->read(buf+b_end, nbuf_rem) : 0;
+  } else {
+    // Get the number of bytes waiting from the serial port
+    size_t nbytes_avail = port->available();
+    // Get the min of the two above numbers
+    n = nbuf_rem < nbytes_avail ? nbuf_rem : nbytes_avail;
+    n = port->readBytes(buf+b_end, n);
+  }
+  b_end += n;
   stats.n_bytes_read += n;
   return b_mid < b_end;
 }
@@ -108,6 +122,7 @@ bool OatmealPort::_consume_from_buffer() {
   for (; b_mid < b_end; b_mid++) {
     if (buf[b_mid] == 0) {
       // Invalid byte - reset the parser state and record the error
+      if (stream_on) { _stream_abort(); }
       b_start = b_mid;
       state = WaitingOnStart;
       stats.n_illegal_character++;
@@ -115,6 +130,7 @@ bool OatmealPort::_consume_from_buffer() {
       // A start byte means a packet is now starting, regardless of the state
       // we were in.
       stats.n_missing_end_byte += (state != WaitingOnStart);
+      if (stream_on) { _stream_abort(); }
       b_start = b_mid;
       state = WaitingOnEnd;
     } else if (state == WaitingOnStart) {
@@ -123,9 +139,20 @@ bool OatmealPort::_consume_from_buffer() {
       b_start = b_mid;
       stats.n_missing_start_byte += (buf[b_mid] == OatmealFmt::END_BYTE);
     } else if (state == WaitingOnEnd) {
+      if (stream_fn && !stream_skip &&
+          b_mid - b_start == OatmealMsg::ARGS_OFFSET) {
+        // Have the opcode and token: stream this frame?
+        stream_on = strncmp(buf+b_start+OatmealMsg::OPCODE_OFFSET,
+                            stream_opcode, OatmealMsg::OPCODE_LEN) == 0;
+        stream_in_str = stream_esc = false;
+        stream_depth = 0;
+        stream_sep = 0;
+      }
       // < => frame start, > => frame end, other => add to frame
       if (buf[b_mid] == OatmealFmt::END_BYTE) {
         state = WaitingOnLength;
+      } else if (stream_on) {
+        _stream_scan(buf[b_mid]);
       }
     } else if (state == WaitingOnLength) {
       // Now have a length-checksum byte
@@ -137,7 +164,9 @@ bool OatmealPort::_consume_from_buffer() {
       n = b_mid+1-b_start;
       b_start = b_mid+1;
       state = WaitingOnStart;
-      if (n < OatmealMsg::MIN_MSG_LEN) {
+      if (stream_on) {
+        _stream_end(msg_buf, n);
+      } else if (n < OatmealMsg::MIN_MSG_LEN) {
         stats.n_frame_too_short++;
       } else if (n > OatmealMsg::MAX_MSG_LEN) {
         stats.n_frame_too_long++;
@@ -145,15 +174,98 @@ bool OatmealPort::_consume_from_buffer() {
         stats.n_bad_checksums++;
       } else {
         msg_in = OatmealMsgReadonly(msg_buf, n);
+        msg_in_us = micros();
         stats.n_good_frames++;
         b_mid++;
         return true;
       }
     }
   }
+  if (stream_on && stream_sep) { _stream_deliver(); }
   return false;
 }
 
+
+/* Track nesting and strings to find separators between top-level args */
+void OatmealPort::_stream_scan(char c) {
+  if (stream_esc) {
+    stream_esc = false;
+  } else if (stream_in_str) {
+    if (c == '\\') { stream_esc = true; }
+    else if (c == '"') { stream_in_str = false; }
+  } else if (c == '"') {
+    stream_in_str = true;
+  } else if (c == OatmealFmt::LIST_START || c == OatmealFmt::DICT_START) {
+    stream_depth++;
+  } else if ((c == OatmealFmt::LIST_END || c == OatmealFmt::DICT_END) &&
+             stream_depth) {
+    stream_depth--;
+  } else if (c == OatmealFmt::ARG_SEP && !stream_depth) {
+    stream_sep = b_mid - b_start;
+  }
+}
+
+
+/* Pass the complete args received to the handler, then drop them from the
+buffer, keeping the frame's opcode and token */
+void OatmealPort::_stream_deliver() {
+  char *frame = buf+b_start, *args = frame+OatmealMsg::ARGS_OFFSET;
+  OatmealArgParser parser;
+  parser.init(args, stream_sep - OatmealMsg::ARGS_OFFSET);
+  stream_fn(OatmealStreamArgs,
+            OatmealMsgReadonly(frame, OatmealMsg::ARGS_OFFSET),
+            &parser, stream_ctx);
+
+  // Checksum covers the opcode and token the first time only
+  for (char *p = stream_skip ? args : frame; p <= frame+stream_sep; p++) {
+    stream_checksum = (stream_checksum + *p) * OATMEAL_CHECKSUM_COEFF;
+  }
+  size_t n_drop = stream_sep + 1 - OatmealMsg::ARGS_OFFSET;
+  memmove(args, args+n_drop, b_end - (b_start+stream_sep+1));
+  stream_skip += n_drop;
+  b_mid -= n_drop;
+  b_end -= n_drop;
+  stream_sep = 0;
+}
+
+
+/* Check the checksum of a streamed frame and commit or abort it */
+void OatmealPort::_stream_end(const char *frame, size_t n) {
+  OatmealMsgReadonly head(frame, OatmealMsg::ARGS_OFFSET);
+  uint8_t checksum = stream_skip ? stream_checksum : 0;
+  const char *p = stream_skip ? frame+OatmealMsg::ARGS_OFFSET : frame;
+  for (; p < frame+n-1; p++) {
+    checksum = (checksum + *p) * OATMEAL_CHECKSUM_COEFF;
+  }
+  size_t len = n + stream_skip;
+  stream_on = false;
+  stream_skip = 0;
+
+  if (frame[n-2] != OatmealMsg::length_checksum(len) ||
+      frame[n-1] != OatmealMsg::checkbyte_uint16_to_ascii(checksum)) {
+    stats.n_bad_checksums++;
+    stats.n_streams_aborted++;
+    stream_fn(OatmealStreamAbort, head, nullptr, stream_ctx);
+    return;
+  }
+  OatmealArgParser parser;
+  parser.init(frame+OatmealMsg::ARGS_OFFSET,
+              n - OatmealMsg::ARGS_OFFSET - OatmealMsg::CHECKSUM_LEN - 1);
+  stats.n_good_frames++;
+  stats.n_frames_streamed++;
+  stream_fn(OatmealStreamCommit, head, &parser, stream_ctx);
+}
+
+
+void OatmealPort::_stream_abort() {
+  stream_on = false;
+  stream_skip = 0;
+  stats.n_streams_aborted++;
+  stream_fn(OatmealStreamAbort,
+            OatmealMsgReadonly(buf+b_start, OatmealMsg::ARGS_OFFSET),
+            nullptr, stream_ctx);
+}
+
 /*
 Read a message from the port into `msg`. Returns true if a complete message
 was read. Messages with invalid checksums are dropped. Non-blocking.
@@ -174,15 +286,57 @@ bool OatmealPort::recv() {
 }
 
 
+bool OatmealPort::check_for_msgs(size_t max_msgs, uint32_t max_us) {
+  bool out_of_budget = false;
+  bool got_msg = _check_for_msgs(max_msgs, max_us, &out_of_budget);
+  stats.n_budget_calls++;
+  stats.n_budget_hits += out_of_budget;
+  return got_msg;
+}
+
+
+bool OatmealPort::_check_for_msgs(size_t max_msgs, uint32_t max_us,
+                                  bool *out_of_budget) {
+  uint32_t start_us = micros();
+  if (n_jobs_active) { poll_jobs(); }
+  if (var_registry && var_registry->get_n_watches()) { send_var_updates(); }
+  for (size_t n_msgs = 0; ; n_msgs++) {
+    if ((max_msgs && n_msgs >= max_msgs) ||
+        (max_us && micros() - start_us >= max_us)) {
+      *out_of_budget = msgs_pending();
+      return false;
+    }
+    if (!recv()) { return false; }
+    if (replay_cache && replay_request(msg_in)) { continue; }
+    if (!handle_msg(msg_in)) { return true; }
+  }
+}
+
+
+bool OatmealPort::replay_request(const OatmealMsgReadonly &msg) {
+  const char *resp;
+  size_t n;
+  if (msg.flag() != 'R' || !replay_cache->lookup(msg, &resp, &n)) {
+    return false;
+  }
+  OATMEAL_TX_LOCK();
+  port->write((const uint8_t*)resp, n);
+  OATMEAL_TX_UNLOCK();
+  stats.n_requests_replayed++;
+  return true;
+}
+
+
 bool OatmealPort::handle_msg(const OatmealMsgReadonly &msg) {
   OatmealArgParser parser;
   bool bool_arg = false;
+  uint32_t n_frames = 0, frame_len = 0;
 
-  if (msg.is_opcode("DISR")) {
+  if (msg.is_opcode(F("DISR"))) {
     /* Discovery Request doesn't have any parameters - no need to check */
     send_discovery_ack(msg.token());
     return true;
-  } else if (msg.is_opcode("HRTR")) {
+  } else if (msg.is_opcode(F("HRTR"))) {
     /* Heartbeat toggle request; args: <status:bool> */
     if (parser.init(msg) &&
         parser.parse_arg(&bool_arg) &&
@@ -191,7 +345,7 @@ bool OatmealPort::handle_msg(const OatmealMsgReadonly &msg) {
       send_ack(msg);
       return true;
     }
-  } else if (msg.is_opcode("LOGR")) {
+  } else if (msg.is_opcode(F("LOGR"))) {
     /* Logging toggle request; args: <status:bool> */
     if (parser.init(msg) &&
         parser.parse_arg(&bool_arg) &&
@@ -200,11 +354,463 @@ bool OatmealPort::handle_msg(const OatmealMsgReadonly &msg) {
       send_ack(msg);
       return true;
     }
+  } else if (msg.is_opcode(F("TIMR"))) {
+    /* Time sync request doesn't have any parameters */
+    send_time_sync_ack(msg);
+    return true;
+  } else if (msg.is_opcode(F("ECHR"))) {
+    /* Echo request; any args, returned verbatim */
+    start("ECH", 'A', msg.token());
+    write(msg.args(), msg.args_len());
+    finish();
+    return true;
+  } else if (msg.is_opcode(F("BSTR"))) {
+    /* Burst request; args: <n_frames:int>,<frame_len:int> */
+    if (parser.init(msg) &&
+        parser.parse_arg(&n_frames) &&
+        parser.parse_arg(&frame_len) &&
+        parser.finished()) {
+      send_burst(msg.token(), n_frames, frame_len);
+      return true;
+    }
+  } else if (var_registry != nullptr && handle_var_msg(msg)) {
+    return true;
+  }
+
+  return false;
+}
+
+
+bool OatmealPort::start_job(const OatmealMsgReadonly &msg,
+                            OatmealJobPollFn poll, void *ctx) {
+  for (uint8_t i = 0; i < OATMEAL_MAX_JOBS; i++) {
+    Job &job = jobs[i];
+    if (!job.active) {
+      memcpy(job.cmd, msg.opcode(), OatmealMsg::CMD_LEN);
+      memcpy(job.token, msg.token(), OatmealMsg::TOKEN_LEN);
+      job.poll = poll;
+      job.ctx = ctx;
+      job.active = true;
+      n_jobs_active++;
+      stats.n_jobs_started++;
+      if (n_jobs_active > stats.max_jobs_active) {
+        stats.max_jobs_active = n_jobs_active;
+      }
+      send_ack(msg);
+      return true;
+    }
+  }
+  stats.n_jobs_rejected++;
+  start(msg.opcode(), 'F', msg.token());
+  append(F("busy"));
+  finish();
+  return false;
+}
+
+void OatmealPort::finish_job(Job *job, bool success) {
+  job->active = false;
+  n_jobs_active--;
+  if (success) { stats.n_jobs_done++; }
+  else { stats.n_jobs_failed++; }
+  start(job->cmd, success ? 'D' : 'F', job->token);
+  finish();
+}
+
+bool OatmealPort::complete_job(const char *cmd, const char *token,
+                               bool success) {
+  for (uint8_t i = 0; i < OATMEAL_MAX_JOBS; i++) {
+    Job &job = jobs[i];
+    if (job.active &&
+        memcmp(job.cmd, cmd, OatmealMsg::CMD_LEN) == 0 &&
+        memcmp(job.token, token, OatmealMsg::TOKEN_LEN) == 0) {
+      finish_job(&job, success);
+      return true;
+    }
+  }
+  return false;
+}
+
+void OatmealPort::poll_jobs() {
+  for (uint8_t i = 0; i < OATMEAL_MAX_JOBS; i++) {
+    Job &job = jobs[i];
+    if (job.active && job.poll != nullptr) {
+      OatmealJobStatus status = job.poll(job.ctx);
+      if (status != OatmealJobRunning) {
+        finish_job(&job, status == OatmealJobDone);
+      }
+    }
+  }
+}
+
+
+bool OatmealVarRegistry::_add(const char *name, void *ptr, Type type,
+                              bool read_only) {
+  if (n_vars == MAX_VARS || strlen(name) > MAX_NAME_LEN) { return false; }
+  /* Insert in order of name */
+  uint8_t i = n_vars;
+  for (; i > 0; i--) {
+    int cmp = strcmp(vars[i-1].name, name);
+    if (cmp == 0) { return false; }
+    if (cmp < 0) { break; }
+  }
+  memmove(vars+i+1, vars+i, (n_vars-i) * sizeof(vars[0]));
+  for (uint8_t w = 0; w < n_watches; w++) {
+    if (watches[w].var_idx >= i) { watches[w].var_idx++; }
+  }
+  vars[i].name = name;
+  vars[i].ptr = ptr;
+  vars[i].type = type;
+  vars[i].read_only = read_only;
+  n_vars++;
+  return true;
+}
+
+const OatmealVarRegistry::Var* OatmealVarRegistry::find(const char *name) const {
+  uint8_t lo = 0, hi = n_vars;
+  while (lo < hi) {
+    uint8_t mid = (lo + hi) / 2;
+    int cmp = strcmp(vars[mid].name, name);
+    if (cmp == 0) { return &vars[mid]; }
+    if (cmp < 0) { lo = mid+1; } else { hi = mid; }
+  }
+  return nullptr;
+}
+
+size_t OatmealVarRegistry::type_size(Type type) {
+  switch (type) {
+    case Bool: return sizeof(bool);
+    case SChar: return sizeof(signed char);
+    case UChar: return sizeof(unsigned char);
+    case Short: return sizeof(short);
+    case UShort: return sizeof(unsigned short);
+    case Int: return sizeof(int);
+    case UInt: return sizeof(unsigned int);
+    case Long: return sizeof(long);
+    case ULong: return sizeof(unsigned long);
+    case Float: return sizeof(float);
+    case Double: return sizeof(double);
+  }
+  return 0;
+}
+
+/* Load a value of type T from `ptr`, which may not be aligned for T */
+template<typename T>
+static double load_as_double(const void *ptr) {
+  T val;
+  memcpy(&val, ptr, sizeof(val));
+  return val;
+}
+
+double OatmealVarRegistry::as_double(Type type, const void *ptr) {
+  switch (type) {
+    case Bool: return load_as_double<bool>(ptr);
+    case SChar: return load_as_double<signed char>(ptr);
+    case UChar: return load_as_double<unsigned char>(ptr);
+    case Short: return load_as_double<short>(ptr);
+    case UShort: return load_as_double<unsigned short>(ptr);
+    case Int: return load_as_double<int>(ptr);
+    case UInt: return load_as_double<unsigned int>(ptr);
+    case Long: return load_as_double<long>(ptr);
+    case ULong: return load_as_double<unsigned long>(ptr);
+    case Float: return load_as_double<float>(ptr);
+    case Double: return load_as_double<double>(ptr);
+  }
+  return 0;
+}
+
+bool OatmealVarRegistry::watch(const char *name, float deadband,
+                               uint16_t min_interval_ms) {
+  const Var *var = find(name);
+  if (var == nullptr) { return false; }
+  uint8_t var_idx = var - vars, w = 0;
+  while (w < n_watches && watches[w].var_idx != var_idx) { w++; }
+  if (w == n_watches) {
+    if (n_watches == MAX_WATCHES) { return false; }
+    n_watches++;
+    watches[w].var_idx = var_idx;
+    watches[w].sent = false;  /* report the current value first */
+  }
+  watches[w].deadband = deadband;
+  watches[w].min_interval_ms = min_interval_ms;
+  return true;
+}
+
+bool OatmealVarRegistry::is_watched(const Var *var) const {
+  for (uint8_t w = 0; w < n_watches; w++) {
+    if (watches[w].var_idx == var - vars) { return true; }
+  }
+  return false;
+}
+
+bool OatmealVarRegistry::unwatch(const char *name) {
+  const Var *var = find(name);
+  for (uint8_t w = 0; var != nullptr && w < n_watches; w++) {
+    if (watches[w].var_idx == var - vars) {
+      watches[w] = watches[--n_watches];
+      return true;
+    }
   }
+  return false;
+}
 
+bool OatmealVarRegistry::is_due(uint8_t w, uint32_t now_ms) const {
+  const Watch &watch = watches[w];
+  const Var &var = vars[watch.var_idx];
+  if (!watch.sent) { return true; }
+  if (now_ms - watch.last_sent_ms < watch.min_interval_ms) { return false; }
+  if (watch.deadband > 0) {
+    double diff = as_double(var.type, var.ptr) - as_double(var.type, watch.shadow);
+    return diff > watch.deadband || diff < -watch.deadband;
+  }
+  return memcmp(watch.shadow, var.ptr, type_size(var.type)) != 0;
+}
+
+void OatmealVarRegistry::mark_sent(uint8_t w, uint32_t now_ms) {
+  Watch &watch = watches[w];
+  const Var &var = vars[watch.var_idx];
+  memcpy(watch.shadow, var.ptr, type_size(var.type));
+  watch.last_sent_ms = now_ms;
+  watch.sent = true;
+}
+
+size_t OatmealVarRegistry::format(char *dst, size_t dlen, const Var &var) {
+  switch (var.type) {
+    case Bool: return OatmealFmt::format(dst, dlen, *static_cast<bool*>(var.ptr));
+    case SChar: return OatmealFmt::format(dst, dlen, *static_cast<signed char*>(var.ptr));
+    case UChar: return OatmealFmt::format(dst, dlen, *static_cast<unsigned char*>(var.ptr));
+    case Short: return OatmealFmt::format(dst, dlen, *static_cast<short*>(var.ptr));
+    case UShort: return OatmealFmt::format(dst, dlen, *static_cast<unsigned short*>(var.ptr));
+    case Int: return OatmealFmt::format(dst, dlen, *static_cast<int*>(var.ptr));
+    case UInt: return OatmealFmt::format(dst, dlen, *static_cast<unsigned int*>(var.ptr));
+    case Long: return OatmealFmt::format(dst, dlen, *static_cast<long*>(var.ptr));
+    case ULong: return OatmealFmt::format(dst, dlen, *static_cast<unsigned long*>(var.ptr));
+    case Float: return OatmealFmt::format(dst, dlen, *static_cast<float*>(var.ptr));
+    case Double: return OatmealFmt::format(dst, dlen, *static_cast<double*>(var.ptr));
+  }
+  return 0;
+}
+
+/* Parse a value of type T and store it in `ptr` if `set` is true */
+template<typename T>
+static bool parse_var_value(OatmealArgParser *parser, void *ptr, bool set) {
+  T val;
+  if (!parser->parse_arg(&val)) { return false; }
+  if (set) { *static_cast<T*>(ptr) = val; }
+  return true;
+}
+
+bool OatmealVarRegistry::parse(OatmealArgParser *parser, const Var &var,
+                               bool set) {
+  switch (var.type) {
+    case Bool: return parse_var_value<bool>(parser, var.ptr, set);
+    case SChar: return parse_var_value<signed char>(parser, var.ptr, set);
+    case UChar: return parse_var_value<unsigned char>(parser, var.ptr, set);
+    case Short: return parse_var_value<short>(parser, var.ptr, set);
+    case UShort: return parse_var_value<unsigned short>(parser, var.ptr, set);
+    case Int: return parse_var_value<int>(parser, var.ptr, set);
+    case UInt: return parse_var_value<unsigned int>(parser, var.ptr, set);
+    case Long: return parse_var_value<long>(parser, var.ptr, set);
+    case ULong: return parse_var_value<unsigned long>(parser, var.ptr, set);
+    case Float: return parse_var_value<float>(parser, var.ptr, set);
+    case Double: return parse_var_value<double>(parser, var.ptr, set);
+  }
   return false;
 }
 
+/* Append `name=value` to the dict being built in `msg`, leaving room to close
+the dict and append a bool. Returns false if it does not fit. */
+static bool append_var(OatmealMsg *msg, const OatmealVarRegistry::Var &var) {
+  char tmp[OatmealVarRegistry::MAX_NAME_LEN + 32];
+  size_t n = 0, name_len = strlen(var.name);
+  if (msg->frame()[msg->length()-1] != OatmealFmt::DICT_START) {
+    tmp[n++] = OatmealFmt::ARG_SEP;
+  }
+  memcpy(tmp+n, var.name, name_len);
+  n += name_len;
+  tmp[n++] = OatmealFmt::DICT_KV_SEP;
+  size_t n_val = OatmealVarRegistry::format(tmp+n, sizeof(tmp)-n, var);
+  if (!n_val) { return false; }
+  n += n_val;
+  /* +3 for the closing '}' and ",T" */
+  if (msg->length() + n + 3 > OatmealMsg::MAX_FRAME_END_OFFSET) { return false; }
+  msg->write(tmp, n);
+  return true;
+}
+
+void OatmealPort::send_var_dicts(const OatmealMsgReadonly &req,
+                                 OatmealArgParser *names) {
+  /*
+  Respond with one or more frames <vars:dict>,<more:bool> where more is `T` if
+  another frame follows.
+  */
+  OatmealMsg resp;
+  char name[OatmealVarRegistry::MAX_NAME_LEN+1];
+  const OatmealVarRegistry::Var *var = nullptr;
+  uint8_t i = 0;
+
+  resp.start(req.opcode(), 'A', req.token());
+  resp.append_dict_start();
+  while (true) {
+    if (names != nullptr) {
+      if (!names->parse_str(name, sizeof(name))) { break; }
+      var = var_registry->find(name);
+    } else {
+      if (i == var_registry->size()) { break; }
+      var = &var_registry->get(i++);
+    }
+    if (append_var(&resp, *var)) { continue; }
+    /* Frame full: send it and put this variable in the next one */
+    resp.append_dict_end();
+    resp.append(true);
+    resp.finish();
+    send(resp);
+    resp.start(req.opcode(), 'A', req.token());
+    resp.append_dict_start();
+    append_var(&resp, *var);
+  }
+  resp.append_dict_end();
+  resp.append(false);
+  resp.finish();
+  send(resp);
+}
+
+size_t OatmealPort::send_var_updates(uint32_t now_ms) {
+  /* Report <values:dict> of watched variables that have changed */
+  OatmealMsg msg;
+  char tok[OatmealMsg::TOKEN_LEN+1];
+  size_t n_msgs = 0;
+  bool empty = true;
+  if (!now_ms) { now_ms = millis(); }
+
+  for (uint8_t w = 0; w < var_registry->get_n_watches(); w++) {
+    if (!var_registry->is_due(w, now_ms)) { continue; }
+    if (empty) {
+      msg.start("VAR", 'B', next_token(tok));
+      msg.append_dict_start();
+      empty = false;
+    }
+    if (!append_var(&msg, var_registry->watched(w))) {
+      /* Frame full: send it and report this variable in the next one */
+      msg.append_dict_end();
+      msg.finish();
+      send(msg);
+      n_msgs++;
+      msg.start("VAR", 'B', next_token(tok));
+      msg.append_dict_start();
+      append_var(&msg, var_registry->watched(w));
+    }
+    var_registry->mark_sent(w, now_ms);
+  }
+  if (!empty) {
+    msg.append_dict_end();
+    msg.finish();
+    send(msg);
+    n_msgs++;
+  }
+  return n_msgs;
+}
+
+bool OatmealPort::handle_var_msg(const OatmealMsgReadonly &msg) {
+  OatmealArgParser parser, clone;
+  char name[OatmealVarRegistry::MAX_NAME_LEN+1] = "";
+  const OatmealVarRegistry::Var *var = nullptr;
+
+  if (msg.is_opcode(F("VDMR"))) {
+    /* Dump all variables; args: None */
+    send_var_dicts(msg, nullptr);
+    return true;
+  } else if (msg.is_opcode(F("VGTR"))) {
+    /* Get variables; args: <name:str>,... */
+    parser.init(msg);
+    clone = parser;
+    /* Check all names are known before responding */
+    while (parser.parse_str(name, sizeof(name))) {
+      if (var_registry->find(name) == nullptr) { break; }
+      name[0] = '\0';
+    }
+    if (name[0] == '\0' && parser.finished()) {
+      send_var_dicts(msg, &clone);
+      return true;
+    }
+  } else if (msg.is_opcode(F("VWTR"))) {
+    /* Watch variables; args: <min_interval_ms:int>,<deadband:float>,<name:str>,... */
+    uint16_t min_interval_ms = 0;
+    float deadband = 0;
+    /* Variables not yet watched, each counted once */
+    const OatmealVarRegistry::Var *added[OatmealVarRegistry::MAX_WATCHES];
+    uint8_t n_new = 0;
+    if (parser.init(msg) &&
+        parser.parse_arg(&min_interval_ms) &&
+        parser.parse_arg(&deadband)) {
+      /* First pass checks the names and that there is room to watch them */
+      clone = parser;
+      while (parser.parse_str(name, sizeof(name))) {
+        if ((var = var_registry->find(name)) == nullptr) { break; }
+        bool counted = var_registry->is_watched(var);
+        for (uint8_t i = 0; i < n_new && !counted; i++) {
+          counted = (added[i] == var);
+        }
+        if (!counted) {
+          if (var_registry->get_n_watches() + n_new ==
+              OatmealVarRegistry::MAX_WATCHES) {
+            break;  /* no room: report this name */
+          }
+          added[n_new++] = var;
+        }
+        name[0] = '\0';
+      }
+      if (name[0] == '\0' && parser.finished()) {
+        while (clone.parse_str(name, sizeof(name))) {
+          var_registry->watch(name, deadband, min_interval_ms);
+        }
+        send_ack(msg);
+        return true;
+      }
+    }
+  } else if (msg.is_opcode(F("VUWR"))) {
+    /* Stop watching variables; args: <name:str>,... or None for all */
+    parser.init(msg);
+    if (parser.finished()) {
+      var_registry->unwatch_all();
+    } else {
+      while (parser.parse_str(name, sizeof(name))) {
+        var_registry->unwatch(name);
+      }
+      name[0] = '\0';
+    }
+    if (parser.finished()) {
+      send_ack(msg);
+      return true;
+    }
+  } else if (msg.is_opcode(F("VSTR"))) {
+    /* Set variables; args: {<name>=<value>,...} */
+    /* First pass checks every value, second pass sets them */
+    for (uint8_t set = 0; set < 2; set++) {
+      if (!parser.init(msg) || !parser.parse_dict_start()) { break; }
+      while (!parser.parse_dict_end()) {
+        name[0] = '\0';
+        if (!parser.parse_dict_key(name, sizeof(name)) ||
+            (var = var_registry->find(name)) == nullptr ||
+            var->read_only ||
+            !OatmealVarRegistry::parse(&parser, *var, set)) {
+          break;
+        }
+        name[0] = '\0';
+      }
+      if (name[0] != '\0' || !parser.finished()) { break; }
+      if (set) { send_ack(msg); return true; }
+    }
+  } else {
+    return false;
+  }
+
+  /* Report the variable name that could not be handled, if any */
+  start(msg.opcode(), 'F', msg.token());
+  if (name[0] != '\0') { append(name); }
+  finish();
+  return true;
+}
+
 
 #ifdef TEENSY36
 static const time_t start_time = Teensy3Clock.get();
@@ -224,20 +830,135 @@ static inline int32_t get_free_ram_bytes() {
 void OatmealPort::build_status_heartbeat(OatmealMsg *resp,
                                          uint32_t max_loop_ms) {
   // Oatmeal errors
-  if (stats.format_stats(resp)) { resp->append(','); }
+  stats.format_stats(resp);
+  size_t n_budget_hits = stats.n_budget_hits;
+  size_t n_tx_too_long = stats.n_frames_refused + stats.n_frames_oversized;
   stats.reset();
   // Max loop period (milliseconds)
-  resp->append_dict_key_value("loop_ms", max_loop_ms);
+  resp->append_dict_key_value(F("loop_ms"), max_loop_ms);
+  // Number of calls to check_for_msgs() that ran out of time or messages
+  if (n_budget_hits) {
+    resp->append_dict_key_value(F("budget_hits"), n_budget_hits);
+  }
+  // Number of frames sent, or not sent, too long for the receiver
+  if (n_tx_too_long) {
+    resp->append_dict_key_value(F("tx_too_long"), n_tx_too_long);
+  }
   // Free RAM
   int32_t avail_kb = get_free_ram_bytes() / 1024;
-  resp->append_dict_key_value("avail_kb", avail_kb);
+  resp->append_dict_key_value(F("avail_kb"), avail_kb);
   // Uptime, if we have a real time clock (RTC)
   #ifdef TEENSY36
     uint32_t uptime_mins = (Teensy3Clock.get() - start_time) / 60;
-    resp->append_dict_key_value("uptime", uptime_mins);
+    resp->append_dict_key_value(F("uptime"), uptime_mins);
   #endif
 }
 
+size_t OatmealPort::send_samples(OatmealSampleBatch *batch, uint32_t now_us) {
+  OatmealMsg msg;
+  char tok[OatmealMsg::TOKEN_LEN+1];
+  /* dt and values, each at most 11 chars plus a separator */
+  char tmp[(OatmealSampleBatch::MAX_VALUES+1)*12];
+  size_t n_msgs = 0;
+  uint8_t n_samples = 0, n_values = batch->get_n_values();
+  if (!now_us) { now_us = micros(); }
+
+  int8_t b = batch->take(now_us, &n_samples);
+  if (b < 0) { return 0; }
+
+  uint8_t i = 0;
+  while (i < n_samples) {
+    uint32_t prev_us = batch->timestamp(b, i);
+    msg.start("SMP", 'B', next_token(tok));
+    msg.append(prev_us);
+    msg.append(n_values);
+    msg.append_list_start();
+    /* Add as many samples as fit in this frame, leaving room for the ']' */
+    for (bool first = true; i < n_samples; i++, first = false) {
+      const int32_t *vals = batch->values(b, i);
+      uint32_t t_us = batch->timestamp(b, i);
+      size_t n = 0;
+      if (!first) { tmp[n++] = OatmealFmt::ARG_SEP; }
+      n += OatmealFmt::format(tmp+n, sizeof(tmp)-n, t_us - prev_us);
+      for (uint8_t j = 0; j < n_values; j++) {
+        tmp[n++] = OatmealFmt::ARG_SEP;
+        n += OatmealFmt::format(tmp+n, sizeof(tmp)-n, vals[j]);
+      }
+      if (msg.length() + n + 1 > OatmealMsg::MAX_FRAME_END_OFFSET) {
+        /* Drop a sample too big to ever fit in a frame */
+        if (first) { i++; batch->n_dropped++; }
+        break;
+      }
+      msg.write(tmp, n);
+      prev_us = t_us;
+    }
+    msg.append_list_end();
+    msg.finish();
+    send(msg);
+    n_msgs++;
+  }
+
+  batch->release(b);
+  return n_msgs;
+}
+
+void OatmealPort::send_time_sync_ack(const OatmealMsgReadonly &msg) {
+  /*
+  Report <rx_us>,<tx_us>
+    - rx_us (int): micros() when the request was read in
+    - tx_us (int): micros() when the response started being written
+  */
+  uint32_t rx_us = (msg.frame() == msg_in.frame()) ? msg_in_us : micros();
+  start("TIM", 'A', msg.token());
+  append(rx_us);
+  append(static_cast<uint32_t>(micros()));
+  finish();
+}
+
+void OatmealPort::send_burst(const char *token, uint32_t n_frames,
+                             uint32_t frame_len) {
+  /*
+  Ack, then send <n_frames> frames of <frame_len> bytes as fast as possible:
+    BSTB <seq:int>,<padding:str>
+  then report how long it took:
+    BSTD <n_frames:int>,<elapsed_us:int>
+  The ack reports the number and length of the frames actually sent.
+  */
+  if (n_frames > OATMEAL_MAX_BURST_FRAMES) { n_frames = OATMEAL_MAX_BURST_FRAMES; }
+  /* The last frame has the longest seq: without padding, it is the shortest
+  frame that all others can be padded to. +6 for the separator, quotes, '>'
+  and two check bytes */
+  char seq_str[12];
+  uint32_t min_len = OatmealMsg::ARGS_OFFSET + 6 +
+                     OatmealFmt::format(seq_str, sizeof(seq_str),
+                                        n_frames ? n_frames - 1 : 0);
+  if (frame_len < min_len) { frame_len = min_len; }
+  if (frame_len > OatmealMsg::MAX_MSG_LEN) { frame_len = OatmealMsg::MAX_MSG_LEN; }
+  start("BST", 'A', token);
+  append(n_frames);
+  append(frame_len);
+  finish();
+
+  uint32_t start_us = micros();
+  for (uint32_t seq = 0; seq < n_frames; seq++) {
+    start("BST", 'B', token);
+    append(seq);
+    separator();
+    write('"');
+    /* +4 for the closing quote, '>' and two check bytes */
+    while (curr_msg_len + 4 < frame_len) { write('x'); }
+    write('"');
+    finish();
+  }
+  port->flush();
+  uint32_t elapsed_us = micros() - start_us;
+
+  start("BST", 'D', token);
+  append(n_frames);
+  append(elapsed_us);
+  finish();
+}
+
 void OatmealPort::send_discovery_ack(const char *token) {
   /*
   Report <role>,<instance_idx>,<hardware_id>,<version>
@@ -249,7 +970,11 @@ void OatmealPort::send_discovery_ack(const char *token) {
   */
   start("DIS", 'A', token);
   // Append role and instance index
-  append(role_str);
+  if (role_in_flash) {
+    append(reinterpret_cast<const __FlashStringHelper*>(role_str));
+  } else {
+    append(role_str);
+  }
   append(instance_idx);
 
   if (hardware_id != nullptr) {
@@ -279,3 +1004,19 @@ void OatmealPort::send_discovery_ack(const char *token) {
   }
   finish();
 }
+
+
+bool OatmealPortGroup::check_for_msgs() {
+  bool out_of_budget;
+  // One turn per port per call, so a busy link cannot hold up loop()
+  for (uint8_t n = 0; n < n_ports; n++) {
+    OatmealPort *port = ports[next_port];
+    next_port = next_port + 1 < n_ports ? next_port + 1 : 0;
+    // At most one message per port per turn
+    if (port->_check_for_msgs(1, 0, &out_of_budget)) {
+      curr_port = port;
+      return true;
+    }
+  }
+  return false;
+}
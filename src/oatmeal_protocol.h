@@ -31,6 +31,85 @@ need a redundant include to be future-proof.
   #define OATMEAL_INSTANCE_IDX 0
 #endif
 
+#ifndef OATMEAL_SAMPLE_BUF_LEN
+  /** Number of samples held by each half of an `OatmealSampleBatch` double
+  buffer. Two buffers of this many samples are allocated per batch. */
+  #define OATMEAL_SAMPLE_BUF_LEN 8
+#endif
+
+#ifndef OATMEAL_SAMPLE_MAX_VALUES
+  /** Maximum number of values recorded with each sample in an
+  `OatmealSampleBatch`. */
+  #define OATMEAL_SAMPLE_MAX_VALUES 2
+#endif
+
+#ifndef OATMEAL_MAX_JOBS
+  /** Max number of long-running jobs an `OatmealPort` tracks at once.
+  @see OatmealPort::start_job() */
+  #define OATMEAL_MAX_JOBS 4
+#endif
+
+#ifndef OATMEAL_TX_LOCK
+  /** Called before an `OatmealPort` writes a frame, and `OATMEAL_TX_UNLOCK()`
+  once the whole frame is written. Empty by default. When several tasks (e.g.
+  FreeRTOS tasks) send on the same port, define both, for instance to take
+  and give a mutex, so that frames are never interleaved on the wire. Frames
+  streamed with `start()` ... `finish()` hold the lock throughout, so keep
+  them short; other tasks should build an `OatmealMsg` and `send()` it. The
+  lock is never taken recursively. */
+  #define OATMEAL_TX_LOCK()
+#endif
+
+#ifndef OATMEAL_TX_UNLOCK
+  /** Release the lock taken by `OATMEAL_TX_LOCK()`. */
+  #define OATMEAL_TX_UNLOCK()
+#endif
+
+#ifndef OATMEAL_MAX_BURST_FRAMES
+  /** Max number of frames an `OatmealPort` sends in reply to a burst request
+  (`BSTR`). The burst is sent from `check_for_msgs()`, so this bounds how long
+  one request can hold up `loop()`: about 3s at 115200 baud. */
+  #define OATMEAL_MAX_BURST_FRAMES 256
+#endif
+
+#ifndef OATMEAL_MAX_PORTS
+  /** Max number of ports an `OatmealPortGroup` serves. */
+  #define OATMEAL_MAX_PORTS 4
+#endif
+
+#ifndef OATMEAL_REPLAY_CACHE_LEN
+  /** Number of recent requests an `OatmealReplayCache` holds responses for. */
+  #define OATMEAL_REPLAY_CACHE_LEN 4
+#endif
+
+#ifndef OATMEAL_REPLAY_BUF_LEN
+  /** Bytes of response frames stored per request by an `OatmealReplayCache`.
+  Requests with longer responses are not replayed. At most 255. */
+  #define OATMEAL_REPLAY_BUF_LEN 32
+#endif
+
+#ifndef OATMEAL_MAX_VARS
+  /** Max number of variables in an `OatmealVarRegistry`. */
+  #define OATMEAL_MAX_VARS 16
+#endif
+
+#ifndef OATMEAL_VAR_NAME_LEN
+  /** Max length of the name of a variable in an `OatmealVarRegistry`. */
+  #define OATMEAL_VAR_NAME_LEN 16
+#endif
+
+#ifndef OATMEAL_MAX_WATCHES
+  /** Max number of variables in an `OatmealVarRegistry` that can be watched
+  for changes at once. */
+  #define OATMEAL_MAX_WATCHES 4
+#endif
+
+#ifndef OATMEAL_RX_RING_LEN
+  /** Size in bytes of an `OatmealRxRing` receive buffer. Must be a power of two,
+  at most 32768. One byte of the buffer is always left unused. */
+  #define OATMEAL_RX_RING_LEN 256
+#endif
+
 
 class OatmealStats {
   /** Statistics about sending and receiving Oatmeal Protocol messages over
@@ -53,6 +132,28 @@ class OatmealStats {
   size_t n_unknown_opcode = 0;  /** unexpected opcode */
   size_t n_bad_messages = 0;  /** unexpected flag or args */
 
+  /* statistics on long-running jobs, see OatmealPort::start_job() */
+  size_t n_jobs_started = 0;
+  size_t n_jobs_done = 0;
+  size_t n_jobs_failed = 0;
+  size_t n_jobs_rejected = 0;  /** job table was full */
+  size_t max_jobs_active = 0;  /** most jobs running at once */
+
+  /* statistics on budgeted calls to OatmealPort::check_for_msgs() */
+  size_t n_budget_calls = 0;  /** budgeted calls made */
+  size_t n_budget_hits = 0;  /** calls that ran out of budget with data left */
+
+  /* statistics on OatmealReplayCache */
+  size_t n_requests_replayed = 0;  /** retransmitted requests answered */
+
+  /* statistics on frames streamed, see OatmealPort::set_stream_handler() */
+  size_t n_frames_streamed = 0;  /** streamed frames committed */
+  size_t n_streams_aborted = 0;  /** streamed frames that were corrupt */
+
+  /* statistics on frames sent too long for the receiver (MAX_MSG_LEN) */
+  size_t n_frames_refused = 0;  /** not sent by a checked start() */
+  size_t n_frames_oversized = 0;  /** sent anyway, so dropped by the receiver */
+
   /** Get the total number of errors encountered. */
   size_t get_n_errors() const {
     return n_frame_too_short +
@@ -71,7 +172,8 @@ class OatmealStats {
   }
 
   /**
-  Add error stats to a message, only adds if there are any errors.
+  Add error stats to a message as key=value pairs of a dictionary, only adds
+  if there are any errors.
   Call reset() on this object after calling this method to reset the counters.
   @returns the number of bytes written
   */
@@ -79,6 +181,608 @@ class OatmealStats {
 };
 
 
+class OatmealSampleBatch {
+  /** Double buffer of timestamped samples, filled from an ISR and sent in
+  batches as `SMPB` messages by `OatmealPort::send_samples()`.
+
+  Each sample is a device timestamp (from `micros()`) and a fixed number of
+  integer values. Samples are written into one buffer while the other is being
+  sent. A buffer is sent once it is full, or once its oldest sample is older
+  than the deadline set with `set_deadline_us()`.
+
+  Example:
+
+      OatmealSampleBatch batch(2);
+
+      void on_adc_isr() {
+        int32_t vals[2] = {read_adc(0), read_adc(1)};
+        batch.add(vals);
+      }
+
+      void loop() {
+        port.send_samples(&batch);
+      }
+  */
+
+ public:
+  /** Max number of samples in each half of the double buffer */
+  static const uint8_t BUF_LEN = OATMEAL_SAMPLE_BUF_LEN;
+  /** Max number of values per sample */
+  static const uint8_t MAX_VALUES = OATMEAL_SAMPLE_MAX_VALUES;
+
+ private:
+  struct Sample {
+    uint32_t t_us;
+    int32_t vals[MAX_VALUES];
+  };
+
+  Sample bufs[2][BUF_LEN];
+  volatile uint8_t n_samples[2] = {0, 0};
+  volatile bool ready[2] = {false, false};
+  /* Buffer currently being written to by add() */
+  volatile uint8_t fill_idx = 0;
+
+  uint8_t n_values;
+  uint32_t deadline_us = 0;
+
+  bool is_free(uint8_t b) const { return !ready[b] && n_samples[b] == 0; }
+
+ public:
+  /** Number of samples dropped because both buffers were full */
+  volatile size_t n_dropped = 0;
+
+  /** Create a new sample batch.
+  @param _n_values: number of values recorded with each sample, at most
+                    `MAX_VALUES`. */
+  explicit OatmealSampleBatch(uint8_t _n_values) :
+      n_values(_n_values < MAX_VALUES ? _n_values : MAX_VALUES) {}
+
+  /** Get the number of values recorded with each sample */
+  uint8_t get_n_values() const { return n_values; }
+
+  /** Set the max time a sample may wait before it is sent.
+  @param _deadline_us: max age in microseconds of the oldest unsent sample
+                       before a partially full buffer is sent. 0 means only
+                       send full buffers. */
+  void set_deadline_us(uint32_t _deadline_us) { deadline_us = _deadline_us; }
+
+  /** Record a sample. Safe to call from an interrupt handler.
+  @param t_us: device timestamp of the sample in microseconds.
+  @param vals: `get_n_values()` values to store.
+  @returns `false` if the sample was dropped because both buffers are full. */
+  bool add(uint32_t t_us, const int32_t *vals) {
+    uint8_t b = fill_idx;
+    if (n_samples[b] == BUF_LEN) {
+      /* Buffer filled earlier while the other one was still being sent */
+      if (!is_free(!b)) { n_dropped++; return false; }
+      b = fill_idx = !b;
+    }
+    Sample &s = bufs[b][n_samples[b]];
+    s.t_us = t_us;
+    for (uint8_t i = 0; i < n_values; i++) { s.vals[i] = vals[i]; }
+    if (++n_samples[b] == BUF_LEN) {
+      ready[b] = true;
+      if (is_free(!b)) { fill_idx = !b; }
+    }
+    return true;
+  }
+
+  /** Record a sample timestamped with `micros()`.
+  @see add(uint32_t, const int32_t*) */
+  bool add(const int32_t *vals) { return add(micros(), vals); }
+
+  /** Take a buffer that is ready to send, closing the buffer being filled if
+  its deadline has passed. Called from the main loop.
+  @param now_us: current time in microseconds.
+  @param n: set to the number of samples in the buffer taken.
+  @returns index of the buffer taken, or -1 if no buffer is ready. Must be
+           followed by `release()` with the index returned. */
+  int8_t take(uint32_t now_us, uint8_t *n) {
+    int8_t b = -1;
+    noInterrupts();
+    uint8_t f = fill_idx;
+    if (ready[!f]) {
+      b = !f;  /* older of the two buffers */
+    } else if (ready[f]) {
+      b = f;
+      fill_idx = !f;
+    } else if (n_samples[f] > 0 && deadline_us > 0 &&
+               now_us - bufs[f][0].t_us >= deadline_us) {
+      ready[f] = true;
+      fill_idx = !f;
+      b = f;
+    }
+    *n = (b >= 0) ? n_samples[b] : 0;
+    interrupts();
+    return b;
+  }
+
+  /** Get the timestamp of sample `i` of buffer `b` returned by `take()` */
+  uint32_t timestamp(int8_t b, uint8_t i) const { return bufs[b][i].t_us; }
+  /** Get the values of sample `i` of buffer `b` returned by `take()` */
+  const int32_t* values(int8_t b, uint8_t i) const { return bufs[b][i].vals; }
+
+  /** Mark buffer `b` returned by `take()` as sent, so it can be refilled */
+  void release(int8_t b) {
+    noInterrupts();
+    n_samples[b] = 0;
+    ready[b] = false;
+    interrupts();
+  }
+};
+
+
+class OatmealRxRing {
+  /** Lock-free single producer, single consumer ring buffer of received bytes.
+
+  Filled from an interrupt handler and read by `OatmealPort::recv()` from the
+  main loop, so that bytes are not lost in the core's serial buffer while
+  `loop()` is busy. Attach to a port with `OatmealPort::set_rx_ring()`.
+
+  Either `push()` each byte from your UART receive interrupt, or call
+  `fill_from()` from a timer interrupt to drain the core's serial buffer often
+  enough that it never overflows.
+
+  With frame pre-scanning on, the ring counts complete frames as bytes are
+  pushed, and the port only copies bytes out of the ring once a whole frame has
+  arrived (or the ring is half full), so `recv()` returns immediately while a
+  frame is still being received.
+
+  Example:
+
+      OatmealRxRing rx_ring;
+
+      void on_timer_isr() {
+        rx_ring.fill_from(&Serial);
+      }
+
+      void setup() {
+        port.set_rx_ring(&rx_ring);
+      }
+  */
+
+ public:
+  /** Size of the ring buffer in bytes */
+  static const uint16_t LEN = OATMEAL_RX_RING_LEN;
+  static_assert(LEN && !(LEN & (LEN-1)) && LEN <= 32768,
+                "OATMEAL_RX_RING_LEN must be a power of two <= 32768");
+
+ private:
+  static const uint16_t MASK = LEN-1;
+
+  char buf[LEN];
+  volatile uint16_t head = 0;  /* written by the producer (ISR) only */
+  volatile uint16_t tail = 0;  /* written by the consumer (loop) only */
+
+  /* Frame pre-scanning: a frame ends two bytes after an end byte */
+  bool prescan;
+  uint8_t end_countdown_in = 0, end_countdown_out = 0;
+  volatile uint8_t n_frames_in = 0;
+  uint8_t n_frames_out = 0;
+
+  /* 16-bit loads and stores are not atomic on 8-bit AVR, so the consumer
+  keeps the producer out while it loads `head` or stores `tail`. Interrupts
+  are restored rather than enabled, in case the caller had them off. */
+  uint16_t load_head() const {
+    #ifdef __AVR__
+      uint8_t sreg = SREG;
+      cli();
+      uint16_t h = head;
+      SREG = sreg;
+      return h;
+    #else
+      return head;
+    #endif
+  }
+
+  void store_tail(uint16_t t) {
+    #ifdef __AVR__
+      uint8_t sreg = SREG;
+      cli();
+      tail = t;
+      SREG = sreg;
+    #else
+      tail = t;
+    #endif
+  }
+
+  static bool count_frame_end(uint8_t *countdown, char c) {
+    bool frame_end = (*countdown && --*countdown == 0);
+    if (c == OatmealFmt::END_BYTE) { *countdown = 2; }
+    return frame_end;
+  }
+
+ public:
+  /** Number of bytes dropped because the ring was full */
+  volatile size_t n_overflows = 0;
+
+  /** Create a new receive ring.
+  @param _prescan: whether to count complete frames as bytes are pushed. */
+  explicit OatmealRxRing(bool _prescan = true) : prescan(_prescan) {}
+
+  /** Add a received byte. Call from the producer (e.g. an ISR) only.
+  @returns `false` if the byte was dropped because the ring is full. */
+  bool push(char c) {
+    uint16_t h = head, next = (h + 1) & MASK;
+    if (next == tail) { n_overflows++; return false; }
+    buf[h] = c;
+    head = next;
+    if (prescan && count_frame_end(&end_countdown_in, c)) { n_frames_in++; }
+    return true;
+  }
+
+  /** Move all bytes waiting in a serial port into the ring. Call from the
+  producer (e.g. a timer ISR) only.
+  @returns the number of bytes moved */
+  size_t fill_from(Stream *stream) {
+    size_t n = 0;
+    while (stream->available() > 0 && push(stream->read())) { n++; }
+    return n;
+  }
+
+  /** Get the number of bytes waiting to be read. Call from the consumer only. */
+  size_t available() const { return (load_head() - tail) & MASK; }
+
+  /** Whether `OatmealPort::recv()` should read from the ring now: there is a
+  complete frame to read, or pre-scanning is off and there are any bytes. The
+  ring is also read once half full, to make room for more bytes.
+  Call from the consumer only. */
+  bool ready() const {
+    size_t n = available();
+    return prescan ? (n_frames_in != n_frames_out || n >= LEN/2) : n > 0;
+  }
+
+  /** Read up to `n` bytes into `dst`. Call from the consumer only.
+  @returns the number of bytes read */
+  size_t read(char *dst, size_t n) {
+    size_t n_avail = available();
+    if (n > n_avail) { n = n_avail; }
+    uint16_t t = tail;
+    for (size_t i = 0; i < n; i++, t = (t + 1) & MASK) {
+      dst[i] = buf[t];
+      if (prescan && count_frame_end(&end_countdown_out, dst[i])) {
+        n_frames_out++;
+      }
+    }
+    store_tail(t);
+    return n;
+  }
+};
+
+
+class OatmealReplayCache {
+  /** Cache of the responses sent to the most recent requests, so that
+  retransmitted requests can be answered without running their handler again.
+
+  A request is a retransmission if its command, token and checksum bytes match
+  a recent request. Every response frame sent with the same command and token
+  as a cached request is stored (including `D`/`F` responses to jobs that
+  finish later) and sent again if the request is retransmitted. Requests whose
+  responses do not fit in `OATMEAL_REPLAY_BUF_LEN` bytes are handled again.
+  A request that reuses the command and token of a cached request with other
+  arguments replaces it, so at most one request is cached per command and
+  token.
+
+  Attach to a port with `OatmealPort::set_replay_cache()`. Retransmissions are
+  only recognized by `OatmealPort::check_for_msgs()`. The host must resend
+  requests with the same token for them to be recognized.
+  */
+
+ public:
+  /** Number of requests held */
+  static const uint8_t N_ENTRIES = OATMEAL_REPLAY_CACHE_LEN;
+  /** Max bytes of responses stored per request */
+  static const uint8_t BUF_LEN = OATMEAL_REPLAY_BUF_LEN;
+
+ private:
+  static const size_t KEY_LEN = OatmealMsg::CMD_LEN + OatmealMsg::TOKEN_LEN;
+
+  struct Entry {
+    /* command, token then checksum bytes of the request */
+    char key[KEY_LEN + OatmealMsg::CHECKSUM_LEN];
+    char buf[BUF_LEN];
+    uint8_t len;
+    bool used;
+    bool overflowed;
+  };
+
+  Entry entries[N_ENTRIES] = {};
+  uint8_t next_entry = 0;
+  Entry *recording = nullptr;
+
+  static void make_key(char *key, const OatmealMsgReadonly &msg) {
+    memcpy(key, msg.opcode(), OatmealMsg::CMD_LEN);
+    memcpy(key + OatmealMsg::CMD_LEN, msg.token(), OatmealMsg::TOKEN_LEN);
+    memcpy(key + KEY_LEN, msg.frame() + msg.length() - OatmealMsg::CHECKSUM_LEN,
+           OatmealMsg::CHECKSUM_LEN);
+  }
+
+ public:
+  /** Look up a request. Call with each request received.
+  @param msg: request received
+  @param buf: set to the stored responses if `msg` is a retransmission
+  @param n: set to the number of bytes in `*buf`
+  @returns `true` if `msg` is a retransmission with responses to replay,
+           otherwise records `msg` as a new request and returns `false`. */
+  bool lookup(const OatmealMsgReadonly &msg, const char **buf, size_t *n) {
+    char key[sizeof(entries[0].key)];
+    make_key(key, msg);
+    /* Responses are matched to requests by command and token only */
+    Entry *e = nullptr;
+    for (uint8_t i = 0; i < N_ENTRIES && e == nullptr; i++) {
+      if (entries[i].used && memcmp(entries[i].key, key, KEY_LEN) == 0) {
+        e = &entries[i];
+      }
+    }
+    if (e != nullptr && e->len > 0 && !e->overflowed &&
+        memcmp(e->key + KEY_LEN, key + KEY_LEN,
+               OatmealMsg::CHECKSUM_LEN) == 0) {
+      *buf = e->buf;
+      *n = e->len;
+      return true;
+    }
+    if (e == nullptr) {
+      /* New request: replace the oldest entry */
+      e = &entries[next_entry];
+      next_entry = (next_entry + 1) % N_ENTRIES;
+    }
+    /* Nothing to replay yet, or the token was reused with other args, so the
+    request will be handled (again) */
+    if (recording == e) { recording = nullptr; }
+    memcpy(e->key, key, sizeof(key));
+    e->len = 0;
+    e->used = true;
+    e->overflowed = false;
+    return false;
+  }
+
+  /** Start recording a response frame, if it responds to a cached request.
+  @param cmd: command of the response (3 chars)
+  @param token: token of the response (2 chars) */
+  void record_start(const char *cmd, const char *token) {
+    recording = nullptr;
+    for (uint8_t i = 0; i < N_ENTRIES; i++) {
+      Entry &e = entries[i];
+      if (e.used &&
+          memcmp(e.key, cmd, OatmealMsg::CMD_LEN) == 0 &&
+          memcmp(e.key + OatmealMsg::CMD_LEN, token,
+                 OatmealMsg::TOKEN_LEN) == 0) {
+        recording = &e;
+        return;
+      }
+    }
+  }
+
+  /** Record bytes of the response frame being sent, if any. */
+  void record(const char *b, size_t n) {
+    if (recording == nullptr) { return; }
+    if (n > (size_t)(BUF_LEN - recording->len)) {
+      recording->overflowed = true;
+      recording = nullptr;
+      return;
+    }
+    memcpy(recording->buf + recording->len, b, n);
+    recording->len += n;
+  }
+
+  /** Finish recording the response frame being sent. */
+  void record_end() {
+    record("\n", 1);
+    recording = nullptr;
+  }
+
+  /** Record a complete response frame being sent. */
+  void record_frame(const char *frame, size_t n) {
+    record_start(frame + 1, frame + 1 + OatmealMsg::OPCODE_LEN);
+    record(frame, n);
+    record_end();
+  }
+};
+
+
+class OatmealVarRegistry {
+  /** Table of named variables that the host can get and set remotely.
+
+  Register variables in `setup()` and attach the registry to a port with
+  `OatmealPort::set_var_registry()`. The port then handles these requests:
+
+  - `VGTR` with any number of variable names, e.g. `"x","y"`, responds with
+    their values as a dict `{x=1,y=2}`.
+  - `VSTR` with a dict of names and values, e.g. `{x=1,y=2}`, sets them all.
+    Nothing is set if any name is unknown, read-only or has a bad value.
+  - `VDMR` responds with the values of all variables as a dict.
+  - `VWTR` with a min interval (ms), a deadband and variable names, e.g.
+    `100,0.5,"x","y"`, watches the variables for changes. Changes are sent
+    as `VARB` background messages with a dict of the values that changed by
+    more than the deadband, at most once per interval per variable, by
+    `OatmealPort::send_var_updates()` (called by `check_for_msgs()`). If
+    there is no room for all the new watches, none are set and the response
+    names the first variable that did not fit.
+  - `VUWR` with variable names stops watching them, or all if none are given.
+
+  Variables are kept sorted by name and looked up with a binary search.
+  Names must be valid dict keys and are not copied, so must remain valid.
+
+  Example:
+
+      OatmealVarRegistry vars;
+      int32_t speed = 100;
+      float gain = 0.5;
+
+      void setup() {
+        vars.add("speed", &speed);
+        vars.add("gain", &gain);
+        port.set_var_registry(&vars);
+      }
+  */
+
+ public:
+  /** Max number of variables registered */
+  static const uint8_t MAX_VARS = OATMEAL_MAX_VARS;
+  /** Max length of a variable name */
+  static const uint8_t MAX_NAME_LEN = OATMEAL_VAR_NAME_LEN;
+  /** Max number of variables watched for changes */
+  static const uint8_t MAX_WATCHES = OATMEAL_MAX_WATCHES;
+
+  enum Type : uint8_t {Bool, SChar, UChar, Short, UShort, Int, UInt,
+                       Long, ULong, Float, Double};
+
+  struct Var {
+    const char *name;
+    void *ptr;
+    Type type;
+    bool read_only;
+  };
+
+ private:
+  Var vars[MAX_VARS];
+  uint8_t n_vars = 0;
+
+  struct Watch {
+    uint8_t var_idx;
+    uint16_t min_interval_ms;
+    float deadband;
+    uint32_t last_sent_ms;
+    bool sent;  /* whether `shadow` holds the value last sent */
+    uint8_t shadow[sizeof(double)];  /* unaligned: read with as_double() */
+  };
+
+  Watch watches[MAX_WATCHES];
+  uint8_t n_watches = 0;
+
+  bool _add(const char *name, void *ptr, Type type, bool read_only);
+
+  static size_t type_size(Type type);
+  static double as_double(Type type, const void *ptr);
+
+ public:
+  /** Register a variable.
+  @param name: name of the variable, at most `MAX_NAME_LEN` chars
+  @param ptr: variable to read and write
+  @param read_only: if `true`, the host cannot set this variable
+  @returns `false` if the registry is full or the name is already taken */
+  bool add(const char *name, bool *ptr, bool read_only = false) {
+    return _add(name, ptr, Bool, read_only);
+  }
+  /** @see add(const char*, bool*, bool) */
+  bool add(const char *name, signed char *ptr, bool read_only = false) {
+    return _add(name, ptr, SChar, read_only);
+  }
+  /** @see add(const char*, bool*, bool) */
+  bool add(const char *name, unsigned char *ptr, bool read_only = false) {
+    return _add(name, ptr, UChar, read_only);
+  }
+  /** @see add(const char*, bool*, bool) */
+  bool add(const char *name, short *ptr, bool read_only = false) {
+    return _add(name, ptr, Short, read_only);
+  }
+  /** @see add(const char*, bool*, bool) */
+  bool add(const char *name, unsigned short *ptr, bool read_only = false) {
+    return _add(name, ptr, UShort, read_only);
+  }
+  /** @see add(const char*, bool*, bool) */
+  bool add(const char *name, int *ptr, bool read_only = false) {
+    return _add(name, ptr, Int, read_only);
+  }
+  /** @see add(const char*, bool*, bool) */
+  bool add(const char *name, unsigned int *ptr, bool read_only = false) {
+    return _add(name, ptr, UInt, read_only);
+  }
+  /** @see add(const char*, bool*, bool) */
+  bool add(const char *name, long *ptr, bool read_only = false) {
+    return _add(name, ptr, Long, read_only);
+  }
+  /** @see add(const char*, bool*, bool) */
+  bool add(const char *name, unsigned long *ptr, bool read_only = false) {
+    return _add(name, ptr, ULong, read_only);
+  }
+  /** @see add(const char*, bool*, bool) */
+  bool add(const char *name, float *ptr, bool read_only = false) {
+    return _add(name, ptr, Float, read_only);
+  }
+  /** @see add(const char*, bool*, bool) */
+  bool add(const char *name, double *ptr, bool read_only = false) {
+    return _add(name, ptr, Double, read_only);
+  }
+
+  /** Get the number of variables registered */
+  uint8_t size() const { return n_vars; }
+
+  /** Get the `i`th variable, in order of name */
+  const Var& get(uint8_t i) const { return vars[i]; }
+
+  /** Find a variable by name.
+  @returns the variable or `nullptr` if there is no variable called `name` */
+  const Var* find(const char *name) const;
+
+  /** Watch a variable for changes, or update the settings of a watch.
+  @param name: name of the variable to watch
+  @param deadband: only report changes larger than this. If 0, any change.
+  @param min_interval_ms: min time between reports of this variable
+  @returns `false` if there is no such variable or too many are watched */
+  bool watch(const char *name, float deadband, uint16_t min_interval_ms);
+
+  /** Whether a variable is being watched for changes */
+  bool is_watched(const Var *var) const;
+
+  /** Stop watching a variable.
+  @returns `false` if the variable was not being watched */
+  bool unwatch(const char *name);
+
+  /** Stop watching all variables */
+  void unwatch_all() { n_watches = 0; }
+
+  /** Get the number of variables being watched */
+  uint8_t get_n_watches() const { return n_watches; }
+
+  /** Whether the watch with index `w` is due to be reported: its variable has
+  changed by more than the deadband and the min interval has passed. */
+  bool is_due(uint8_t w, uint32_t now_ms) const;
+
+  /** Get the variable watched by the watch with index `w` */
+  const Var& watched(uint8_t w) const { return vars[watches[w].var_idx]; }
+
+  /** Record that the watch with index `w` has been reported */
+  void mark_sent(uint8_t w, uint32_t now_ms);
+
+  /** Write the value of a variable as an Oatmeal argument.
+  @returns the number of chars written, or 0 if `dlen` is too small */
+  static size_t format(char *dst, size_t dlen, const Var &var);
+
+  /** Parse the next argument as the value of a variable.
+  @param set: if `true`, store the value parsed in the variable.
+  @returns `true` if a value of the right type was parsed */
+  static bool parse(OatmealArgParser *parser, const Var &var, bool set);
+};
+
+
+/** Status of a long-running job, returned by its `OatmealJobPollFn`. */
+enum OatmealJobStatus : uint8_t {OatmealJobRunning, OatmealJobDone,
+                                 OatmealJobFailed};
+
+/** Function polled from the main loop to advance a long-running job.
+@param ctx: pointer passed to `OatmealPort::start_job()`
+@returns whether the job is still running, done or has failed */
+typedef OatmealJobStatus (*OatmealJobPollFn)(void *ctx);
+
+/** Event passed to an `OatmealStreamFn`. */
+enum OatmealStreamEvent : uint8_t {
+  OatmealStreamArgs,    /* more arguments received; checksum not yet checked */
+  OatmealStreamCommit,  /* last arguments received and the frame is valid */
+  OatmealStreamAbort    /* frame was corrupt or cut short: undo its arguments */
+};
+
+/** Function called with the arguments of a streamed frame as they arrive.
+@param event: what has happened, see `OatmealStreamEvent`
+@param head: the frame's opcode and token (no arguments)
+@param args: parser over the complete arguments received since the last call,
+             or `nullptr` for `OatmealStreamAbort`
+@param ctx: pointer passed to `OatmealPort::set_stream_handler()` */
+typedef void (*OatmealStreamFn)(OatmealStreamEvent event,
+                                const OatmealMsgReadonly &head,
+                                OatmealArgParser *args, void *ctx);
+
+
 class OatmealPort {
  private:
   enum State : uint8_t {WaitingOnStart, WaitingOnEnd,
@@ -86,6 +790,21 @@ class OatmealPort {
 
   HardwareSerial *port;
 
+  /* If set, received bytes are read from this ring instead of `port` */
+  OatmealRxRing *rx_ring = nullptr;
+
+  /* If set, retransmitted requests are answered from this cache */
+  OatmealReplayCache *replay_cache = nullptr;
+
+  /* If set, the host can get and set these variables */
+  OatmealVarRegistry *var_registry = nullptr;
+
+  /* If set, frames with this opcode are passed to `stream_fn` as they
+  arrive, see set_stream_handler() */
+  const char *stream_opcode = nullptr;
+  OatmealStreamFn stream_fn = nullptr;
+  void *stream_ctx = nullptr;
+
   OatmealPort::State state = WaitingOnStart;
 
   /*
@@ -100,10 +819,11 @@ class OatmealPort {
   buffer along with some some noises byte beforehand.
   */
   char buf[OatmealMsg::MAX_MSG_LEN + 8];
-  size_t b_start = 0, b_mid, b_end = 0;
+  size_t b_start = 0, b_mid = 0, b_end = 0;
 
   /* Variables used in the discovery request */
   const char *role_str = nullptr;
+  bool role_in_flash = false;
   const char *hardware_id = nullptr;
   const char *version_str = nullptr;
   uint32_t instance_idx = 0;
@@ -133,11 +853,68 @@ class OatmealPort {
 
   void send_discovery_ack(const char *token);
 
+  void send_time_sync_ack(const OatmealMsgReadonly &msg);
+
+  void send_burst(const char *token, uint32_t n_frames, uint32_t frame_len);
+
+  /* check_for_msgs() within a budget, without updating the budget stats.
+  Sets `*out_of_budget` if the budget ran out with data left to process. */
+  bool _check_for_msgs(size_t max_msgs, uint32_t max_us, bool *out_of_budget);
+
+  /* Polls ports with _check_for_msgs() */
+  friend class OatmealPortGroup;
+
+  /* Replay responses if `msg` is a retransmitted request */
+  bool replay_request(const OatmealMsgReadonly &msg);
+
+  /* Handle VGTR, VSTR and VDMR requests */
+  bool handle_var_msg(const OatmealMsgReadonly &msg);
+
+  /* Respond with the values of the variables named by `names`, or all
+  variables if `names` is `nullptr` */
+  void send_var_dicts(const OatmealMsgReadonly &req, OatmealArgParser *names);
+
+  /* ---------- Long-running jobs ---------- */
+
+  struct Job {
+    char cmd[OatmealMsg::CMD_LEN];
+    char token[OatmealMsg::TOKEN_LEN];
+    OatmealJobPollFn poll;
+    void *ctx;
+    bool active;
+  };
+
+  Job jobs[OATMEAL_MAX_JOBS] = {};
+  uint8_t n_jobs_active = 0;
+
+  void finish_job(Job *job, bool success);
+
+  /* ---------- Streaming input ---------- */
+
+  /* Whether the frame being received is streamed to `stream_fn` */
+  bool stream_on = false;
+  /* Position within the arguments, to find top-level separators */
+  bool stream_in_str = false, stream_esc = false;
+  uint8_t stream_depth = 0;
+  /* Offset from `b_start` of the last top-level separator, or 0 */
+  size_t stream_sep = 0;
+  /* Bytes of the frame already passed to `stream_fn` and dropped, and the
+  checksum of the frame up to the last of them */
+  size_t stream_skip = 0;
+  uint8_t stream_checksum = 0;
+
+  void _stream_scan(char c);
+  void _stream_deliver();
+  void _stream_end(const char *frame, size_t n);
+  void _stream_abort();
+
   /* ---------- Streaming output ---------- */
 
   size_t curr_msg_len = 0;
   uint8_t curr_msg_checksum = 0;
   char last_chr = '\0';
+  /* the frame being sent was refused by a checked start() */
+  bool tx_refused = false;
 
  public:
   /** Default baud rate (symbols-per-second) for the underlying serial port. */
@@ -154,6 +931,9 @@ class OatmealPort {
   */
   OatmealMsgReadonly msg_in;
 
+  /** Time from `micros()` at which `msg_in` was read in by this port. */
+  uint32_t msg_in_us = 0;
+
   /** Create a new OatmealPort.
 
   Any strings passed to the OatmealPort constructor MUST be stored by the
@@ -186,6 +966,22 @@ class OatmealPort {
     set_discovery_ptrs(_role_str, _instance_idx, _hardware_id, _version_str);
   }
 
+  /** Create a new OatmealPort with a role string stored in flash, e.g.
+  `OatmealPort(&Serial1, F("NAMEHERE"))`, to save RAM.
+  @see OatmealPort(HardwareSerial*, const char*, uint32_t, const char*,
+                   const char*) */
+  OatmealPort(HardwareSerial *h_port,
+              const __FlashStringHelper *_role_str,
+              uint32_t _instance_idx = OATMEAL_INSTANCE_IDX,
+              const char *_hardware_id = nullptr,
+              const char *_version_str = nullptr) :
+      port(h_port), msg_in(buf, 0) {
+    strcpy(token_str, "aa");
+    set_discovery_ptrs(reinterpret_cast<const char*>(_role_str), _instance_idx,
+                       _hardware_id, _version_str);
+    role_in_flash = true;
+  }
+
   /** Set up the port */
   void init(int32_t baud_rate = DEFAULT_BAUD_RATE) {
     port->begin(baud_rate);
@@ -215,6 +1011,7 @@ class OatmealPort {
                           const char *_hardware_id = nullptr,
                           const char *_version_str = nullptr) {
     role_str = _role_str;
+    role_in_flash = false;
     instance_idx = _instance_idx;
     hardware_id = _hardware_id;
     version_str = _version_str;
@@ -222,8 +1019,10 @@ class OatmealPort {
 
   /** Send bytes directly over the underlying port serial port with a newline */
   void send(const char *buf, size_t n) {
+    OATMEAL_TX_LOCK();
     port->write((const uint8_t*)buf, n);
     port->write('\n');
+    if (replay_cache) { replay_cache->record_frame(buf, n); }
 
     /*
     Uncommenting the flush() call here - which just blocks until the data
@@ -235,6 +1034,7 @@ class OatmealPort {
     // port->flush();
 
     stats.n_frames_written++;
+    OATMEAL_TX_UNLOCK();
   }
 
   /** Send a message over the port */
@@ -242,7 +1042,8 @@ class OatmealPort {
 
   /** Construct and send a message over the port */
   void send(const char *cmd, char flag, const char *token = nullptr) {
-    if (token == nullptr) { token = next_token(); }
+    char tok[OatmealMsg::TOKEN_LEN+1];
+    if (token == nullptr) { token = next_token(tok); }
     start(cmd, flag, token);
     finish();
   }
@@ -261,9 +1062,16 @@ class OatmealPort {
   void send_failed(const OatmealMsgReadonly &msg) { send_response(msg, 'F'); }
 
   /** Increment the OatmealPort token and return a pointer to it.
+  Not threadsafe: the token is overwritten by the next call.
   @returns A pointer to the next token to use. */
   const char* next_token();
 
+  /** Increment the OatmealPort token and copy it into `dst`. Safe to call
+  from several tasks if `OATMEAL_TX_LOCK()` is defined.
+  @param dst: buffer of at least `OatmealMsg::TOKEN_LEN+1` chars
+  @returns `dst` */
+  char* next_token(char *dst);
+
   /** Read a message from the port into internal memory `msg_in`.
   Corrupted messages are dropped. Partial messages are left in the input buffer.
   Non-blocking.
@@ -292,22 +1100,29 @@ class OatmealPort {
 
   /** Attempt to parse a built-in message.
 
-  Built-in messages include a discovery request or toggling logging/heartbeats.
+  Built-in messages include a discovery request, toggling logging/heartbeats,
+  a time sync request, the echo and burst link self-tests and, if a variable
+  registry is set, getting and setting variables.
   If successful sends an ACK packet back.
 
   @returns `true` if parsed and ack'd successfully, `false` otherwise. */
   bool handle_msg(const OatmealMsgReadonly &msg);
 
-  /** Read messages and reply to any built-in commands (DISR, HRTR, LOGR)
+  /** Read messages and reply to any built-in commands (DISR, HRTR, LOGR, TIMR,
+  ECHR, BSTR and VGTR, VSTR, VDMR)
   @returns `true` if a message was read into `msg_in` for the user */
   bool check_for_msgs() {
+    if (n_jobs_active) { poll_jobs(); }
+    if (var_registry && var_registry->get_n_watches()) { send_var_updates(); }
     while (recv()) {
+      if (replay_cache && replay_request(msg_in)) { continue; }
       if (!handle_msg(msg_in)) { return true; }
     }
     return false;
   }
 
-  /** Read messages and reply to any built-in commands (DISR, HRTR, LOGR)
+  /** Read messages and reply to any built-in commands (DISR, HRTR, LOGR, TIMR,
+  ECHR, BSTR and VGTR, VSTR, VDMR)
   Copies the read-only message into parameter `msg`.
   @returns `true` if a message was read into `msg_in` for the user */
   bool check_for_msgs(OatmealMsgReadonly *msg) {
@@ -315,13 +1130,124 @@ class OatmealPort {
     return false;
   }
 
-  /** Read messages and reply to any built-in commands (DISR, HRTR, LOGR)
+  /** Read messages and reply to any built-in commands (DISR, HRTR, LOGR, TIMR,
+  ECHR, BSTR and VGTR, VSTR, VDMR)
   @returns `true` if a message was read into `msg` for the user. */
   bool check_for_msgs(OatmealMsg *msg) {
     if (check_for_msgs()) { msg->copy_from(msg_in); return true; }
     return false;
   }
 
+  /** Read messages and reply to any built-in commands, like `check_for_msgs()`,
+  but within a budget so that a flood of commands cannot starve the rest of
+  `loop()`. Stops after `max_msgs` messages have been read or `max_us`
+  microseconds have passed, whichever comes first. Use `msgs_pending()` to
+  find out whether work was left for the next call.
+
+  @param max_msgs: max number of messages to read, 0 for no limit
+  @param max_us: max time to spend in microseconds, 0 for no limit
+  @returns `true` if a message was read into `msg_in` for the user */
+  bool check_for_msgs(size_t max_msgs, uint32_t max_us);
+
+  /** Whether there is received data that has not been parsed yet, either in
+  this port's buffer or waiting in the serial port. With a ring attached, only
+  counts the bytes in the ring once it is `ready()` to be read.
+  @returns `true` if `check_for_msgs()` has more data to process */
+  bool msgs_pending() {
+    return b_mid < b_end ||
+           (rx_ring ? rx_ring->ready() : port->available() > 0);
+  }
+
+  /** Receive bytes from a ring buffer filled by an interrupt handler, rather
+  than by polling the serial port.
+  @param ring: ring to read from, or `nullptr` to read from the serial port.
+  @see OatmealRxRing */
+  void set_rx_ring(OatmealRxRing *ring) { rx_ring = ring; }
+
+  /** Answer retransmitted requests by replaying the responses sent the first
+  time, rather than handling them again.
+  @param cache: cache of recent responses, or `nullptr` to turn replay off.
+  @see OatmealReplayCache */
+  void set_replay_cache(OatmealReplayCache *cache) { replay_cache = cache; }
+
+  /** Pass the arguments of frames with a given opcode to a handler as they
+  arrive, rather than waiting for the whole frame. Each call gets the
+  complete top-level arguments received since the last, which are then
+  dropped from the receive buffer, so streamed frames may be longer than
+  `OatmealMsg::MAX_MSG_LEN` as long as each argument fits. Work can start on
+  arguments as they land, but the checksum is only checked at the end: keep
+  changes tentative until `OatmealStreamCommit`, and undo them on
+  `OatmealStreamAbort`. Streamed frames are not returned by `recv()`.
+  @param opcode: opcode (command+flag) to stream, e.g. `"CFGR"`
+  @param fn: handler, or `nullptr` to turn streaming off
+  @param ctx: passed to `fn` */
+  void set_stream_handler(const char *opcode, OatmealStreamFn fn,
+                          void *ctx = nullptr) {
+    stream_opcode = opcode;
+    stream_fn = fn;
+    stream_ctx = ctx;
+  }
+
+  /** Let the host get and set the variables in a registry, with the `VGTR`,
+  `VSTR` and `VDMR` built-in commands.
+  @param registry: variables to expose, or `nullptr` for none.
+  @see OatmealVarRegistry */
+  void set_var_registry(OatmealVarRegistry *registry) {
+    var_registry = registry;
+  }
+
+  /** Send `VARB` messages with the values of watched variables that have
+  changed. Called by `check_for_msgs()`.
+  @param now_ms: current time in milliseconds. If 0, uses `millis()`.
+  @returns the number of messages sent
+  @see OatmealVarRegistry::watch() */
+  size_t send_var_updates(uint32_t now_ms = 0);
+
+  /* ---------- Long-running jobs ---------- */
+
+  /** Start a long-running job in response to a request, so that its handler
+  can return straight away rather than blocking all other messages.
+
+  Sends an ack (`A`) for `msg` and polls the job from `poll_jobs()` (called by
+  `check_for_msgs()`) until `poll` reports it is done or has failed, when a
+  done (`D`) or failed (`F`) response is sent with the request's token. If
+  `OATMEAL_MAX_JOBS` jobs are already running, sends a failed response with
+  the reason `"busy"` instead.
+
+  Example:
+
+      OatmealJobStatus poll_move(void *ctx) {
+        return motor.at_target() ? OatmealJobDone : OatmealJobRunning;
+      }
+
+      if (msg.is_opcode("MOVR") && parser.parse_arg(&pos)) {
+        motor.move_to(pos);
+        port.start_job(msg, poll_move, nullptr);
+      }
+
+  @param msg: request that started the job
+  @param poll: function to poll the job with, or `nullptr` if the job is only
+               finished with `complete_job()`.
+  @param ctx: passed to `poll`
+  @returns `true` if the job was started, `false` if the job table is full */
+  bool start_job(const OatmealMsgReadonly &msg, OatmealJobPollFn poll,
+                 void *ctx);
+
+  /** Finish a job started with `start_job()`, sending a done or failed
+  response. Use for jobs that complete on an event rather than being polled.
+  @param cmd: command (3 chars) of the request that started the job
+  @param token: token (2 chars) of the request that started the job
+  @param success: send a done response if `true`, failed otherwise
+  @returns `false` if no such job is running */
+  bool complete_job(const char *cmd, const char *token, bool success);
+
+  /** Poll all running jobs, sending responses for any that have finished.
+  Called by `check_for_msgs()`. */
+  void poll_jobs();
+
+  /** Get the number of jobs currently running */
+  uint8_t get_n_jobs_active() const { return n_jobs_active; }
+
   /* ---------- Logging ---------- */
 
   /** Turn logging on/off.
@@ -341,27 +1267,76 @@ class OatmealPort {
   @see log_info(const char*)
   @see log_warning(const char*)
   @see log_error(const char*) */
-  void log(const char *level, const char *msg_text) {
-    if (send_logging) {
-      start("LOG", 'B', next_token());
-      append(level);
-      append(msg_text);
-      finish();
-    }
+  void log(const char *level, const char *msg_text) { _log(level, msg_text); }
+
+  /** Send a log message with the message text stored in flash, e.g.
+  `log("INFO", F("Started"))`.
+  @see log(const char*, const char*) */
+  void log(const char *level, const __FlashStringHelper *msg_text) {
+    _log(level, msg_text);
+  }
+
+  /** Send a log message with the level stored in flash, e.g.
+  `log(F("INFO"), buf)`.
+  @see log(const char*, const char*) */
+  void log(const __FlashStringHelper *level, const char *msg_text) {
+    _log(level, msg_text);
+  }
+
+  /** Send a log message with the level and message text stored in flash,
+  e.g. `log(F("INFO"), F("Started"))`.
+  @see log(const char*, const char*) */
+  void log(const __FlashStringHelper *level,
+           const __FlashStringHelper *msg_text) {
+    _log(level, msg_text);
   }
 
   /** Send a log message with level `DEBUG` and message `txt`
   @see `log(const char*, const char*) `*/
-  void log_debug(const char *txt) { log("DEBUG", txt); }
+  void log_debug(const char *txt) { _log(F("DEBUG"), txt); }
   /** Send a log message with level `INFO` and message `txt`
   @see `log(const char*, const char*) `*/
-  void log_info(const char *txt) { log("INFO", txt); }
+  void log_info(const char *txt) { _log(F("INFO"), txt); }
   /** Send a log message with level `WARNING` and message `txt`
   @see `log(const char*, const char*) `*/
-  void log_warning(const char *txt) { log("WARNING", txt); }
+  void log_warning(const char *txt) { _log(F("WARNING"), txt); }
   /** Send a log message with level `ERROR` and message `txt`
   @see `log(const char*, const char*) `*/
-  void log_error(const char *txt) { log("ERROR", txt); }
+  void log_error(const char *txt) { _log(F("ERROR"), txt); }
+
+  /** Send a log message with level `DEBUG` and message `txt` stored in flash
+  @see `log(const char*, const char*) `*/
+  void log_debug(const __FlashStringHelper *txt) { _log(F("DEBUG"), txt); }
+  /** Send a log message with level `INFO` and message `txt` stored in flash
+  @see `log(const char*, const char*) `*/
+  void log_info(const __FlashStringHelper *txt) { _log(F("INFO"), txt); }
+  /** Send a log message with level `WARNING` and message `txt` stored in
+  flash
+  @see `log(const char*, const char*) `*/
+  void log_warning(const __FlashStringHelper *txt) { _log(F("WARNING"), txt); }
+  /** Send a log message with level `ERROR` and message `txt` stored in flash
+  @see `log(const char*, const char*) `*/
+  void log_error(const __FlashStringHelper *txt) { _log(F("ERROR"), txt); }
+
+ private:
+  template<typename L, typename S>
+  void _log(L level, S msg_text) {
+    if (send_logging) {
+      char tok[OatmealMsg::TOKEN_LEN+1];
+      next_token(tok);
+      OatmealSizer size;
+      size.start("LOG", 'B', tok);
+      size.append(level);
+      size.append(msg_text);
+      size.finish();
+      start("LOG", 'B', tok, size.length());
+      append(level);
+      append(msg_text);
+      finish();
+    }
+  }
+
+ public:
 
   /* ---------- Heartbeats ---------- */
 
@@ -374,7 +1349,22 @@ class OatmealPort {
     heartbeats_period_ms = period_ms;
   }
 
-  /** Construct a heartbeat message with general statistics in it. */
+  /** Add general statistics to a heartbeat message, as key=value pairs of a
+  dictionary started with `append_dict_start()`.
+
+  Heartbeat args are a single dict (see protocol.md). This used to append bare
+  `key=value` args, which hosts cannot parse: callers must now wrap the call,
+  and any keys of their own, in `append_dict_start()`/`append_dict_end()`.
+
+  Example:
+
+      hb_msg.start("HRT", 'B', port.next_token());
+      hb_msg.append_dict_start();
+      port.build_status_heartbeat(&hb_msg, max_loop_ms);
+      hb_msg.append_dict_key_value("T", temperature);
+      hb_msg.append_dict_end();
+      hb_msg.finish();
+  */
   void build_status_heartbeat(OatmealMsg *resp, uint32_t max_loop_ms);
 
   /** Whether or not to send a heartbeat message.
@@ -396,15 +1386,32 @@ class OatmealPort {
     return false;
   }
 
+  /* ---------- Sample batches ---------- */
+
+  /** Send any buffers of samples that are ready as `SMPB` messages.
+
+  Each message has args `<t0_us:int>,<n_values:int>,[<dt_us>,<v_0>,...]`
+  where `t0_us` is the timestamp of the first sample and the list holds, for
+  each sample, the time since the previous sample followed by its values.
+  Buffers that do not fit in a single frame are split over several messages.
+
+  @param batch: samples to send
+  @param now_us: current time in microseconds, used to check the deadline. If
+                 0, uses `micros()`.
+  @returns the number of messages sent */
+  size_t send_samples(OatmealSampleBatch *batch, uint32_t now_us = 0);
+
   /* ---------- Streaming output messages ---------- */
 
   /** Write out a single raw character
   @returns the number of bytes written (1)
   @see OatmealMsg::write(const char) */
   size_t write(const char c) {
+    if (tx_refused) { return 0; }
     curr_msg_checksum = (curr_msg_checksum + c) * OATMEAL_CHECKSUM_COEFF;
     curr_msg_len++;
     last_chr = c;
+    if (replay_cache) { replay_cache->record(&c, 1); }
     return port->write(c);
   }
 
@@ -415,19 +1422,46 @@ class OatmealPort {
     return write(b, strlen(b));
   }
 
+  /** Write a null terminated string stored in flash, a byte at a time.
+  @returns the number of bytes written. */
+  size_t write(const __FlashStringHelper *b) {
+    size_t n = 0;
+    char c;
+    for (size_t i = 0; (c = OatmealFmt::flash_char(b, i)); i++) {
+      n += write(c);
+    }
+    return n;
+  }
+
   /** Write out `n` bytes pointed to by `ptr`.
   @returns the number of bytes written
   @see OatmealMsg::write(const char*, size_t) */
   size_t write(const char *b, size_t n) {
-    if (!n) { return 0; }
+    if (!n || tx_refused) { return 0; }
     for (size_t i = 0; i < n; i++) {
       curr_msg_checksum = (curr_msg_checksum + b[i]) * OATMEAL_CHECKSUM_COEFF;
     }
     curr_msg_len += n;
     last_chr = b[n-1];
+    if (replay_cache) { replay_cache->record(b, n); }
     return port->write(b, n);
   }
 
+  /** Write out a string literal escaped at compile time by `OATMEAL_STR()`.
+  The running checksum is updated in one step from the checksum of the
+  literal, rather than a byte at a time.
+  @returns the number of bytes written
+  @see OatmealMsg::write(const OatmealStrLiteral<N>&) */
+  template<size_t N>
+  size_t write(const OatmealStrLiteral<N> &str) {
+    if (tx_refused) { return 0; }
+    curr_msg_checksum = curr_msg_checksum * str.checksum_coeff + str.checksum;
+    curr_msg_len += N;
+    last_chr = str.str[N-1];
+    if (replay_cache) { replay_cache->record(str.str, N); }
+    return port->write(str.str, N);
+  }
+
   /** Encode and write a byte to this frame as part of a str/data message argument.
   @returns the number of bytes written (1)
   @see OatmealMsg::write_encoded(const char c) */
@@ -510,13 +1544,36 @@ class OatmealPort {
   @returns Number of frame bytes written out
   @see OatmealMsg::start(const char*, char, const char*) */
   size_t start(const char *cmd, char flag, const char *token) {
+    OATMEAL_TX_LOCK();
     curr_msg_len = curr_msg_checksum = 0;
+    if (replay_cache) { replay_cache->record_start(cmd, token); }
     return write(OatmealFmt::START_BYTE) +
            write(cmd, OatmealMsg::CMD_LEN) +
            write(flag) +
            write(token, OatmealMsg::TOKEN_LEN);
   }
 
+  /** Construct a message only if it will fit in a receiver's buffer.
+
+  Streamed frames can't be cut short once started, so a frame longer than
+  `OatmealMsg::MAX_MSG_LEN` is otherwise sent in full then dropped by the
+  receiver. Measure the frame first with an `OatmealSizer`. If it is too long
+  nothing is sent: the following calls up to and including `finish()` do
+  nothing and return 0, and `stats.n_frames_refused` is incremented.
+
+  @param frame_len: exact length of the frame e.g. `OatmealSizer::length()`
+  @returns Number of frame bytes written out, 0 if the frame was refused */
+  size_t start(const char *cmd, char flag, const char *token,
+               size_t frame_len) {
+    if (frame_len <= OatmealMsg::MAX_MSG_LEN) {
+      return start(cmd, flag, token);
+    }
+    OATMEAL_TX_LOCK();  /* released by finish() */
+    stats.n_frames_refused++;
+    tx_refused = true;
+    return 0;
+  }
+
   /* Argument construction */
 
   /** Append an arg separator onto the message.
@@ -551,6 +1608,28 @@ class OatmealPort {
     return n;
   }
 
+  /** Append a null terminated string argument stored in flash, e.g. `F("hi")`.
+  @returns Number of frame bytes written out
+  @see OatmealMsg::append(const __FlashStringHelper*) */
+  size_t append(const __FlashStringHelper *str) {
+    size_t n = separator_if_needed() + write('"');
+    char c;
+    for (size_t i = 0; (c = OatmealFmt::flash_char(str, i)); i++) {
+      n += write_encoded(c);
+    }
+    n += write('"');
+    return n;
+  }
+
+  /** Append a string argument escaped at compile time, e.g.
+  `append(OATMEAL_STR("busy"))`.
+  @returns Number of frame bytes written out
+  @see OatmealMsg::append(const OatmealStrLiteral<N>&) */
+  template<size_t N>
+  size_t append(const OatmealStrLiteral<N> &str) {
+    return separator_if_needed() + write(str);
+  }
+
   /** Append a data bytes argument to the message.
   @returns Number of frame bytes written out
   @see OatmealMsg::append(const uint8_t*, size_t) */
@@ -623,6 +1702,13 @@ class OatmealPort {
     return write(key) + write(OatmealFmt::DICT_KV_SEP);
   }
 
+  /** Append a dictionary key stored in flash and equals sign.
+  @returns The number of bytes written out
+  @see OatmealMsg::append_dict_key(const __FlashStringHelper*) */
+  size_t append_dict_key(const __FlashStringHelper *key) {
+    return write(key) + write(OatmealFmt::DICT_KV_SEP);
+  }
+
   /** Append a key=value pair to a dictionary for a float value.
   @returns The number of bytes written out
   @see OatmealMsg::append_dict_key_value(const char*, float, int) */
@@ -649,6 +1735,34 @@ class OatmealPort {
     return separator_if_needed() + append_dict_key(key) + append(val);
   }
 
+  /** Append a key=value pair to a dictionary with a key stored in flash, e.g.
+  `append_dict_key_value(F("loop_ms"), 12)`.
+  @returns The number of bytes written out
+  @see OatmealMsg::append_dict_key_value(const __FlashStringHelper*, T) */
+  template<typename T>
+  size_t append_dict_key_value(const __FlashStringHelper *key, T val) {
+    return separator_if_needed() + append_dict_key(key) + append(val);
+  }
+
+  /** Append a key=value pair to a dictionary for a string value escaped at
+  compile time by `OATMEAL_STR()`.
+  @returns The number of bytes written out
+  @see OatmealMsg::append_dict_key_value(const char*, const OatmealStrLiteral<N>&) */
+  template<size_t N>
+  size_t append_dict_key_value(const char *key,
+                               const OatmealStrLiteral<N> &val) {
+    return separator_if_needed() + append_dict_key(key) + write(val);
+  }
+
+  /** Append a key=value pair to a dictionary with a key stored in flash for a
+  string value escaped at compile time by `OATMEAL_STR()`.
+  @returns The number of bytes written out */
+  template<size_t N>
+  size_t append_dict_key_value(const __FlashStringHelper *key,
+                               const OatmealStrLiteral<N> &val) {
+    return separator_if_needed() + append_dict_key(key) + write(val);
+  }
+
   /** Append a key=value pair to a dictionary for a bytes value.
   @param key: null termintated string to use as the key
   @param data: bytes to use as the value
@@ -673,6 +1787,11 @@ class OatmealPort {
   @returns the number of bytes written (3).
   @see OatmealMsg::finish() */
   size_t finish() {
+    if (tx_refused) {
+      tx_refused = false;
+      OATMEAL_TX_UNLOCK();
+      return 0;
+    }
     // +3 for the last three bytes: '>', checklen, checksum
     uint16_t checklen_byte = (curr_msg_len+3) * OATMEAL_CHECKLEN_COEFF;
     // _stream_write updates curr_msg_len and curr_msg_checksum
@@ -680,8 +1799,91 @@ class OatmealPort {
     write(OatmealMsg::checkbyte_uint16_to_ascii(checklen_byte));
     write(OatmealMsg::checkbyte_uint16_to_ascii(curr_msg_checksum));
     port->write('\n');
+    if (replay_cache) { replay_cache->record_end(); }
+    if (curr_msg_len > OatmealMsg::MAX_MSG_LEN) { stats.n_frames_oversized++; }
+    OATMEAL_TX_UNLOCK();
     return 3; /* Don't include the newline (not part of the frame) */
   }
 };
 
+
+/** Serves several `OatmealPort`s (e.g. USB `Serial` to a host and `Serial1` to
+another controller) from a single dispatch loop. Ports are polled in turn,
+handling at most one message from each per turn, so a busy link cannot
+starve the others, and each call polls every port at most once, so `loop()`
+gets control back however busy the links are. Each message the user handles
+is answered on the port it came from, so one set of handlers serves every
+link.
+
+Example:
+
+    OatmealPort usb(&Serial, "Valve"), link(&Serial1, "Valve");
+    OatmealPortGroup ports;
+    ports.add(&usb);
+    ports.add(&link);
+
+    void loop() {
+      if (ports.check_for_msgs()) {
+        const OatmealMsgReadonly &msg = ports.msg();
+        if (msg.is_opcode("RUNR")) {
+          ports.port()->send_response(msg, 'A');
+        }
+      }
+    }
+
+Each port keeps its own receive buffer and state (stats, heartbeats, jobs),
+since frames arrive on every link at once, but the user's handlers and any
+response buffer they use are shared. */
+class OatmealPortGroup {
+ private:
+  OatmealPort *ports[OATMEAL_MAX_PORTS];
+  uint8_t n_ports = 0, next_port = 0;
+  OatmealPort *curr_port = nullptr;
+
+ public:
+  static const uint8_t MAX_PORTS = OATMEAL_MAX_PORTS;
+
+  /** Add a port to be served.
+  @returns `false` if `MAX_PORTS` ports have already been added */
+  bool add(OatmealPort *port) {
+    if (n_ports >= MAX_PORTS) { return false; }
+    ports[n_ports++] = port;
+    return true;
+  }
+
+  /** Get the number of ports in the group */
+  uint8_t size() const { return n_ports; }
+
+  /** Get the port with index `i` (in the order they were added) */
+  OatmealPort* get(uint8_t i) const { return ports[i]; }
+
+  /** Poll each port once, in turn, reading at most one message from each and
+  replying to any built-in commands. Stops at the first message for the user;
+  the next call carries on from the following port. Call from every `loop()`.
+  @returns `true` if a message was read for the user, in which case `port()`
+  is the port it came from and `msg()` is the message */
+  bool check_for_msgs();
+
+  /** Read messages from all ports, like `check_for_msgs()`, and copy the
+  message for the user into `msg`.
+  @returns `true` if a message was read into `msg` for the user */
+  bool check_for_msgs(OatmealMsg *msg) {
+    if (check_for_msgs()) { msg->copy_from(curr_port->msg_in); return true; }
+    return false;
+  }
+
+  /** Get the port the last message for the user came from, to respond on.
+  @returns `nullptr` if no message has been read yet */
+  OatmealPort* port() const { return curr_port; }
+
+  /** Get the last message for the user. Only valid after `check_for_msgs()`
+  has returned `true`, until it is next called. */
+  const OatmealMsgReadonly& msg() const { return curr_port->msg_in; }
+
+  /** Send a log message on every port with logging enabled */
+  void log(const char *level, const char *msg_text) {
+    for (uint8_t i = 0; i < n_ports; i++) { ports[i]->log(level, msg_text); }
+  }
+};
+
 #endif /* OATMEAL_PROTOCOL_H_ */
@@ -691,6 +691,22 @@ bool test_parse_fails_and_recovers() {
   return pass;
 }
 
+bool test_parse_zero_and_negative_decimals() {
+  OatmealArgParser parser;
+  float fval = 1;
+  double dval = 1;
+  bool pass = true;
+
+  pass &= _set_up_test_case(&parser, __func__, "0,-1.5,0.0,-2") &&
+          parser.parse_arg(&fval) && fval == 0 &&
+          parser.parse_arg(&fval) && fval == -1.5 &&
+          parser.parse_arg(&dval) && dval == 0 &&
+          parser.parse_arg(&dval) && dval == -2 &&
+          parser.finished();
+
+  return pass;
+}
+
 
 bool compare_msgs(const char *exp_msg, const char *act_msg) {
   if (strcmp(exp_msg, act_msg) != 0) {
@@ -835,6 +851,146 @@ bool test_write_hex() {
   return true;
 }
 
+bool test_flash_strings() {
+  printf("Running %s()...\n", __func__);
+
+  OatmealMsg ram, flash;
+
+  ram.start("TST", 'R', "ab");
+  ram.append("hi\"x");
+  ram.append_dict_start();
+  ram.append_dict_key_value("k", 5);
+  ram.append_dict_end();
+  ram.finish();
+
+  flash.start("TST", 'R', "ab");
+  flash.append(F("hi\"x"));
+  flash.append_dict_start();
+  flash.append_dict_key_value(F("k"), 5);
+  flash.append_dict_end();
+  flash.finish();
+
+  if (!compare_msgs(ram.frame(), flash.frame())) { return false; }
+  if (!flash.is_opcode(F("TSTR")) || flash.is_opcode(F("TSTA"))) {
+    return false;
+  }
+  return flash.is_command(F("TST")) && !flash.is_command(F("TSX"));
+}
+
+bool test_str_literals() {
+  printf("Running %s()...\n", __func__);
+
+  OatmealMsg rt, ct;
+  const char src[] = "a\\b\"c<d>e\nf\rg";
+
+  rt.start("TST", 'R', "ab");
+  rt.append(src);
+  rt.append("");
+  rt.append_dict_start();
+  rt.append_dict_key_value("k", "busy");
+  rt.append_dict_end();
+  rt.finish();
+
+  ct.start("TST", 'R', "ab");
+  ct.append(OATMEAL_STR("a\\b\"c<d>e\nf\rg"));
+  ct.append(OATMEAL_STR(""));
+  ct.append_dict_start();
+  ct.append_dict_key_value("k", OATMEAL_STR("busy"));
+  ct.append_dict_end();
+  ct.finish();
+
+  if (!compare_msgs(rt.frame(), ct.frame())) { return false; }
+
+  /* Checksum of the literal continues a running checksum */
+  const char *quoted = "\"a\\\\b\\\"c\\(d\\)e\\nf\\rg\"";
+  uint8_t checksum = 7, expected = 7;
+  for (const char *c = quoted; *c; c++) {
+    expected = OatmealFmt::checksum_add(expected, *c);
+  }
+  const auto &lit = OATMEAL_STR("a\\b\"c<d>e\nf\rg");
+  if (strcmp(lit.str, quoted) != 0 || lit.length() != strlen(quoted)) {
+    fprintf(stderr, "Bad literal: '%s' vs '%s'\n", lit.str, quoted);
+    return false;
+  }
+  checksum = checksum * lit.checksum_coeff + lit.checksum;
+  if (checksum != expected) {
+    fprintf(stderr, "Bad literal checksum: %i vs %i\n", checksum, expected);
+    return false;
+  }
+
+  /* Literals that don't fit are not appended */
+  ct.start("TST", 'R', "ab");
+  while (ct.append(OATMEAL_STR("0123456789"))) {}
+  ct.finish();
+  return OatmealMsg::validate_frame(ct.frame(), ct.length());
+}
+
+bool test_sizer() {
+  printf("Running %s()...\n", __func__);
+
+  OatmealMsg msg;
+  OatmealSizer size;
+  const uint8_t data[] = {0, '<', 'a', '>', '\\'};
+  bool pass = true;
+
+  /* Each call must return the number of bytes OatmealMsg adds */
+  #define CHECK_SIZE(call) do { \
+      size_t n_exp = msg.call, n_act = size.call; \
+      if (n_exp != n_act) { \
+        fprintf(stderr, "Bad size %s: %zu vs %zu\n", #call, n_exp, n_act); \
+        pass = false; \
+      } \
+    } while (0)
+
+  msg.start("TST", 'R', "ab");
+  size.start("TST", 'R', "ab");
+  CHECK_SIZE(append("a\"b<c>\n"));
+  CHECK_SIZE(append(F("flash\r")));
+  CHECK_SIZE(append(data, sizeof(data)));
+  CHECK_SIZE(append(OATMEAL_STR("lit\\")));
+  CHECK_SIZE(append(-1234567));
+  CHECK_SIZE(append(static_cast<uint64_t>(ULLONG_MAX)));
+  CHECK_SIZE(append(3.14159265, 3));
+  CHECK_SIZE(append(-1.5e-20f));
+  CHECK_SIZE(append(true));
+  CHECK_SIZE(append_none());
+  CHECK_SIZE(append_list_start());
+  CHECK_SIZE(append(1));
+  CHECK_SIZE(append_list_start());
+  CHECK_SIZE(append_list_end());
+  CHECK_SIZE(append("x"));
+  CHECK_SIZE(append_list_end());
+  msg.finish();
+  size.finish();
+  if (!pass || size.length() != msg.length()) {
+    fprintf(stderr, "Bad frame size: %zu vs %zu\n", msg.length(), size.length());
+    return false;
+  }
+
+  msg.start("TST", 'R', "ab");
+  size.start("TST", 'R', "ab");
+  CHECK_SIZE(append_dict_start());
+  CHECK_SIZE(append_dict_key_value("a", 12));
+  CHECK_SIZE(append_dict_key_value(F("bb"), "s"));
+  CHECK_SIZE(append_dict_key_value("c", 2.5, 2));
+  CHECK_SIZE(append_dict_key_value("d", data, 2));
+  CHECK_SIZE(append_dict_end());
+  #undef CHECK_SIZE
+  msg.finish();
+  size.finish();
+
+  if (!pass || size.length() != msg.length() || !size.fits()) {
+    fprintf(stderr, "Bad frame size: %zu vs %zu\n", msg.length(), size.length());
+    return false;
+  }
+
+  /* Frames too long to be received */
+  size.start("TST", 'R', "ab");
+  while (size.length() <= OatmealMsg::MAX_MSG_LEN) { size.append(123456); }
+  size.finish();
+  return !size.fits() && OatmealSizer::arg_len("a\"") == 5;
+}
+
 int main() {
   OatmealMsg msg;
   msg.start("TST", 'R', "ab");
@@ -851,9 +1007,13 @@ int main() {
   if (!test_parsing_none()) { return EXIT_FAILURE; }
   if (!test_parsing_fails()) { return EXIT_FAILURE; }
   if (!test_parse_fails_and_recovers()) { return EXIT_FAILURE; }
+  if (!test_parse_zero_and_negative_decimals()) { return EXIT_FAILURE; }
   if (!test_parse_dicts()) { return EXIT_FAILURE; }
   if (!test_write_hex()) { return EXIT_FAILURE; }
   if (!test_checksum()) { return EXIT_FAILURE; }
+  if (!test_flash_strings()) { return EXIT_FAILURE; }
+  if (!test_str_literals()) { return EXIT_FAILURE; }
+  if (!test_sizer()) { return EXIT_FAILURE; }
   printf("\n  Success!\n\n");
   return EXIT_SUCCESS;
 }
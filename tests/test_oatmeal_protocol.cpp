@@ -0,0 +1,827 @@
+/*
+  test_oatmeal_protocol.cpp
+  Copyright 2019, Shield Diagnostics and the Oatmeal Protocol contributors
+  License: Apache 2.0
+
+  Tests of OatmealPort, built on the host against the Arduino shim used by the
+  benchmarks (bench/shim/Arduino.h). Requests are written by a host-side
+  OatmealPort into memory and fed to the port under test, and everything the
+  port under test sends is captured so the responses can be checked.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <Arduino.h>
+#include "oatmeal_protocol.h"
+
+HardwareSerial Serial, Serial1;
+int *__brkval = nullptr;  /* top of the heap, provided by avr-libc on AVR */
+
+/* Test clock: micros() advances by `test_tick_us` each call */
+static unsigned long test_time_us = 0, test_tick_us = 0;
+unsigned long millis() { return test_time_us / 1000; }
+unsigned long micros() { return test_time_us += test_tick_us; }
+void set_time(unsigned long now_us) { test_time_us = now_us; }
+
+/* Host end of the link: frames sent by `host` are captured in `host_tx` */
+static HardwareSerial host_serial;
+static OatmealPort host(&host_serial, "Host");
+static char host_tx[2048];
+static size_t n_delivered = 0;
+
+/* Frames sent by the port under test */
+static char dev_tx[8192];
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%i  Check failed: %s\n", __FILE__, __LINE__, #cond); \
+    return false; \
+  } \
+} while (0)
+
+/* Clear both ends of the link to the port under test on `dev` */
+static void reset_link(HardwareSerial *dev) {
+  memset(host_tx, 0, sizeof(host_tx));
+  memset(dev_tx, 0, sizeof(dev_tx));
+  host_serial.capture(host_tx, sizeof(host_tx)-1);
+  dev->capture(dev_tx, sizeof(dev_tx)-1);
+  dev->feed(nullptr, 0);
+  n_delivered = 0;
+}
+
+/* Send a frame from the host with raw (already formatted) args */
+static void host_send(const char *cmd, char flag, const char *token,
+                      const char *args) {
+  host.start(cmd, flag, token);
+  host.write(args);
+  host.finish();
+}
+
+/* Make the frames sent by the host since the last call readable on `dev` */
+static void deliver(HardwareSerial *dev) {
+  dev->feed(host_tx + n_delivered, host_serial.n_tx - n_delivered);
+  n_delivered = host_serial.n_tx;
+}
+
+/* Count the times `str` appears in `tx` */
+static size_t count(const char *tx, const char *str) {
+  size_t n = 0;
+  for (const char *p = tx; (p = strstr(p, str)) != nullptr; p++) { n++; }
+  return n;
+}
+
+/* Count the valid frames in `tx` that start with `head` and are `len` bytes */
+static size_t count_frames(const char *tx, const char *head, size_t len) {
+  size_t n = 0;
+  for (const char *p = tx; (p = strstr(p, head)) != nullptr; p++) {
+    const char *end = strchr(p, '\n');
+    n += (end != nullptr && (size_t)(end - p) == len &&
+          OatmealMsg::validate_frame(p, len));
+  }
+  return n;
+}
+
+/* Find the next valid frame in `*tx` that starts with `head` and move `*tx`
+past it */
+static bool next_frame(const char **tx, const char *head,
+                       OatmealMsgReadonly *msg) {
+  const char *p = strstr(*tx, head), *end;
+  if (p == nullptr || (end = strchr(p, '\n')) == nullptr) { return false; }
+  *tx = end;
+  *msg = OatmealMsgReadonly(p, end - p);
+  return OatmealMsg::validate_frame(p, end - p);
+}
+
+bool test_samples() {
+  /* Sample batches are sent once full or once the oldest sample is too old,
+  split across as many frames as needed */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  OatmealSampleBatch batch(2);
+  reset_link(&Serial);
+  batch.set_deadline_us(5000);
+  int32_t vals[3][2] = {{8, -800}, {9, -900}, {10, -1000}};
+  batch.add(9000, vals[0]);
+  batch.add(10000, vals[1]);
+  batch.add(10500, vals[2]);
+  CHECK(port.send_samples(&batch, 13999) == 0 && dev_tx[0] == '\0');
+  /* The frame decoded by the Python tests (test_sample_batch) */
+  port.next_token();
+  port.next_token();
+  CHECK(port.send_samples(&batch, 14000) == 1);
+  CHECK(strcmp(dev_tx, "<SMPB039000,2,[0,8,-800,1000,9,-900,500,10,-1000]>{}\n") == 0);
+  CHECK(port.send_samples(&batch, 100000) == 0);
+
+  /* Full buffers are sent without waiting for the deadline */
+  reset_link(&Serial);
+  batch.set_deadline_us(0);
+  int32_t big[2] = {-2000000000, 2000000000};
+  const uint8_t n = OatmealSampleBatch::BUF_LEN;
+  for (uint8_t i = 0; i < n; i++) { CHECK(batch.add(1000000 + 10*i, big)); }
+  size_t n_msgs = port.send_samples(&batch, 1000000);
+  CHECK(n_msgs > 1 && count(dev_tx, "<SMPB") == n_msgs);
+
+  /* Each frame starts from the timestamp of its first sample */
+  const char *tx = dev_tx;
+  OatmealMsgReadonly msg(dev_tx, 0);
+  uint32_t t_us = 1000000, t0_us, dt_us;
+  uint8_t n_values, n_read = 0;
+  int32_t v0, v1;
+  for (size_t m = 0; m < n_msgs; m++) {
+    OatmealArgParser parser;
+    CHECK(next_frame(&tx, "<SMPB", &msg) && parser.init(msg));
+    CHECK(parser.parse_arg(&t0_us) && t0_us == t_us);
+    CHECK(parser.parse_arg(&n_values) && n_values == 2);
+    CHECK(parser.parse_list_start());
+    for (bool first = true; !parser.parse_list_end(); first = false) {
+      CHECK(parser.parse_arg(&dt_us) && dt_us == (first ? 0u : 10u));
+      CHECK(parser.parse_arg(&v0) && parser.parse_arg(&v1));
+      CHECK(v0 == big[0] && v1 == big[1]);
+      t_us += 10;
+      n_read++;
+    }
+    CHECK(parser.finished());
+  }
+  CHECK(n_read == n && batch.n_dropped == 0);
+
+  /* Samples are dropped once both buffers are full */
+  for (uint8_t i = 0; i < 2*n; i++) { CHECK(batch.add(i, big)); }
+  CHECK(!batch.add(2*n, big) && batch.n_dropped == 1);
+  CHECK(port.send_samples(&batch, 0) == n_msgs);
+  CHECK(port.send_samples(&batch, 0) == n_msgs);
+  CHECK(port.send_samples(&batch, 0) == 0);
+  return true;
+}
+
+bool test_time_sync() {
+  /* Time sync requests are answered with when the request was read and when
+  the response was sent */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  reset_link(&Serial);
+  set_time(1200340);
+  host_send("TIM", 'R', "aa", "");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<TIMAaa1200340,1200340>") == 1);
+
+  /* The request is timestamped as it is read, before it is handled */
+  reset_link(&Serial);
+  host_send("TIM", 'R', "ab", "");
+  deliver(&Serial);
+  test_tick_us = 10;
+  CHECK(!port.check_for_msgs());
+  test_tick_us = 0;
+  const char *tx = dev_tx;
+  OatmealMsgReadonly msg(dev_tx, 0);
+  OatmealArgParser parser;
+  uint32_t rx_us, tx_us;
+  CHECK(next_frame(&tx, "<TIMAab", &msg) && parser.init(msg));
+  CHECK(parser.parse_arg(&rx_us) && parser.parse_arg(&tx_us) && parser.finished());
+  CHECK(rx_us > 1200340 && tx_us > rx_us && tx_us <= test_time_us);
+  return true;
+}
+
+bool test_echo() {
+  /* Echo requests are answered with their args, verbatim */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  reset_link(&Serial);
+  host_send("ECH", 'R', "aa", "1,\"hi\",[2.5],{a=F}");
+  host_send("ECH", 'R', "ab", "");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs());
+  CHECK(count(dev_tx, "<ECHAaa1,\"hi\",[2.5],{a=F}>") == 1);
+  CHECK(count(dev_tx, "<ECHAab>") == 1);
+  CHECK(count_frames(dev_tx, "<ECHA", 28) == 1);
+
+  /* The frame decoded by the Python tests (test_self_test_frames) */
+  host_send("ECH", 'R', "ab", "1,\"hi\\(\\)\",[2.5]");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs());
+  CHECK(count(dev_tx, "\n<ECHAab1,\"hi\\(\\)\",[2.5]>}\"\n") == 1);
+  return true;
+}
+
+bool test_burst() {
+  /* Burst requests are acked, then answered with frames of the length asked
+  for, then the time taken */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  reset_link(&Serial);
+  host_send("BST", 'R', "aa", "12,40");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs());
+  CHECK(count(dev_tx, "<BSTAaa12,40>") == 1);
+  CHECK(count(dev_tx, "<BSTBaa") == 12 && count_frames(dev_tx, "<BSTBaa", 40) == 12);
+  CHECK(count(dev_tx, "<BSTBaa0,\"") == 1 && count(dev_tx, "<BSTBaa11,\"") == 1);
+  CHECK(count(dev_tx, "<BSTDaa12,") == 1);
+
+  /* Frame lengths are limited to what a frame can hold... */
+  host_send("BST", 'R', "ab", "12,1");
+  host_send("BST", 'R', "ac", "1,1000");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs());
+  CHECK(count(dev_tx, "<BSTAab12,15>") == 1);
+  CHECK(count(dev_tx, "<BSTBab") == 12 && count_frames(dev_tx, "<BSTBab", 15) == 12);
+  char ack[32];
+  snprintf(ack, sizeof(ack), "<BSTAac1,%u>", (unsigned)OatmealMsg::MAX_MSG_LEN);
+  CHECK(count(dev_tx, ack) == 1);
+  CHECK(count_frames(dev_tx, "<BSTBac", OatmealMsg::MAX_MSG_LEN) == 1);
+
+  /* ...and the number of frames so that loop() is not held up for long */
+  reset_link(&Serial);
+  host_send("BST", 'R', "ad", "4000000000,0");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs());
+  snprintf(ack, sizeof(ack), "<BSTAad%u,16>", OATMEAL_MAX_BURST_FRAMES);
+  CHECK(count(dev_tx, ack) == 1);
+  CHECK(count_frames(dev_tx, "<BSTBad", 16) == OATMEAL_MAX_BURST_FRAMES);
+
+  /* The frames decoded by the Python tests (test_self_test_frames) */
+  reset_link(&Serial);
+  host_send("BST", 'R', "cd", "3,30");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs());
+  CHECK(count(dev_tx, "\n<BSTBcd0,\"xxxxxxxxxxxxxxxx\">;n\n") == 1);
+  CHECK(count(dev_tx, "\n<BSTDcd3,0>~(\n") == 1);
+
+  /* Bad args are not handled */
+  host_send("BST", 'R', "ae", "1");
+  deliver(&Serial);
+  CHECK(port.check_for_msgs() && port.msg_in.is_opcode("BSTR"));
+  return true;
+}
+
+bool test_budget() {
+  /* Budgeted check_for_msgs() stops after max_msgs and counts budget hits */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  reset_link(&Serial);
+  for (int i = 0; i < 3; i++) { host_send("ECH", 'R', "aa", "1"); }
+  deliver(&Serial);
+
+  CHECK(!port.check_for_msgs(2, 0));
+  CHECK(count(dev_tx, "<ECHAaa1>") == 2 && port.msgs_pending());
+  CHECK(port.stats.n_budget_calls == 1 && port.stats.n_budget_hits == 1);
+  CHECK(!port.check_for_msgs(2, 0));
+  CHECK(count(dev_tx, "<ECHAaa1>") == 3 && !port.msgs_pending());
+  CHECK(port.stats.n_budget_calls == 2 && port.stats.n_budget_hits == 1);
+
+  /* Messages for the user are returned within the budget */
+  host_send("RUN", 'R', "ab", "");
+  deliver(&Serial);
+  CHECK(port.check_for_msgs(1, 0) && port.msg_in.is_opcode("RUNR"));
+  CHECK(port.stats.n_budget_hits == 1);
+
+  /* Hits are reported in heartbeats, then reset */
+  OatmealMsg resp;
+  resp.start("HRT", 'B', "aa");
+  resp.append_dict_start();
+  port.build_status_heartbeat(&resp, 5);
+  resp.append_dict_end();
+  resp.finish();
+  CHECK(strstr(resp.frame(), "budget_hits=1") != nullptr);
+  CHECK(port.stats.n_budget_calls == 0 && port.stats.n_budget_hits == 0);
+  return true;
+}
+
+/* Push the frames sent by the host since the last call into `ring` */
+static void deliver(OatmealRxRing *ring, size_t n_max = SIZE_MAX) {
+  for (; n_delivered < host_serial.n_tx && n_max; n_delivered++, n_max--) {
+    ring->push(host_tx[n_delivered]);
+  }
+}
+
+bool test_rx_ring() {
+  /* With pre-scanning, the ring is only read once a whole frame is in it */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  OatmealRxRing ring;
+  port.set_rx_ring(&ring);
+  reset_link(&Serial);
+  host_send("RUN", 'R', "ab", "1,2,3");
+  size_t frame_len = host_serial.n_tx;
+
+  deliver(&ring, frame_len / 2);
+  CHECK(ring.available() == frame_len / 2 && !ring.ready());
+  CHECK(!port.msgs_pending());
+  CHECK(!port.check_for_msgs() && port.stats.n_bytes_read == 0);
+
+  deliver(&ring);
+  CHECK(ring.ready() && port.msgs_pending());
+  CHECK(port.check_for_msgs() && port.msg_in.is_opcode("RUNR"));
+  CHECK(!ring.ready() && !port.check_for_msgs() && !port.msgs_pending());
+
+  /* Two frames and the start of a third: both whole frames are read */
+  host_send("RUN", 'R', "ac", "");
+  host_send("RUN", 'R', "ad", "");
+  host_send("RUN", 'R', "ae", "");
+  deliver(&ring, host_serial.n_tx - n_delivered - 4);
+  CHECK(port.check_for_msgs() && memcmp(port.msg_in.token(), "ac", 2) == 0);
+  CHECK(port.check_for_msgs() && memcmp(port.msg_in.token(), "ad", 2) == 0);
+  CHECK(!port.check_for_msgs() && !port.msgs_pending());
+  deliver(&ring);
+  CHECK(port.check_for_msgs() && memcmp(port.msg_in.token(), "ae", 2) == 0);
+
+  /* A ring half full is read even without a whole frame, to make room */
+  for (size_t i = 0; i < OatmealRxRing::LEN/2; i++) { ring.push('x'); }
+  CHECK(ring.ready() && port.msgs_pending());
+  CHECK(!port.check_for_msgs() && ring.available() == 0);
+
+  /* Without pre-scanning, any bytes are read */
+  OatmealRxRing raw_ring(false);
+  port.set_rx_ring(&raw_ring);
+  raw_ring.push('<');
+  CHECK(raw_ring.ready() && port.msgs_pending());
+  return true;
+}
+
+/* Poll a job whose status is set by the test */
+static OatmealJobStatus poll_status(void *ctx) {
+  return *static_cast<OatmealJobStatus*>(ctx);
+}
+
+bool test_jobs() {
+  /* Jobs are acked at once, then answered when done, failed or completed */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  OatmealJobStatus status = OatmealJobRunning;
+  reset_link(&Serial);
+  host_send("RUN", 'R', "ab", "");
+  host_send("RUN", 'R', "ac", "");
+  deliver(&Serial);
+
+  CHECK(port.check_for_msgs());
+  CHECK(port.start_job(port.msg_in, poll_status, &status));
+  CHECK(port.check_for_msgs());
+  CHECK(port.start_job(port.msg_in, nullptr, nullptr));
+  CHECK(count(dev_tx, "<RUNAab>") == 1 && count(dev_tx, "<RUNAac>") == 1);
+  CHECK(port.get_n_jobs_active() == 2);
+
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<RUNDab>") == 0);
+  status = OatmealJobDone;
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<RUNDab>") == 1);
+  CHECK(!port.complete_job("RUN", "ab", true));
+  CHECK(port.complete_job("RUN", "ac", false));
+  CHECK(count(dev_tx, "<RUNFac>") == 1 && port.get_n_jobs_active() == 0);
+
+  /* Requests beyond the job table are failed as busy */
+  for (int i = 0; i <= OATMEAL_MAX_JOBS; i++) { host_send("RUN", 'R', "ba", ""); }
+  deliver(&Serial);
+  for (int i = 0; i <= OATMEAL_MAX_JOBS; i++) {
+    CHECK(port.check_for_msgs());
+    CHECK(port.start_job(port.msg_in, nullptr, nullptr) == (i < OATMEAL_MAX_JOBS));
+  }
+  CHECK(count(dev_tx, "<RUNFba\"busy\">") == 1);
+  CHECK(port.stats.n_jobs_started == 2 + OATMEAL_MAX_JOBS &&
+        port.stats.n_jobs_done == 1 && port.stats.n_jobs_failed == 1 &&
+        port.stats.n_jobs_rejected == 1 &&
+        port.stats.max_jobs_active == OATMEAL_MAX_JOBS);
+  return true;
+}
+
+bool test_replay() {
+  /* Retransmitted requests are answered from the cache, not handled again */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  OatmealReplayCache cache;
+  port.set_replay_cache(&cache);
+  reset_link(&Serial);
+  host_send("ADD", 'R', "ab", "1,2");
+  deliver(&Serial);
+  CHECK(port.check_for_msgs() && port.msg_in.is_opcode("ADDR"));
+  port.start("ADD", 'A', "ab");
+  port.append(3);
+  port.finish();
+
+  host_send("ADD", 'R', "ab", "1,2");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs());
+  CHECK(count(dev_tx, "<ADDAab3>") == 2 && port.stats.n_requests_replayed == 1);
+
+  /* The same token reused with other args is a new request */
+  host_send("ADD", 'R', "ab", "2,2");
+  deliver(&Serial);
+  CHECK(port.check_for_msgs() && port.msg_in.is_opcode("ADDR"));
+  port.start("ADD", 'A', "ab");
+  port.append(4);
+  port.finish();
+  host_send("ADD", 'R', "ab", "2,2");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs());
+  CHECK(count(dev_tx, "<ADDAab4>") == 2 && count(dev_tx, "<ADDAab3>") == 2);
+  CHECK(port.stats.n_requests_replayed == 2);
+
+  /* ...and replaces the request it reused the token of */
+  host_send("ADD", 'R', "ab", "1,2");
+  deliver(&Serial);
+  CHECK(port.check_for_msgs() && port.msg_in.is_opcode("ADDR"));
+  CHECK(count(dev_tx, "<ADDAab3>") == 2 && count(dev_tx, "<ADDAab4>") == 2);
+
+  /* Built-in requests are replayed too, and responses only once recorded */
+  host_send("ECH", 'R', "ac", "\"hi\"");
+  host_send("ECH", 'R', "ac", "\"hi\"");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs());
+  CHECK(count(dev_tx, "<ECHAac\"hi\">") == 2);
+  CHECK(port.stats.n_requests_replayed == 3);
+  return true;
+}
+
+bool test_vars() {
+  /* Variables are got, set and dumped by name, in as many frames as needed */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  OatmealVarRegistry vars;
+  float gain = 0.5;
+  bool on = true;
+  int32_t ro = 7, x = 5, v[10];
+  char v_names[10][4];
+  CHECK(vars.add("x", &x) && vars.add("gain", &gain) && vars.add("on", &on));
+  CHECK(vars.add("ro", &ro, true) && !vars.add("x", &ro));
+  for (int i = 0; i < 10; i++) {
+    v[i] = -1000000000 - i;
+    snprintf(v_names[i], sizeof(v_names[i]), "v%02i", i);
+    CHECK(vars.add(v_names[i], &v[i]));
+  }
+  port.set_var_registry(&vars);
+  reset_link(&Serial);
+
+  /* The frames decoded by the Python tests (test_var_dicts) */
+  host_send("VGT", 'R', "aa", "\"x\",\"gain\"");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VGTAaa{x=5,gain=0.5},F>}%\n") == 1);
+  host_send("VST", 'R', "ac", "{on=F,x=9}");
+  CHECK(strstr(host_tx, "<VSTRac{on=F,x=9}>S%\n") != nullptr);
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VSTAac>") == 1);
+  CHECK(!on && x == 9);
+  gain = 2.5;
+  x = 5;
+  host_send("VDM", 'R', "af", "");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs());
+  CHECK(count(dev_tx, "<VDMAaf{gain=2.5,on=F,ro=7,v00=-1000000000,"
+                      "v01=-1000000001,v02=-1000000002,v03=-1000000003,"
+                      "v04=-1000000004},T>S|\n") == 1);
+
+  /* Every variable is dumped once, in order, the last frame ending with F */
+  const char *tx = dev_tx;
+  OatmealMsgReadonly msg(dev_tx, 0);
+  char name[OatmealVarRegistry::MAX_NAME_LEN+1];
+  uint8_t n_read = 0;
+  bool more = true;
+  while (more) {
+    OatmealArgParser parser;
+    CHECK(next_frame(&tx, "<VDMAaf", &msg) && parser.init(msg));
+    CHECK(parser.parse_dict_start());
+    while (!parser.parse_dict_end()) {
+      CHECK(parser.parse_dict_key(name, sizeof(name)));
+      CHECK(n_read < vars.size() && strcmp(name, vars.get(n_read++).name) == 0);
+      CHECK(OatmealVarRegistry::parse(&parser, *vars.find(name), false));
+    }
+    CHECK(parser.parse_arg(&more) && parser.finished());
+  }
+  CHECK(n_read == vars.size() && count(dev_tx, "<VDMAaf") == 2);
+
+  /* Gets are split the same way */
+  host_send("VGT", 'R', "ag", "\"v09\",\"v08\",\"v07\",\"v06\",\"v05\","
+                              "\"v04\",\"v03\",\"v02\"");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs());
+  CHECK(count(dev_tx, "<VGTAag{v09=-1000000009,") == 1);
+  CHECK(count(dev_tx, "<VGTAag{") == 2 && count(dev_tx, "},T>") == 2);
+  CHECK(count(dev_tx, "<VGTAag{v02=-1000000002},F>") == 1);
+
+  /* Unknown names, read-only variables and bad values fail the request, and
+  nothing is set */
+  host_send("VGT", 'R', "ah", "\"x\",\"y\"");
+  host_send("VST", 'R', "ai", "{x=1,ro=1}");
+  host_send("VST", 'R', "aj", "{x=1,on=3.5}");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs());
+  CHECK(count(dev_tx, "<VGTFah\"y\">") == 1 && count(dev_tx, "<VSTFai\"ro\">") == 1);
+  CHECK(count(dev_tx, "<VSTFaj\"on\">") == 1 && x == 5 && ro == 7 && !on);
+  return true;
+}
+
+bool test_var_watches() {
+  /* Watch requests only need room for variables not already watched */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  OatmealVarRegistry vars;
+  int32_t a = 1, b = 2, c = 3, d = 4, e = 5;
+  vars.add("a", &a);
+  vars.add("b", &b);
+  vars.add("c", &c);
+  vars.add("d", &d);
+  vars.add("e", &e);
+  port.set_var_registry(&vars);
+  reset_link(&Serial);
+  static_assert(OatmealVarRegistry::MAX_WATCHES == 4, "test assumes 4 watches");
+
+  host_send("VWT", 'R', "aa", "0,0,\"a\",\"b\",\"a\"");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VWTAaa>") == 1);
+  CHECK(vars.get_n_watches() == 2);
+
+  host_send("VWT", 'R', "ab", "0,0,\"a\",\"b\",\"c\",\"d\"");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VWTAab>") == 1);
+  CHECK(vars.get_n_watches() == 4);
+
+  /* A full table fails with the first name that did not fit */
+  host_send("VWT", 'R', "ac", "100,0,\"a\",\"e\",\"b\"");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VWTFac\"e\">") == 1);
+  CHECK(vars.get_n_watches() == 4 && !vars.is_watched(vars.find("e")));
+
+  host_send("VWT", 'R', "ad", "0,0,\"a\",\"x\"");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VWTFad\"x\">") == 1);
+  return true;
+}
+
+bool test_var_updates() {
+  /* Watched variables are sent when they change by more than the deadband, at
+  most once per interval */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  OatmealVarRegistry vars;
+  double x = 1.5;
+  int32_t n = 1;
+  vars.add("x", &x);
+  vars.add("n", &n);
+  port.set_var_registry(&vars);
+  reset_link(&Serial);
+  set_time(0);
+
+  host_send("VWT", 'R', "aa", "100,0.5,\"x\"");
+  host_send("VWT", 'R', "ab", "0,0,\"n\"");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VWTA") == 2);
+  /* The current values are sent first */
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VARB") == 1);
+  CHECK(count(dev_tx, "{x=1.5,n=1}") == 1);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VARB") == 1);
+
+  /* Changes before the min interval are held back */
+  x = 2.5;
+  n = 2;
+  set_time(50000);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "{n=2}") == 1);
+  set_time(150000);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "{x=2.5}") == 1);
+
+  /* Changes within the deadband are not sent, any change without one is */
+  x = 2.75;
+  n = 3;
+  set_time(300000);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "{n=3}") == 1);
+  x = 1.75;
+  CHECK(!port.check_for_msgs() && count(dev_tx, "{x=1.75}") == 1);
+  CHECK(count(dev_tx, "<VARB") == 5);
+  return true;
+}
+
+bool test_var_update_frames() {
+  /* The frames decoded by the Python tests (test_var_watches) */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  OatmealVarRegistry vars;
+  int32_t x = 5;
+  bool on = true;
+  float g = 1.6;
+  vars.add("x", &x);
+  vars.add("on", &on);
+  vars.add("g", &g);
+  port.set_var_registry(&vars);
+  reset_link(&Serial);
+  set_time(0);
+
+  host.start("VWT", 'R', "aa");
+  host.append(100);
+  host.append(0.0f);
+  host.append("x");
+  host.append("on");
+  host.finish();
+  CHECK(strcmp(host_tx, "<VWTRaa100,0,\"x\",\"on\">o_\n") == 0);
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VWTAaa>") == 1);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "\n<VARB01{x=5,on=T}>SJ\n") == 1);
+
+  x = 6;
+  set_time(100000);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VARB02{x=6}>") == 1);
+  on = false;
+  set_time(200000);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VARB03{on=F}>") == 1);
+  host_send("VWT", 'R', "ab", "0,0,\"g\"");
+  deliver(&Serial);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "<VWTAab>") == 1);
+  CHECK(!port.check_for_msgs() && count(dev_tx, "\n<VARB04{g=1.6}>=(\n") == 1);
+  return true;
+}
+
+bool test_port_group() {
+  /* Ports take turns, one message at a time, and each is polled at most once
+  per call */
+  printf("Running %s()...\n", __func__);
+  OatmealPort usb(&Serial, "Test"), link(&Serial1, "Test");
+  OatmealPortGroup group;
+  CHECK(group.add(&usb) && group.add(&link) && group.size() == 2);
+  reset_link(&Serial);
+  static char link_tx[1024] = {};
+  Serial1.capture(link_tx, sizeof(link_tx)-1);
+  Serial1.feed(nullptr, 0);
+
+  for (int i = 0; i < 3; i++) { host_send("RUN", 'R', "aa", ""); }
+  deliver(&Serial);
+  for (int i = 0; i < 3; i++) { host_send("RUN", 'R', "ab", ""); }
+  deliver(&Serial1);
+  for (int i = 0; i < 6; i++) {
+    CHECK(group.check_for_msgs() && group.msg().is_opcode("RUNR"));
+    CHECK(group.port() == (i % 2 ? &link : &usb));
+  }
+  CHECK(!group.check_for_msgs());
+
+  /* A flood of built-in requests on one port cannot hold up the caller */
+  for (int i = 0; i < 3; i++) { host_send("ECH", 'R', "ac", "1"); }
+  deliver(&Serial);
+  host_send("ECH", 'R', "ad", "2");
+  deliver(&Serial1);
+  CHECK(!group.check_for_msgs() && usb.msgs_pending());
+  CHECK(count(dev_tx, "<ECHAac1>") == 1 && count(link_tx, "<ECHAad2>") == 1);
+  CHECK(!group.check_for_msgs() && count(dev_tx, "<ECHAac1>") == 2);
+  CHECK(!group.check_for_msgs() && count(dev_tx, "<ECHAac1>") == 3);
+
+  /* Polling through the group is not a budgeted call */
+  CHECK(usb.stats.n_budget_calls == 0 && usb.stats.n_budget_hits == 0);
+  CHECK(link.stats.n_budget_calls == 0 && link.stats.n_budget_hits == 0);
+  return true;
+}
+
+/* What a stream handler has been passed */
+struct StreamSums {
+  int32_t sum = 0;        /* of the args of the frame being received */
+  int32_t committed = 0;  /* of the args of the last valid frame */
+  int n_calls = 0, n_commits = 0, n_aborts = 0;
+};
+
+/* Stream handler adding up int args, only keeping the sum once committed */
+static void sum_args(OatmealStreamEvent event, const OatmealMsgReadonly &head,
+                     OatmealArgParser *args, void *ctx) {
+  StreamSums *sums = static_cast<StreamSums*>(ctx);
+  int32_t x;
+  (void)head;
+  sums->n_calls++;
+  if (event == OatmealStreamAbort) {
+    sums->n_aborts++;
+    sums->sum = 0;
+    return;
+  }
+  while (args->parse_arg(&x)) { sums->sum += x; }
+  if (event == OatmealStreamCommit) {
+    sums->n_commits++;
+    sums->committed = sums->sum;
+    sums->sum = 0;
+  }
+}
+
+bool test_streaming() {
+  /* Frames longer than MAX_MSG_LEN are passed to a handler as they arrive */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  StreamSums sums;
+  port.set_stream_handler("SUMR", sum_args, &sums);
+  reset_link(&Serial);
+  host.start("SUM", 'R', "aa");
+  for (int32_t i = 1; i <= 100; i++) { host.append(i); }
+  host.finish();
+  CHECK(host_serial.n_tx > 2 * OatmealMsg::MAX_MSG_LEN);
+  host_send("RUN", 'R', "ab", "");
+  deliver(&Serial);
+
+  CHECK(port.check_for_msgs() && port.msg_in.is_opcode("RUNR"));
+  CHECK(sums.n_commits == 1 && sums.committed == 5050 && sums.n_aborts == 0);
+  CHECK(sums.n_calls > 2);
+  CHECK(port.stats.n_frames_streamed == 1 && port.stats.n_bad_checksums == 0);
+
+  /* A bad checksum aborts the frame, after its args were passed on */
+  host.start("SUM", 'R', "ac");
+  for (int32_t i = 1; i <= 100; i++) { host.append(-i); }
+  host.finish();
+  char *checksum = host_tx + host_serial.n_tx - 2;
+  *checksum = (*checksum == 'A') ? 'B' : 'A';
+  deliver(&Serial);
+  sums.n_calls = 0;
+  CHECK(!port.check_for_msgs());
+  CHECK(sums.n_calls > 2 && sums.n_aborts == 1 && sums.n_commits == 1);
+  CHECK(sums.sum == 0 && sums.committed == 5050);
+  CHECK(port.stats.n_streams_aborted == 1 && port.stats.n_bad_checksums == 1);
+
+  /* Short frames are streamed too, in one call */
+  host_send("SUM", 'R', "ad", "1,2");
+  deliver(&Serial);
+  sums.n_calls = 0;
+  CHECK(!port.check_for_msgs() && sums.n_calls == 1 && sums.committed == 3);
+  CHECK(port.stats.n_frames_streamed == 2);
+  return true;
+}
+
+bool test_checked_start() {
+  /* Frames sized first are only sent if the receiver can take them */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  reset_link(&Serial);
+  OatmealSizer size;
+  size.start("BIG", 'B', "aa");
+  for (int32_t i = 0; i < 20; i++) { size.append(1000000 + i); }
+  size.finish();
+  CHECK(size.length() > OatmealMsg::MAX_MSG_LEN);
+
+  CHECK(port.start("BIG", 'B', "aa", size.length()) == 0);
+  for (int32_t i = 0; i < 20; i++) { CHECK(port.append(1000000 + i) == 0); }
+  CHECK(port.finish() == 0);
+  CHECK(Serial.n_tx == 0 && port.stats.n_frames_refused == 1);
+
+  /* Frames that fit are sent as usual */
+  size = OatmealSizer();
+  size.start("SML", 'B', "ab");
+  size.append(F("ok"));
+  size.finish();
+  CHECK(port.start("SML", 'B', "ab", size.length()) == OatmealMsg::ARGS_OFFSET);
+  port.append(F("ok"));
+  port.finish();
+  CHECK(count_frames(dev_tx, "<SMLBab\"ok\">", size.length()) == 1);
+  CHECK(port.stats.n_frames_refused == 1 && port.stats.n_frames_oversized == 0);
+
+  /* Log messages too long to receive are not sent */
+  char text[OatmealMsg::MAX_MSG_LEN];
+  memset(text, 'x', sizeof(text)-1);
+  text[sizeof(text)-1] = '\0';
+  port.set_logging_on(true);
+  port.log_error(text);
+  CHECK(count(dev_tx, "<LOGB") == 0 && port.stats.n_frames_refused == 2);
+
+  /* Frames sent unchecked are sent in full, and counted */
+  port.start("BIG", 'B', "ac");
+  for (int32_t i = 0; i < 20; i++) { port.append(1000000 + i); }
+  port.finish();
+  CHECK(count_frames(dev_tx, "<BIGBac", size.length()) == 0);
+  CHECK(count(dev_tx, "<BIGBac1000000,") == 1 && port.stats.n_frames_oversized == 1);
+
+  /* Both are reported in heartbeats */
+  OatmealMsg resp;
+  resp.start("HRT", 'B', "ad");
+  resp.append_dict_start();
+  port.build_status_heartbeat(&resp, 0);
+  resp.append_dict_end();
+  resp.finish();
+  CHECK(strstr(resp.frame(), "tx_too_long=3") != nullptr);
+  CHECK(port.stats.n_frames_refused == 0 && port.stats.n_frames_oversized == 0);
+  return true;
+}
+
+bool test_logging() {
+  /* Log levels and messages can be in RAM or flash */
+  printf("Running %s()...\n", __func__);
+  OatmealPort port(&Serial, "Test");
+  reset_link(&Serial);
+  port.log("INFO", "a");
+  CHECK(count(dev_tx, "<LOGB") == 0);
+  port.set_logging_on(true);
+  port.log("INFO", "a");
+  port.log("INFO", F("b"));
+  port.log(F("WARNING"), "c");
+  port.log(F("ERROR"), F("d"));
+  port.log_debug(F("e"));
+  CHECK(count(dev_tx, "\"INFO\",\"a\">") == 1);
+  CHECK(count(dev_tx, "\"INFO\",\"b\">") == 1);
+  CHECK(count(dev_tx, "\"WARNING\",\"c\">") == 1);
+  CHECK(count(dev_tx, "\"ERROR\",\"d\">") == 1);
+  CHECK(count(dev_tx, "\"DEBUG\",\"e\">") == 1);
+  CHECK(count(dev_tx, "<LOGB") == 5);
+  return true;
+}
+
+int main() {
+  if (!test_samples()) { return EXIT_FAILURE; }
+  if (!test_time_sync()) { return EXIT_FAILURE; }
+  if (!test_echo()) { return EXIT_FAILURE; }
+  if (!test_burst()) { return EXIT_FAILURE; }
+  if (!test_budget()) { return EXIT_FAILURE; }
+  if (!test_rx_ring()) { return EXIT_FAILURE; }
+  if (!test_jobs()) { return EXIT_FAILURE; }
+  if (!test_replay()) { return EXIT_FAILURE; }
+  if (!test_vars()) { return EXIT_FAILURE; }
+  if (!test_var_watches()) { return EXIT_FAILURE; }
+  if (!test_var_updates()) { return EXIT_FAILURE; }
+  if (!test_var_update_frames()) { return EXIT_FAILURE; }
+  if (!test_port_group()) { return EXIT_FAILURE; }
+  if (!test_streaming()) { return EXIT_FAILURE; }
+  if (!test_checked_start()) { return EXIT_FAILURE; }
+  if (!test_logging()) { return EXIT_FAILURE; }
+  printf("\n  Success!\n\n");
+  return EXIT_SUCCESS;
+}